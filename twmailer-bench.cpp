@@ -0,0 +1,370 @@
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <iostream>
+#include <memory_resource>
+#include <new>
+#include <string>
+#include <vector>
+#include "twmailer-tls.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// TWMAILER-BENCH
+// Measures the allocations of request-scoped containers, the way the server
+// handles a command, under the allocation schemes it had:
+//    twmailer-bench [messages in the mailbox] [commands]
+// Every command builds what a SEND and a LIST of the server build: receiver,
+// subject, body lines, the path and subject of every message. Schemes:
+//    heap             std containers, the listing copied into every command
+//    command arena    a fresh monotonic_buffer_resource per command that
+//                     allocates its first block, the listing copied into it
+//    session buffer   one 64 KiB buffer inside every session, released
+//                     after every command, the shared listing borrowed
+//    pooled arena     ARENA-sized first block from one pool shared by all
+//                     sessions, released after every command, the listing
+//                     borrowed (the server now)
+// Prints the time and the operator new calls per command.
+//    twmailer-bench read <ip> <port> [KiB] [reads]
+// measures READ throughput end to end instead: SENDs a message of that
+// size to the user "bench" of a running server, READs it again and again
+// and DELetes it. The transport is the client's, plain or TLS from the
+// same environment (see TRANSPORT); against a server with and without
+// TWMAILER_TLS_KTLS=0 it compares userspace and kernel TLS, the server
+// logs which one a stream got.
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define BENCH_BUFFER 65536 // the arena buffer sessions had inline
+#define BENCH_ARENA 4096 // ARENA of the server
+#define BENCH_POOLED 65536 // ARENA_POOLED of the server
+#define BENCH_MESSAGES 200
+#define BENCH_COMMANDS 100000
+#define BENCH_BODY 20 // lines of the SEND
+#define BENCH_READ_KIB 16384 // size of the message READ
+#define BENCH_READS 20
+#define BENCH_LINE 79 // bytes of a body line of that message, without its terminator
+
+///////////////////////////////////////////////////////////////////////////////
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+// a connection to the server and what was received but not taken yet
+struct BenchConnection
+{
+   int fd = -1;
+   char buffer[65536];
+   size_t start = 0;
+   size_t end = 0;
+   uint64_t received = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+uint64_t allocations = 0;
+size_t checksum = 0; // keeps the work from being optimized away
+
+void *operator new(size_t size)
+{
+   allocations++;
+   void *memory = malloc(size != 0 ? size : 1);
+   if (memory == NULL)
+   {
+      throw bad_alloc();
+   }
+   return memory;
+}
+
+// the pmr resources allocate through the aligned form
+void *operator new(size_t size, align_val_t alignment)
+{
+   allocations++;
+   void *memory = aligned_alloc((size_t)alignment, (size + (size_t)alignment - 1) / (size_t)alignment * (size_t)alignment);
+   if (memory == NULL)
+   {
+      throw bad_alloc();
+   }
+   return memory;
+}
+
+void operator delete(void *memory) noexcept
+{
+   free(memory);
+}
+
+void operator delete(void *memory, size_t) noexcept
+{
+   free(memory);
+}
+
+void operator delete(void *memory, align_val_t) noexcept
+{
+   free(memory);
+}
+
+void operator delete(void *memory, size_t, align_val_t) noexcept
+{
+   free(memory);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+void command(pmr::memory_resource *arena, const vector<string> &listing, bool copy);
+void measure(const char *scheme, const vector<string> &listing, uint64_t commands, int mode);
+int benchRead(int argc, char **argv);
+bool benchRequest(BenchConnection &connection, const string &frames);
+bool benchFrame(BenchConnection &connection, string &frame, char delimiter);
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv)
+{
+   if (argc > 1 && strcmp(argv[1], "read") == 0)
+   {
+      return benchRead(argc, argv);
+   }
+   size_t messages = argc > 1 ? strtoull(argv[1], NULL, 10) : BENCH_MESSAGES;
+   uint64_t commands = argc > 2 ? strtoull(argv[2], NULL, 10) : BENCH_COMMANDS;
+   if (argc > 3 || commands == 0)
+   {
+      cerr << "Usage: " << argv[0] << " [messages in the mailbox] [commands]" << endl;
+      cerr << "       " << argv[0] << " read <ip> <port> [KiB] [reads]" << endl;
+      return EXIT_FAILURE;
+   }
+   // names as the mailbox index holds them, "<bucket>/<user>-<id>.txt"
+   vector<string> listing;
+   for (size_t i = 1; i <= messages; i++)
+   {
+      char name[64];
+      snprintf(name, sizeof(name), "0000/if23b001-%020zu.txt", i);
+      listing.emplace_back(name);
+   }
+   printf("%zu messages in the mailbox, %llu commands\n", messages, (unsigned long long)commands);
+   measure("heap", listing, commands, 0);
+   measure("command arena", listing, commands, 1);
+   measure("session buffer", listing, commands, 2);
+   measure("pooled arena", listing, commands, 3);
+   return checksum == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+void command(pmr::memory_resource *arena, const vector<string> &listing, bool copy)
+{
+   pmr::vector<pmr::string> copied(arena);
+   if (copy)
+   {
+      for (const string &name : listing)
+      {
+         copied.emplace_back(name.data(), name.size());
+      }
+   }
+   // SEND
+   pmr::string receiver("if23b002", arena);
+   pmr::string subject("Re: the protocol of the second exercise", arena);
+   pmr::vector<pmr::string> body(arena);
+   for (int i = 0; i < BENCH_BODY; i++)
+   {
+      body.emplace_back("a line of a message body that does not fit into the small string buffer");
+   }
+   checksum += receiver.size() + subject.size() + body.size();
+   // LIST: a path and a subject per message
+   pmr::vector<pmr::string> subjects(arena);
+   for (size_t i = 0; i < listing.size(); i++)
+   {
+      pmr::string filepath("./spool/.users/af/d0/if23b001/", arena);
+      filepath += copy ? string_view(copied[i].data(), copied[i].size()) : string_view(listing[i]);
+      checksum += filepath.size();
+      subjects.emplace_back("the subject line of a message in the mailbox");
+   }
+   checksum += subjects.size();
+}
+
+// mode 0 = heap, 1 = command arena, 2 = session buffer, 3 = pooled arena
+void measure(const char *scheme, const vector<string> &listing, uint64_t commands, int mode)
+{
+   alignas(max_align_t) static char buffer[BENCH_BUFFER];
+   static pmr::synchronized_pool_resource pool(pmr::pool_options{0, BENCH_POOLED});
+   pmr::monotonic_buffer_resource session(buffer, sizeof(buffer));
+   pmr::monotonic_buffer_resource pooled(BENCH_ARENA, &pool);
+   uint64_t before = allocations;
+   auto started = chrono::steady_clock::now();
+   for (uint64_t i = 0; i < commands; i++)
+   {
+      if (mode == 0)
+      {
+         command(pmr::new_delete_resource(), listing, true);
+      }
+      else if (mode == 1)
+      {
+         pmr::monotonic_buffer_resource arena(BENCH_BUFFER);
+         command(&arena, listing, true);
+      }
+      else if (mode == 2)
+      {
+         command(&session, listing, false);
+         session.release();
+      }
+      else
+      {
+         command(&pooled, listing, false);
+         pooled.release();
+      }
+   }
+   double elapsed = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+   printf("%-15s %9.0f ns/command %9.1f allocations/command\n", scheme, elapsed * 1e9 / commands,
+          (double)(allocations - before) / commands);
+}
+
+int benchRead(int argc, char **argv)
+{
+   size_t kilobytes = argc > 4 ? strtoull(argv[4], NULL, 10) : BENCH_READ_KIB;
+   uint64_t reads = argc > 5 ? strtoull(argv[5], NULL, 10) : BENCH_READS;
+   if (argc < 4 || argc > 6 || kilobytes == 0 || reads == 0)
+   {
+      cerr << "Usage: " << argv[0] << " read <ip> <port> [KiB] [reads]" << endl;
+      return EXIT_FAILURE;
+   }
+   signal(SIGPIPE, SIG_IGN);
+   static BenchConnection connection;
+   string target = string(argv[2]) + ":" + argv[3];
+   connection.fd = netConnect(target);
+   if (connection.fd == -1)
+   {
+      perror(target.c_str());
+      return EXIT_FAILURE;
+   }
+   string transport = "plain";
+   if (tlsRequested())
+   {
+      SSL_CTX *context = tlsClientContext();
+      if (context == nullptr || !tlsConnect(context, connection.fd, argv[2]))
+      {
+         return EXIT_FAILURE;
+      }
+      SSL *ssl = tlsStream(connection.fd);
+      transport = string(SSL_get_version(ssl)) + " " + SSL_get_cipher_name(ssl) + ", kernel TLS receive "
+                  + (BIO_get_ktls_recv(SSL_get_rbio(ssl)) ? "on" : "off");
+   }
+   string frame;
+   do
+   {
+      if (!benchFrame(connection, frame, '\n'))
+      {
+         cerr << target << ": no welcome" << endl;
+         return EXIT_FAILURE;
+      }
+   }
+   while (frame.find("commands") == string::npos);
+
+   // the message, the newest of the mailbox, is the one LIST counts last
+   const char start[] = "login\0bench\0bench\0send\0bench\0bench read"; // its '\0' ends the subject
+   string request(start, sizeof(start));
+   string line(BENCH_LINE, 'x');
+   for (size_t size = 0; size < kilobytes * 1024; size += BENCH_LINE + 1)
+   {
+      request.append(line.c_str(), BENCH_LINE + 1);
+   }
+   const char end[] = ".\0list";
+   request.append(end, sizeof(end));
+   string login;
+   string sent;
+   string count;
+   if (!benchRequest(connection, request) || !benchFrame(connection, login, '\0')
+       || !benchFrame(connection, sent, '\0') || !benchFrame(connection, count, '\0'))
+   {
+      cerr << target << ": connection lost" << endl;
+      return EXIT_FAILURE;
+   }
+   if (login != "OK" || sent != "OK")
+   {
+      cerr << "LOGIN " << login << ", SEND " << sent << endl;
+      return EXIT_FAILURE;
+   }
+   unsigned long long number = strtoull(count.c_str(), NULL, 10);
+   for (unsigned long long i = 0; i < number; i++)
+   {
+      benchFrame(connection, frame, '\0');
+   }
+
+   string read = "read" + string(1, '\0') + to_string(number) + string(1, '\0');
+   uint64_t before = connection.received;
+   auto started = chrono::steady_clock::now();
+   for (uint64_t i = 0; i < reads; i++)
+   {
+      if (!benchRequest(connection, read) || !benchFrame(connection, frame, '\0') || frame != "OK")
+      {
+         cerr << "READ " << number << ": " << frame << endl;
+         return EXIT_FAILURE;
+      }
+      // receiver and subject, then the body up to its "." line
+      int frames = 0;
+      do
+      {
+         if (!benchFrame(connection, frame, '\0'))
+         {
+            cerr << target << ": connection lost" << endl;
+            return EXIT_FAILURE;
+         }
+         frames++;
+      }
+      while (frames < 3 || frame != ".");
+   }
+   double elapsed = chrono::duration<double>(chrono::steady_clock::now() - started).count();
+   uint64_t bytes = connection.received - before;
+
+   benchRequest(connection, "del" + string(1, '\0') + to_string(number) + string(1, '\0') + "quit" + string(1, '\0'));
+   benchFrame(connection, frame, '\0');
+   printf("READ of %zu KiB, %s: %llu reads in %.3f s, %.1f MB/s, %.2f ms/read\n", kilobytes, transport.c_str(),
+          (unsigned long long)reads, elapsed, bytes / elapsed / 1e6, elapsed * 1e3 / reads);
+   return EXIT_SUCCESS;
+}
+
+bool benchRequest(BenchConnection &connection, const string &frames)
+{
+   size_t sent = 0;
+   while (sent < frames.size())
+   {
+      ssize_t size = netSend(connection.fd, frames.data() + sent, frames.size() - sent);
+      if (size <= 0)
+      {
+         return false;
+      }
+      sent += size;
+   }
+   return true;
+}
+
+// the next frame up to delimiter; only its start is kept, enough for a
+// reply word, a count or the "." line
+bool benchFrame(BenchConnection &connection, string &frame, char delimiter)
+{
+   frame.clear();
+   for (;;)
+   {
+      if (connection.start == connection.end)
+      {
+         ssize_t size = netRecv(connection.fd, connection.buffer, sizeof(connection.buffer));
+         if (size <= 0)
+         {
+            return false;
+         }
+         connection.start = 0;
+         connection.end = size;
+         connection.received += size;
+      }
+      char *begin = connection.buffer + connection.start;
+      char *found = (char *)memchr(begin, delimiter, connection.end - connection.start);
+      size_t length = (found != NULL ? found : connection.buffer + connection.end) - begin;
+      if (frame.size() < 64)
+      {
+         frame.append(begin, min(length, 64 - frame.size()));
+      }
+      connection.start += found != NULL ? length + 1 : length;
+      if (found != NULL)
+      {
+         return true;
+      }
+   }
+}
@@ -0,0 +1,204 @@
+#ifndef TWMAILER_CACHE_H
+#define TWMAILER_CACHE_H
+
+#include <sys/stat.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// MAILBOX CACHE
+// The client keeps the listing and the messages it read on disk, one
+// directory per server and user:
+//    <cache>/<ip>:<port>/<user>/list       "<version>\n" then "<id> <subject>\n"
+//    <cache>/<ip>:<port>/<user>/<id>       the READ frames, one per line
+// <cache> is TWMAILER_CACHE_DIR, $XDG_CACHE_HOME/twmailer or
+// ~/.cache/twmailer; an empty TWMAILER_CACHE_DIR turns the cache off.
+// A message never changes once stored and its id is never reused, so a body
+// stays valid as long as its id is in the listing. Legacy names all have id
+// 0, their bodies are never cached. The listing is checked
+// with "LIST SINCE <last id>": an unchanged mailbox version means it is
+// current, a total that grew by exactly the new messages means only
+// messages were added and the delta is appended, anything else means
+// something was deleted and the listing is fetched again.
+
+struct CachedList
+{
+   uint64_t version = 0;
+   std::vector<uint64_t> ids; // in message number order
+   std::vector<std::string> subjects;
+};
+
+class MailCache
+{
+ public:
+   // false when the cache is off or its directory can not be made
+   bool open(const std::string &server, const std::string &user)
+   {
+      directory.clear();
+      std::string root;
+      const char *configured = getenv("TWMAILER_CACHE_DIR");
+      if (configured != NULL)
+      {
+         root = configured;
+      }
+      else if (getenv("XDG_CACHE_HOME") != NULL && getenv("XDG_CACHE_HOME")[0] != '\0')
+      {
+         root = std::string(getenv("XDG_CACHE_HOME")) + "/twmailer";
+      }
+      else if (getenv("HOME") != NULL)
+      {
+         root = std::string(getenv("HOME")) + "/.cache/twmailer";
+      }
+      if (root.empty() || user.empty() || user[0] == '.' || user.find('/') != std::string::npos)
+      {
+         return false;
+      }
+      std::string path = root + "/" + server + "/" + user;
+      // the messages are private, so are the directories
+      for (size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1))
+      {
+         if (mkdir(path.substr(0, slash).c_str(), 0700) == -1 && errno != EEXIST)
+         {
+            return false;
+         }
+         if (slash == std::string::npos)
+         {
+            break;
+         }
+      }
+      directory = path + "/";
+      return true;
+   }
+
+   bool loadList(CachedList &list) const
+   {
+      FILE *file = fopen((directory + "list").c_str(), "r");
+      if (file == NULL)
+      {
+         return false;
+      }
+      list = CachedList();
+      char line[1024];
+      unsigned long long version = 0;
+      bool valid = fgets(line, sizeof(line), file) != NULL && sscanf(line, "%llu", &version) == 1;
+      list.version = version;
+      while (valid && fgets(line, sizeof(line), file) != NULL)
+      {
+         char *subject = NULL;
+         list.ids.push_back(strtoull(line, &subject, 10));
+         subject += *subject == ' ' ? 1 : 0;
+         subject[strcspn(subject, "\n")] = '\0';
+         list.subjects.push_back(subject);
+      }
+      fclose(file);
+      return valid;
+   }
+
+   bool storeList(const CachedList &list) const
+   {
+      std::string text = std::to_string(list.version) + "\n";
+      for (size_t i = 0; i < list.ids.size(); i++)
+      {
+         text += std::to_string(list.ids[i]) + " " + list.subjects[i] + "\n";
+      }
+      return store("list", text);
+   }
+
+   bool loadMessage(uint64_t id, std::vector<std::string> &frames) const
+   {
+      if (id == 0)
+      {
+         return false;
+      }
+      FILE *file = fopen((directory + std::to_string(id)).c_str(), "r");
+      if (file == NULL)
+      {
+         return false;
+      }
+      frames.clear();
+      char *line = NULL;
+      size_t capacity = 0;
+      ssize_t length;
+      while ((length = getline(&line, &capacity, file)) > 0)
+      {
+         frames.emplace_back(line, line[length - 1] == '\n' ? length - 1 : length);
+      }
+      free(line);
+      fclose(file);
+      return frames.size() >= 3 && frames.back() == ".";
+   }
+
+   bool storeMessage(uint64_t id, const std::vector<std::string> &frames) const
+   {
+      if (id == 0)
+      {
+         return false;
+      }
+      std::string text;
+      for (const std::string &frame : frames)
+      {
+         text += frame + "\n";
+      }
+      return store(std::to_string(id), text);
+   }
+
+   // the bodies of messages no longer in list
+   void prune(const CachedList &list) const
+   {
+      DIR *entries = opendir(directory.c_str());
+      if (entries == NULL)
+      {
+         return;
+      }
+      std::unordered_set<uint64_t> kept(list.ids.begin(), list.ids.end());
+      struct dirent *entry;
+      while ((entry = readdir(entries)) != NULL)
+      {
+         char *end = NULL;
+         uint64_t id = strtoull(entry->d_name, &end, 10);
+         if (isdigit((unsigned char)entry->d_name[0]) && *end == '\0' && kept.count(id) == 0)
+         {
+            unlink((directory + entry->d_name).c_str());
+         }
+      }
+      closedir(entries);
+   }
+
+ private:
+   // written aside and renamed, a reader sees the old file or the new one
+   bool store(const std::string &name, const std::string &text) const
+   {
+      if (directory.empty())
+      {
+         return false;
+      }
+      std::string temporary = directory + "." + name + "." + std::to_string((long)getpid());
+      int file = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+      if (file == -1)
+      {
+         return false;
+      }
+      bool written = write(file, text.data(), text.size()) == (ssize_t)text.size();
+      written = close(file) == 0 && written;
+      if (!written || rename(temporary.c_str(), (directory + name).c_str()) == -1)
+      {
+         unlink(temporary.c_str());
+         return false;
+      }
+      return true;
+   }
+
+   std::string directory; // with its trailing '/', empty when closed
+};
+
+#endif
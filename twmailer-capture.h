@@ -0,0 +1,319 @@
+#ifndef TWMAILER_CAPTURE_H
+#define TWMAILER_CAPTURE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <mutex>
+#include <random>
+#include <string>
+#include <string_view>
+#include "twmailer-protocol.h"
+#include "twmailer-stats.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// TRAFFIC CAPTURE
+// With TWMAILER_CAPTURE_FILE set the server records the request frames of
+// every session, twmailer-replay plays them back. The file starts with
+// CAPTURE_MAGIC, then one record per event:
+//    <type> <varint session> <varint us since the previous record>
+//    [<varint length> <frame>]            (frames only)
+// Frames are anonymized before they are written. What the protocol needs
+// to replay stays: the verbs, the numbers where a command expects one (the
+// READ and DEL number, LIST limit, offset and SINCE id, IDLE seconds and
+// last id), "since", the "." that ends SEND and IMPORT and the "*" of
+// EXPORT. Every other word becomes a word of the same length derived from a
+// keyed hash, a number in a body or subject as much as LOGIN name and
+// password, which never stay. The key is random per capture and never
+// stored, so a user keeps one pseudonym throughout the file and the sizes
+// stay as they were, but names, subjects and bodies can not be read back.
+// Replies are not recorded.
+
+#define CAPTURE_MAGIC "TWCAP1\n" // 8 bytes with its '\0'
+#define CAPTURE_BUFFER (1 << 20)
+
+enum CaptureType : uint8_t
+{
+   CaptureOpen = 0,
+   CaptureCommand, // a frame read where the verb of a command was expected
+   CaptureArgument,
+   CaptureClose
+};
+
+// the command whose frames a session sends, to tell what an argument is
+struct CaptureSession
+{
+   uint64_t number = 0; // in the capture, 0 = none
+   Command command = Command::Unknown;
+   int argument = 0; // frames since the verb
+};
+
+struct CaptureRecord
+{
+   CaptureType type;
+   uint64_t session;
+   uint64_t time; // us since the capture started
+   std::string frame;
+};
+
+inline std::atomic<int> captureEnabled{0};
+inline std::mutex captureMutex;
+inline FILE *captureOutput = NULL;
+inline uint64_t captureKey = 0;
+inline uint64_t captureLast = 0; // monotonicNanos() of the previous record
+inline std::atomic<uint64_t> captureSessions{0};
+
+///////////////////////////////////////////////////////////////////////////////
+
+inline void captureVarint(std::string &out, uint64_t value)
+{
+   while (value >= 0x80)
+   {
+      out += (char)(value | 0x80);
+      value >>= 7;
+   }
+   out += (char)value;
+}
+
+inline bool captureReadVarint(FILE *file, uint64_t &value)
+{
+   value = 0;
+   for (int shift = 0; shift < 64; shift += 7)
+   {
+      int c = getc(file);
+      if (c == EOF)
+      {
+         return false;
+      }
+      value |= (uint64_t)(c & 0x7f) << shift;
+      if ((c & 0x80) == 0)
+      {
+         return true;
+      }
+   }
+   return false;
+}
+
+// the pseudonym of word: same length, lowercase letters
+inline void capturePseudonym(std::string &out, std::string_view word)
+{
+   uint64_t hash = 14695981039346656037ull ^ captureKey;
+   for (char c : word)
+   {
+      hash = (hash ^ (unsigned char)c) * 1099511628211ull;
+   }
+   for (size_t i = 0; i < word.size(); i++)
+   {
+      hash ^= hash >> 29;
+      hash *= 0xbf58476d1ce4e5b9ull;
+      out += (char)('a' + (hash >> 32) % 26);
+   }
+}
+
+inline bool captureNumber(std::string_view word)
+{
+   if (word.empty())
+   {
+      return false;
+   }
+   for (char c : word)
+   {
+      if (c < '0' || c > '9')
+      {
+         return false;
+      }
+   }
+   return true;
+}
+
+// a word of the line that holds the verb, position 0 being the verb
+inline bool captureKeepsWord(Command command, size_t position, std::string_view word)
+{
+   switch (command)
+   {
+      case Command::Unknown:
+         return false;
+      case Command::List:
+         // LIST <limit> [<offset>], LIST SINCE <id> [<limit>]
+         return position == 0 || (position <= 3 && captureNumber(word))
+                || (position == 1 && equalsIgnoreCase(word, "since"));
+      case Command::Idle:
+         // IDLE [<seconds> [<last id>]]
+         return position == 0 || (position <= 2 && captureNumber(word));
+      default:
+         return position == 0;
+   }
+}
+
+// an argument frame, which follows the verb on lines of its own
+inline bool captureKeepsArgument(const CaptureSession &session, std::string_view frame)
+{
+   switch (session.command)
+   {
+      case Command::Read:
+      case Command::Del:
+         return session.argument == 1 && captureNumber(frame);
+      case Command::Send:
+      case Command::Import:
+         return frame == ".";
+      case Command::Export:
+         return session.argument == 1 && frame == "*";
+      default:
+         return false; // LOGIN among them
+   }
+}
+
+// command tells whether frame was read where a verb was expected
+inline std::string captureAnonymize(CaptureSession &session, bool command, std::string_view frame)
+{
+   if (command)
+   {
+      session.command = parseCommand(frame).command;
+      session.argument = 0;
+   }
+   else
+   {
+      session.argument++;
+      if (captureKeepsArgument(session, frame))
+      {
+         return std::string(frame);
+      }
+   }
+   std::string out;
+   out.reserve(frame.size());
+   size_t position = 0;
+   while (!frame.empty())
+   {
+      size_t space = frame.find(' ');
+      std::string_view word = frame.substr(0, space);
+      if (command && captureKeepsWord(session.command, position, word))
+      {
+         out += word;
+      }
+      else
+      {
+         capturePseudonym(out, word);
+      }
+      position++;
+      if (space == std::string_view::npos)
+      {
+         break;
+      }
+      out += ' ';
+      frame.remove_prefix(space + 1);
+   }
+   return out;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+inline bool captureStart(const char *filename)
+{
+   captureOutput = fopen(filename, "we");
+   if (captureOutput == NULL)
+   {
+      return false;
+   }
+   setvbuf(captureOutput, NULL, _IOFBF, CAPTURE_BUFFER);
+   fwrite(CAPTURE_MAGIC, 1, sizeof(CAPTURE_MAGIC), captureOutput);
+   std::random_device random;
+   captureKey = ((uint64_t)random() << 32) | random();
+   captureLast = monotonicNanos();
+   captureEnabled = 1;
+   return true;
+}
+
+inline void captureWrite(CaptureType type, uint64_t session, std::string_view frame)
+{
+   std::string record(1, (char)type);
+   captureVarint(record, session);
+   std::lock_guard<std::mutex> lock(captureMutex);
+   if (captureOutput == NULL)
+   {
+      return;
+   }
+   uint64_t now = monotonicNanos();
+   captureVarint(record, (now - captureLast) / 1000);
+   captureLast += (now - captureLast) / 1000 * 1000; // the rest counts for the next record
+   if (type == CaptureCommand || type == CaptureArgument)
+   {
+      captureVarint(record, frame.size());
+      record += frame;
+   }
+   fwrite(record.data(), 1, record.size(), captureOutput);
+   if (type == CaptureClose)
+   {
+      fflush(captureOutput); // a capture cut short keeps its finished sessions
+   }
+}
+
+// a new session, its number in the capture
+inline uint64_t captureOpen()
+{
+   uint64_t session = captureSessions.fetch_add(1, std::memory_order_relaxed) + 1;
+   captureWrite(CaptureOpen, session, std::string_view());
+   return session;
+}
+
+inline void captureFrame(CaptureSession &session, bool command, std::string_view frame)
+{
+   captureWrite(command ? CaptureCommand : CaptureArgument, session.number, captureAnonymize(session, command, frame));
+}
+
+inline void captureClose(const CaptureSession &session)
+{
+   captureWrite(CaptureClose, session.number, std::string_view());
+}
+
+inline void captureStop()
+{
+   std::lock_guard<std::mutex> lock(captureMutex);
+   if (captureOutput != NULL)
+   {
+      fclose(captureOutput);
+      captureOutput = NULL;
+   }
+   captureEnabled = 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// false at the end of the file or on a damaged record; clock carries the
+// time of the previous record
+inline bool captureRead(FILE *file, CaptureRecord &record, uint64_t &clock)
+{
+   int type = getc(file);
+   uint64_t delta = 0;
+   if (type == EOF || type > CaptureClose || !captureReadVarint(file, record.session)
+       || !captureReadVarint(file, delta))
+   {
+      return false;
+   }
+   record.type = (CaptureType)type;
+   clock += delta;
+   record.time = clock;
+   record.frame.clear();
+   if (record.type == CaptureCommand || record.type == CaptureArgument)
+   {
+      uint64_t length;
+      if (!captureReadVarint(file, length) || length > (1 << 20))
+      {
+         return false;
+      }
+      record.frame.resize(length);
+      if (length != 0 && fread(&record.frame[0], 1, length, file) != length)
+      {
+         return false;
+      }
+   }
+   return true;
+}
+
+inline bool captureCheck(FILE *file)
+{
+   char magic[sizeof(CAPTURE_MAGIC)];
+   return fread(magic, 1, sizeof(magic), file) == sizeof(magic) && memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) == 0;
+}
+
+#endif
@@ -1,5 +1,6 @@
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
@@ -8,14 +9,21 @@
 #include <string.h>
 #include <ctype.h>
 #include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
 #include <termios.h>
+#include "twmailer-cache.h"
+#include "twmailer-protocol.h"
+#include "twmailer-tls.h"
 
 ///////////////////////////////////////////////////////////////////////////////
 
 #define BUF 1024
 #define PORT 6543
 #define IP "127.0.0.1"
-#define LEN 6
+#define BATCH_BYTES 32768 // request bytes in flight in batch mode, well below the socket buffers
 
 ///////////////////////////////////////////////////////////////////////////////
 
@@ -24,6 +32,18 @@ using namespace std;
 ///////////////////////////////////////////////////////////////////////////////
 
 string username = "test";
+string loginUser; // name of the LOGIN awaiting its reply
+// output of the running EXPORT, "-" = stdout, *.gz is compressed with gzip
+string exportFile;
+
+// receive state, replies arrive coalesced once requests are pipelined
+char pending[BUF * 4];
+size_t pendingStart = 0;
+size_t pendingEnd = 0;
+
+// listings and messages already read, see twmailer-cache.h
+MailCache cache;
+string cacheServer; // "<ip>:<port>"
 
 ///////////////////////////////////////////////////////////////////////////////
 
@@ -32,11 +52,36 @@ void inputSend(int create_socket,char* buffer, int size);
 void inputRead(int create_socket,char* buffer, int size);
 void inputDelete(int create_socket,char* buffer, int size);
 void inputLogin(int create_socket,char* buffer, int size);
+void inputImport(int create_socket,char* buffer, int size);
+bool appendArchive(vector<string>& frames, const char* filename);
+void inputExport(int create_socket,char* buffer, int size);
+void inputSearch(int create_socket,char* buffer, int size);
+void searchReceive(int create_socket, char* buffer, int size);
+void idleReceive(int create_socket, char* buffer, int size);
+long long exportReceive(int create_socket, char* buffer, const string& filename);
+bool receiveArchive(int create_socket, char* buffer, const string& filename, long long* total);
+void receiveBytes(int create_socket, char* data, size_t length);
+FILE* openOutput(const string& filename, pid_t* compressor);
+bool closeOutput(FILE* output, pid_t compressor);
 char* receive(int create_socket, char* buffer, int size);
+char* receiveFrame(int create_socket, char* buffer, char delimiter);
+void receiveWelcome(int create_socket, char* buffer, bool print);
+void sendLine(int create_socket, const char* line);
+void sendFrames(int create_socket, string& frames);
 void listReceive(int create_socket, char* buffer, int size);
+void listRangeReceive(int create_socket, char* buffer, int size);
 void readReceive(int create_socket, char* buffer, int size);
+bool readFrames(int create_socket, char* buffer, int size, vector<string>& message);
+void printMessage(const vector<string>& message);
+bool cacheRefresh(int create_socket, char* buffer, int size, CachedList& list);
+unsigned long long receiveDelta(int create_socket, char* buffer, int size, CachedList& delta);
+void cachedList(int create_socket, char* buffer, int size);
+void cachedRead(int create_socket, char* buffer, int size);
+void statsReceive(int create_socket, char* buffer, int size);
+bool refused(const char* reply);
 int getch();
 const char* getpass();
+int runBatch(int create_socket, FILE* script);
 
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -47,7 +92,7 @@ int main(int argc, char **argv)
    char buffer[BUF];
    struct sockaddr_in address;
    int isQuit;
-   char commands[LEN][LEN] = {"quit","send", "list", "read", "del", "login"};
+   const char* batchFile = NULL;
 
    ////////////////////////////////////////////////////////////////////////////
    // CREATE A SOCKET
@@ -81,6 +126,15 @@ int main(int argc, char **argv)
       address.sin_port = htons(atoi(argv[2]));
 
    }
+   cacheServer = string(inet_ntoa(address.sin_addr)) + ":" + to_string(ntohs(address.sin_port));
+
+   ////////////////////////////////////////////////////////////////////////////
+   // BATCH MODE
+   // twmailer-client <ip> <port> --batch [file]   (no file or "-" = stdin)
+   if (argc >= 4 && strcmp(argv[3], "--batch") == 0)
+   {
+      batchFile = argc >= 5 ? argv[4] : "-";
+   }
 
    ////////////////////////////////////////////////////////////////////////////
    // CREATE A CONNECTION
@@ -94,6 +148,32 @@ int main(int argc, char **argv)
       return EXIT_FAILURE;
    }
 
+   ////////////////////////////////////////////////////////////////////////////
+   // TLS
+   // TWMAILER_TLS=1 or TWMAILER_TLS_CA, see twmailer-tls.h
+   if (tlsRequested())
+   {
+      SSL_CTX* tlsContext = tlsClientContext();
+      if (tlsContext == NULL || !tlsConnect(tlsContext, create_socket, inet_ntoa(address.sin_addr)))
+      {
+         return EXIT_FAILURE;
+      }
+   }
+
+   if (batchFile != NULL)
+   {
+      FILE* script = strcmp(batchFile, "-") == 0 ? stdin : fopen(batchFile, "r");
+      if (script == NULL)
+      {
+         perror("open batch file");
+         return EXIT_FAILURE;
+      }
+      int result = runBatch(create_socket, script);
+      tlsClose(create_socket);
+      close(create_socket);
+      return result;
+   }
+
    // ignore return value of printf
    printf("Connection with server (%s) at port (%d) established\n",
           inet_ntoa(address.sin_addr), ntohs(address.sin_port));
@@ -101,57 +181,40 @@ int main(int argc, char **argv)
    ////////////////////////////////////////////////////////////////////////////
    // RECEIVE DATA
    // https://man7.org/linux/man-pages/man2/recv.2.html
-   int size = recv(create_socket, buffer, BUF - 1, 0);
-   if (size == -1)
-   {
-      perror("recv error");
-   }
-   else if (size == 0)
+   int size = 0;
+   try
    {
-      printf("Server closed remote socket\n"); // ignore error
+      receiveWelcome(create_socket, buffer, true);
    }
-   else
+   catch (const invalid_argument& except)
    {
-      buffer[size] = '\0';
-      printf("%s", buffer); // ignore error
+      cerr << except.what() << endl;
+      close(create_socket);
+      return EXIT_FAILURE;
    }
 
    do
    {
       int isValid = 0;
       int isAuthorised = 0;
-      int command = -1;
+      Command command = Command::Unknown;
       if(username != "")   //user is definied and that means authorized
       {
-         cout << "Valid Commands: QUIT, SEND, LIST, READ, DEL" << endl;
+         cout << "Valid Commands: QUIT, SEND, LIST, READ, DEL, SEARCH, IDLE, STATS, USAGE, IMPORT, EXPORT" << endl;
       }
       else                 //user is not logged in
       {
          cout << "Valid Commands: QUIT, LOGIN" << endl;
       }
-      strcpy(buffer,input(buffer, BUF));
-      char str[1024] = "";
-      strcpy(str, buffer);
-      int len =strlen(str);
-      for(int i = 0; i < len; i++)
-      {
-         str[i] = tolower(str[i]);
-      }
-      isQuit = strcmp(str, "quit") == 0;
-      for(int i = 0; i < LEN; i++)
-      
-      {
-         if(isValid != 1)
-         {
-            isValid = strcmp(str, commands[i]) == 0;
-            command = i;
-         }
-      }
-      if(username != ""  && command < 5)
+      input(buffer, BUF);
+      command = parseCommand(buffer).command;
+      isQuit = command == Command::Quit;
+      isValid = command != Command::Unknown;
+      if(username != ""  && command != Command::Login)
       {
          isAuthorised = 1;
       }
-      else if(username == "" && (command == 5 || command == 0))
+      else if(username == "" && (command == Command::Login || command == Command::Quit))
       {
          isAuthorised = 1;
       }
@@ -162,9 +225,30 @@ int main(int argc, char **argv)
       // the error of send, but still the count of bytes sent
       if(isValid)
       {
-         if(isAuthorised)
+         // a plain LIST and READ are answered from the cache where it is current
+         bool cacheable = command == Command::Read || (command == Command::List && parseCommand(buffer).arguments.empty());
+         if(isAuthorised && cacheable && cache.open(cacheServer, username))
          {
-            if ((send(create_socket, buffer, size + 1, 0)) == -1) 
+            try
+            {
+               if (command == Command::List)
+               {
+                  cachedList(create_socket, buffer, size);
+               }
+               else
+               {
+                  cachedRead(create_socket, buffer, size);
+               }
+            }
+            catch (const invalid_argument& except)
+            {
+               cerr << except.what() << endl;
+               break;
+            }
+         }
+         else if(isAuthorised)
+         {
+            if ((netSend(create_socket, buffer, strlen(buffer) + 1)) == -1) 
             {
                   // in case the server is gone offline we will still not enter
                   // this part of code: see docs: https://linux.die.net/man/3/send
@@ -182,22 +266,37 @@ int main(int argc, char **argv)
             {
                switch(command)
                {
-                  case 0:
+                  case Command::Quit:
                      break;
-                  case 1:
+                  case Command::Send:
                      inputSend(create_socket, buffer, size);
                      break;
-                  case 2:
+                  case Command::List:
                      break;
-                  case 3:
+                  case Command::Read:
                      inputRead(create_socket, buffer, size);
                      break;
-                  case 4:
+                  case Command::Del:
                      inputDelete(create_socket, buffer, size);
                      break;
-                  case 5:
+                  case Command::Login:
                      inputLogin(create_socket, buffer, size);
                      break;
+                  case Command::Stats:
+                     break;
+                  case Command::Usage:
+                     break;
+                  case Command::Import:
+                     inputImport(create_socket, buffer, size);
+                     break;
+                  case Command::Export:
+                     inputExport(create_socket, buffer, size);
+                     break;
+                  case Command::Search:
+                     inputSearch(create_socket, buffer, size);
+                     break;
+                  case Command::Idle:
+                     break;
                   default:
                      throw invalid_argument("Unknown Error");
                      break;
@@ -226,26 +325,57 @@ int main(int argc, char **argv)
                {
                   switch(command)
                   {
-                     case 0:
+                     case Command::Quit:
                         break;
-                     case 1:
-                        strcpy(buffer, receive(create_socket, buffer, size));
-                        printf("<< %s\n", buffer); // ignore error
+                     case Command::Send:
+                        printf("<< %s\n", receive(create_socket, buffer, size)); // ignore error
                         break;
-                     case 2:
-                        listReceive(create_socket, buffer, size);
+                     case Command::List:
+                        // "list <limit> [offset]" and "list since <id>" answer with ids
+                        if (!parseCommand(buffer).arguments.empty())
+                        {
+                           listRangeReceive(create_socket, buffer, size);
+                        }
+                        else
+                        {
+                           listReceive(create_socket, buffer, size);
+                        }
                         break;
-                     case 3:
+                     case Command::Read:
                         readReceive(create_socket, buffer, size);
                         break;
-                     case 4:
-                        strcpy(buffer, receive(create_socket, buffer, size));
-                        printf("<< %s\n", buffer); // ignore error
+                     case Command::Del:
+                        printf("<< %s\n", receive(create_socket, buffer, size)); // ignore error
                         break;
-                     case 5:
-                        strcpy(buffer, receive(create_socket, buffer, size));;
-                        printf("<< %s\n", buffer); // ignore error
+                     case Command::Login:
+                     {
+                        const char* reply = receive(create_socket, buffer, size);
+                        printf("<< %s\n", reply); // ignore error
+                        if (strcmp(reply, "OK") == 0)
+                        {
+                           username = loginUser;
+                        }
                         break;
+                     }
+                     case Command::Stats:
+                     case Command::Usage:
+                        statsReceive(create_socket, buffer, size);
+                        break;
+                     case Command::Import:
+                        printf("<< %s\n", receive(create_socket, buffer, size)); // ignore error
+                        break;
+                     case Command::Search:
+                        searchReceive(create_socket, buffer, size);
+                        break;
+                     case Command::Idle:
+                        idleReceive(create_socket, buffer, size);
+                        break;
+                     case Command::Export:
+                     {
+                        long long written = exportReceive(create_socket, buffer, exportFile);
+                        fprintf(stderr, "<< OK, %lld bytes written to %s\n", written, exportFile.c_str());
+                        break;
+                     }
                      default:
                         throw invalid_argument("Unknown Error");
                         break;
@@ -262,23 +392,43 @@ int main(int argc, char **argv)
          {
             switch(command)
             {
-               case 0:
+               case Command::Quit:
                   break;
-               case 1:
+               case Command::Send:
                   cerr << "Unauthorised Command - Only authenticated Users can use this - Login in to authenicate" << endl;
                   break;
-               case 2:
+               case Command::List:
                   cerr << "Unauthorised Command - Only authenticated Users can use this - Login in to authenicate" << endl;
                   break;
-               case 3:
+               case Command::Read:
                   cerr << "Unauthorised Command - Only authenticated Users can use this - Login in to authenicate" << endl;
                   break;
-               case 4:
+               case Command::Del:
                   cerr << "Unauthorised Command - Only authenticated Users can use this - Login in to authenicate" << endl;
                   break;
-               case 5:
+               case Command::Login:
                      cerr << "Already logged in" << endl;
                   break;
+               case Command::Stats:
+                  cerr << "Unauthorised Command - Only authenticated Users can use this - Login in to authenicate" << endl;
+                  break;
+               case Command::Usage:
+                  cerr << "Unauthorised Command - Only authenticated Users can use this - Login in to authenicate" << endl;
+                  break;
+               case Command::Import:
+                  cerr << "Unauthorised Command - Only authenticated Users can use this - Login in to authenicate" << endl;
+                  break;
+               case Command::Export:
+                  cerr << "Unauthorised Command - Only authenticated Users can use this - Login in to authenicate" << endl;
+                  break;
+               case Command::Search:
+                  cerr << "Unauthorised Command - Only authenticated Users can use this - Login in to authenicate" << endl;
+                  break;
+               case Command::Idle:
+                  cerr << "Unauthorised Command - Only authenticated Users can use this - Login in to authenicate" << endl;
+                  break;
+               default:
+                  break;
             }
          }
       }
@@ -293,6 +443,7 @@ int main(int argc, char **argv)
    // CLOSES THE DESCRIPTOR
    if (create_socket != -1)
    {
+      tlsClose(create_socket);
       if (shutdown(create_socket, SHUT_RDWR) == -1)
       {
          // invalid in case the server is gone already
@@ -334,113 +485,565 @@ void inputSend(int create_socket,char* buffer, int size)
    cout << "Sender: ";
    cout << username << endl;
    cout << "Receiver: ";
-   strcpy(buffer,input(buffer, BUF));
-   if ((send(create_socket, buffer, size + 1, 0)) == -1) 
-   {
-      throw invalid_argument("send error");
-   }
+   input(buffer, BUF);
+   sendLine(create_socket, buffer);
    cout << "Subject (max. 80 chars): ";
-   strcpy(buffer,input(buffer, 81));
-   if ((send(create_socket, buffer, size + 1, 0)) == -1) 
-   {
-      throw invalid_argument("send error");
-   }
+   input(buffer, 81);
+   sendLine(create_socket, buffer);
    cout << "Message:" << endl;
    while(strcmp(buffer, ".") != 0) 
    {
       cout << ">>";
-      strcpy(buffer,input(buffer, BUF));
-      if ((send(create_socket, buffer, size + 1, 0)) == -1) 
-      {
-         throw invalid_argument("send error");
-      }
+      input(buffer, BUF);
+      sendLine(create_socket, buffer);
    }
 }
 
 void inputRead(int create_socket, char* buffer, int size)
 {
    cout << "Message number: ";
-   strcpy(buffer,input(buffer, BUF));
-   if ((send(create_socket, buffer, size + 1, 0)) == -1) 
-   {
-      throw invalid_argument("send error");
-   }
+   input(buffer, BUF);
+   sendLine(create_socket, buffer);
 }
 
 void inputDelete(int create_socket, char* buffer, int size)
 {
    cout << "Message number: ";
-   strcpy(buffer,input(buffer, BUF));
-   if ((send(create_socket, buffer, size + 1, 0)) == -1) 
-   {
-      throw invalid_argument("send error");
-   }
+   input(buffer, BUF);
+   sendLine(create_socket, buffer);
 }
 
 void inputLogin(int create_socket, char* buffer, int size)
 {
    cout << "Username: ";
-   strcpy(buffer,input(buffer, BUF));
-   if ((send(create_socket, buffer, size + 1, 0)) == -1) 
+   input(buffer, BUF);
+   loginUser = buffer;
+   sendLine(create_socket, buffer);
+   strcpy(buffer,getpass());
+   sendLine(create_socket, buffer);
+}
+
+void inputImport(int create_socket, char* buffer, int size)
+{
+   // the server waits for the archive, so it is ended with "." even when the
+   // file cannot be read
+   vector<string> frames;
+   cout << "mbox file: ";
+   input(buffer, BUF);
+   if (!appendArchive(frames, buffer))
    {
-      throw invalid_argument("send error");
+      perror(buffer);
    }
-   strcpy(buffer,getpass());
-   if ((send(create_socket, buffer, size + 1, 0)) == -1) 
+   frames.push_back(".");
+   string outgoing;
+   for (const string& frame : frames)
    {
-      throw invalid_argument("send error");
+      outgoing.append(frame.c_str(), frame.size() + 1);
+      if (outgoing.size() >= 65536)
+      {
+         sendFrames(create_socket, outgoing);
+      }
    }
+   sendFrames(create_socket, outgoing);
 }
 
-char* receive(int create_socket, char* buffer, int size)
+bool appendArchive(vector<string>& frames, const char* filename)
 {
-   size = recv(create_socket, buffer, BUF - 1, 0);
-   if (size == -1)
+   // mbox lines, a leading "." is doubled so no line can end the transfer
+   FILE* archive = fopen(filename, "r");
+   if (archive == NULL)
    {
-      throw invalid_argument("recv error");
+      return false;
    }
-   else if (size == 0)
+   char* line = NULL;
+   size_t capacity = 0;
+   ssize_t length;
+   while ((length = getline(&line, &capacity, archive)) != -1)
    {
-         throw invalid_argument("Server closed remote socket"); // ignore error
+      line[strcspn(line, "\r\n")] = '\0';
+      frames.push_back(line[0] == '.' ? string(".") + line : string(line));
    }
-   else
+   free(line);
+   fclose(archive);
+   return true;
+}
+
+void inputExport(int create_socket, char* buffer, int size)
+{
+   cout << "Mailbox (empty = own, * = all): ";
+   input(buffer, BUF);
+   sendLine(create_socket, buffer);
+   cout << "Archive file (.gz = compressed, - = stdout): ";
+   input(buffer, BUF);
+   exportFile = strlen(buffer) != 0 ? buffer : "-";
+}
+
+long long exportReceive(int create_socket, char* buffer, const string& filename)
+{
+   receive(create_socket, buffer, BUF);
+   long long total = 0;
+   if (!receiveArchive(create_socket, buffer, filename, &total))
    {
-      buffer[size] = '\0';
-      if (strcmp("ERR", buffer) == 0)  //if the client gets an error returned from the server
-      {                                //it will disconnect from the server
-         throw invalid_argument("<< Server error occured, abort");
+      throw invalid_argument("archive could not be written to " + filename);
+   }
+   return total;
+}
+
+bool receiveArchive(int create_socket, char* buffer, const string& filename, long long* total)
+{
+   // chunks of "<length>" frame plus raw bytes up to length 0; the stream
+   // is always read to its end so the connection stays in sync
+   pid_t compressor = -1;
+   FILE* output = openOutput(filename, &compressor);
+   if (output == NULL)
+   {
+      perror(filename.c_str());
+   }
+   bool written = output != NULL;
+   *total = 0;
+   for (;;)
+   {
+      receiveFrame(create_socket, buffer, '\0');
+      size_t length = strtoull(buffer, NULL, 10);
+      if (length == 0)
+      {
+         break;
+      }
+      while (length > 0)
+      {
+         size_t part = length < BUF ? length : BUF;
+         receiveBytes(create_socket, buffer, part);
+         if (output != NULL && fwrite(buffer, 1, part, output) != part)
+         {
+            written = false;
+         }
+         length -= part;
+         *total += part;
+      }
+   }
+   if (output != NULL && !closeOutput(output, compressor))
+   {
+      written = false;
+   }
+   return written;
+}
+
+void receiveBytes(int create_socket, char* data, size_t length)
+{
+   // raw bytes after a frame, buffered data is used up first
+   while (length > 0)
+   {
+      if (pendingStart == pendingEnd)
+      {
+         ssize_t size = netRecv(create_socket, pending, sizeof(pending));
+         if (size == -1)
+         {
+            throw invalid_argument("recv error");
+         }
+         else if (size == 0)
+         {
+            throw invalid_argument("Server closed remote socket");
+         }
+         pendingStart = 0;
+         pendingEnd = size;
       }
+      size_t part = pendingEnd - pendingStart < length ? pendingEnd - pendingStart : length;
+      memcpy(data, pending + pendingStart, part);
+      pendingStart += part;
+      data += part;
+      length -= part;
+   }
+}
+
+FILE* openOutput(const string& filename, pid_t* compressor)
+{
+   *compressor = -1;
+   if (filename == "-")
+   {
+      return stdout;
+   }
+   if (filename.size() < 3 || filename.compare(filename.size() - 3, 3, ".gz") != 0)
+   {
+      return fopen(filename.c_str(), "wb");
+   }
+   // compressed output: the archive is piped through gzip into the file
+   FILE* target = fopen(filename.c_str(), "wb");
+   if (target == NULL)
+   {
+      return NULL;
+   }
+   int pipes[2];
+   if (pipe(pipes) == -1)
+   {
+      fclose(target);
+      return NULL;
+   }
+   *compressor = fork();
+   if (*compressor == 0)
+   {
+      dup2(pipes[0], STDIN_FILENO);
+      dup2(fileno(target), STDOUT_FILENO);
+      close(pipes[0]);
+      close(pipes[1]);
+      execlp("gzip", "gzip", "-c", (char*)NULL);
+      _exit(127);
+   }
+   close(pipes[0]);
+   fclose(target);
+   if (*compressor == -1)
+   {
+      close(pipes[1]);
+      return NULL;
+   }
+   return fdopen(pipes[1], "wb");
+}
+
+bool closeOutput(FILE* output, pid_t compressor)
+{
+   if (output == stdout)
+   {
+      return fflush(stdout) == 0;
+   }
+   bool closed = fclose(output) == 0;
+   if (compressor > 0)
+   {
+      int status = 0;
+      closed = waitpid(compressor, &status, 0) == compressor && WIFEXITED(status) && WEXITSTATUS(status) == 0 && closed;
+   }
+   return closed;
+}
+
+char* receive(int create_socket, char* buffer, int size)
+{
+   receiveFrame(create_socket, buffer, '\0');
+   if (strcmp("ERR", buffer) == 0)  //if the client gets an error returned from the server
+   {                                //it will disconnect from the server
+      throw invalid_argument("<< Server error occured, abort");
    }
    return buffer;
 }
 
+char* receiveFrame(int create_socket, char* buffer, char delimiter)
+{
+   // every reply of the server is one '\0' terminated frame
+   for (;;)
+   {
+      char* begin = pending + pendingStart;
+      size_t available = pendingEnd - pendingStart;
+      char* end = (char*)memchr(begin, delimiter, available);
+      if (end != NULL || available >= BUF - 1)
+      {
+         size_t size = end != NULL ? end - begin : BUF - 1;
+         if (size > BUF - 1)
+         {
+            size = BUF - 1;
+            end = NULL;
+         }
+         memcpy(buffer, begin, size);
+         buffer[size] = '\0';
+         pendingStart += end != NULL ? size + 1 : size;
+         return buffer;
+      }
+
+      memmove(pending, begin, available);
+      pendingStart = 0;
+      pendingEnd = available;
+      ssize_t size = netRecv(create_socket, pending + pendingEnd, sizeof(pending) - pendingEnd);
+      if (size == -1)
+      {
+         throw invalid_argument("recv error");
+      }
+      else if (size == 0)
+      {
+         throw invalid_argument("Server closed remote socket"); // ignore error
+      }
+      pendingEnd += size;
+   }
+}
+
+void receiveWelcome(int create_socket, char* buffer, bool print)
+{
+   // the welcome text is plain lines, the last one asks for commands
+   do
+   {
+      receiveFrame(create_socket, buffer, '\n');
+      if (strncmp(buffer, "BUSY", 4) == 0)
+      {
+         throw invalid_argument("Server busy - try again later");
+      }
+      if (print)
+      {
+         printf("%s\n", buffer); // ignore error
+      }
+   }
+   while (strstr(buffer, "commands") == NULL);
+}
+
+void sendLine(int create_socket, const char* line)
+{
+   size_t length = strlen(line) + 1;
+   size_t sent = 0;
+   while (sent < length)
+   {
+      ssize_t size = netSend(create_socket, line + sent, length - sent);
+      if (size == -1)
+      {
+         throw invalid_argument("send error");
+      }
+      sent += size;
+   }
+}
+
+void sendFrames(int create_socket, string& frames)
+{
+   // frames were collected back to back, they go out with as few calls as possible
+   size_t sent = 0;
+   while (sent < frames.size())
+   {
+      ssize_t size = netSend(create_socket, frames.data() + sent, frames.size() - sent);
+      if (size == -1)
+      {
+         throw invalid_argument("send error");
+      }
+      sent += size;
+   }
+   frames.clear();
+}
+
+void inputSearch(int create_socket, char* buffer, int size)
+{
+   cout << "Words: ";
+   input(buffer, BUF);
+   sendLine(create_socket, buffer);
+}
+
+void searchReceive(int create_socket, char* buffer, int size)
+{
+   char* reply = receive(create_socket, buffer, size);
+   int matchCount = atoi(reply);
+   cout << "Matches: " << reply << endl;
+   for(int i = 0; i < matchCount; i++)
+   {
+      reply = receive(create_socket, buffer, size);
+      char* subject = strchr(reply, ' ');
+      if (subject != NULL)
+      {
+         *subject++ = '\0';
+      }
+      cout << "Message " << reply << ": " << (subject != NULL ? subject : "") << endl;
+   }
+}
+
+// "idle [seconds] [last id]" waits for a new message: OK, then NEW <id>,
+// TIMEOUT or DONE
+void idleReceive(int create_socket, char* buffer, int size)
+{
+   const char* reply = receive(create_socket, buffer, size);
+   if (strcmp(reply, "OK") != 0)
+   {
+      printf("<< %s\n", reply);
+      return;
+   }
+   cout << "Waiting for new messages..." << endl;
+   reply = receive(create_socket, buffer, size);
+   printf("<< %s\n", reply);
+}
+
 void listReceive(int create_socket, char* buffer, int size)
 {
-   strcpy(buffer, receive(create_socket, buffer, size));
-   int messageCount = atoi(buffer);
-   cout << "Message Count: " << buffer << endl;
+   const char* reply = receive(create_socket, buffer, size);
+   int messageCount = atoi(reply);
+   cout << "Message Count: " << reply << endl;
    for(int i = 0; i < messageCount; i++)
    {
-      strcpy(buffer, receive(create_socket, buffer, size));
-      cout << "Subject " << i+1 <<": " << buffer << endl;
+      reply = receive(create_socket, buffer, size);
+      cout << "Subject " << i+1 <<": " << reply << endl;
+   }
+}
+void listRangeReceive(int create_socket, char* buffer, int size)
+{
+   unsigned long long count = 0, version = 0, total = 0;
+   char* reply = receive(create_socket, buffer, size);
+   sscanf(reply, "%llu %llu %llu", &count, &version, &total);
+   cout << "Message Count: " << count << " of " << total << " (mailbox version " << version << ")" << endl;
+   for(unsigned long long i = 0; i < count; i++)
+   {
+      unsigned long long number = 0, id = 0;
+      int subject = 0;
+      reply = receive(create_socket, buffer, size);
+      sscanf(reply, "%llu %llu %n", &number, &id, &subject);
+      cout << "Subject " << number << " (id " << id << "): " << reply + subject << endl;
    }
 }
 void readReceive(int create_socket, char* buffer, int size) //reads the message received from the server
 {
-   strcpy(buffer, receive(create_socket, buffer, size));
-   printf("<< %s\n", buffer); // ignore error
+   vector<string> message;
+   readFrames(create_socket, buffer, size, message);
+}
+// false when the server refused; message gets receiver, subject, the body
+// lines and the closing "."
+bool readFrames(int create_socket, char* buffer, int size, vector<string>& message)
+{
+   const char* reply = receive(create_socket, buffer, size);
+   printf("<< %s\n", reply); // ignore error
+   if (refused(reply))
+   {
+      return false;
+   }
+   message.clear();
+   do
+   {
+      message.push_back(receive(create_socket, buffer, size));
+   }
+   while (message.size() < 3 || message.back() != ".");
+   printMessage(message);
+   return true;
+}
+void printMessage(const vector<string>& message)
+{
    cout << "Sender: " << username << endl;
-   strcpy(buffer, receive(create_socket, buffer, size));
-   cout << "Receiver: " << buffer << endl;
-   strcpy(buffer, receive(create_socket, buffer, size));
-   cout << "Subject: " << buffer << endl;
+   cout << "Receiver: " << message[0] << endl;
+   cout << "Subject: " << message[1] << endl;
    cout << "Message:" << endl;
-   while(strcmp(buffer, ".") != 0) 
+   for (size_t i = 2; i < message.size(); i++)
    {
-      strcpy(buffer, receive(create_socket, buffer, size));
-      cout << "<< " << buffer << endl;
+      cout << "<< " << message[i] << endl;
    }
-
+}
+// list brought up to date with one "LIST SINCE <last id>": kept when the
+// mailbox version is unchanged, extended when messages were only added and
+// fetched again when one was deleted; false when the mailbox can not be
+// cached, it holds messages without an id (legacy names, which
+// twmailer-migrate keeps) and "LIST SINCE" never reports those
+bool cacheRefresh(int create_socket, char* buffer, int size, CachedList& list)
+{
+   bool cached = cache.loadList(list);
+   uint64_t after = cached && !list.ids.empty() ? list.ids.back() : 0;
+   for (;;)
+   {
+      sendLine(create_socket, ("list since " + to_string(after)).c_str());
+      CachedList delta;
+      unsigned long long total = receiveDelta(create_socket, buffer, size, delta);
+      if (cached && delta.version == list.version)
+      {
+         return true;
+      }
+      if (list.ids.size() + delta.ids.size() == total)
+      {
+         list.version = delta.version;
+         list.ids.insert(list.ids.end(), delta.ids.begin(), delta.ids.end());
+         list.subjects.insert(list.subjects.end(), delta.subjects.begin(), delta.subjects.end());
+         break;
+      }
+      if (after == 0)
+      {
+         // a full listing that still misses messages, they have no id
+         list = CachedList();
+         return false;
+      }
+      // the numbers moved, the bodies of deleted messages go with the listing
+      list = CachedList();
+      cached = false;
+      after = 0;
+   }
+   cache.storeList(list);
+   if (after == 0)
+   {
+      cache.prune(list);
+   }
+   return true;
+}
+// the reply to "LIST SINCE", its total
+unsigned long long receiveDelta(int create_socket, char* buffer, int size, CachedList& delta)
+{
+   unsigned long long count = 0, version = 0, total = 0;
+   const char* reply = receive(create_socket, buffer, size);
+   if (sscanf(reply, "%llu %llu %llu", &count, &version, &total) != 3)
+   {
+      throw invalid_argument("<< Invalid listing, abort");
+   }
+   delta.version = version;
+   for(unsigned long long i = 0; i < count; i++)
+   {
+      unsigned long long number = 0, id = 0;
+      int subject = 0;
+      reply = receive(create_socket, buffer, size);
+      sscanf(reply, "%llu %llu %n", &number, &id, &subject);
+      delta.ids.push_back(id);
+      delta.subjects.push_back(reply + subject);
+   }
+   return total;
+}
+void cachedList(int create_socket, char* buffer, int size)
+{
+   CachedList list;
+   if (!cacheRefresh(create_socket, buffer, size, list))
+   {
+      sendLine(create_socket, "list");
+      listReceive(create_socket, buffer, size);
+      return;
+   }
+   cout << "Message Count: " << list.ids.size() << endl;
+   for(size_t i = 0; i < list.ids.size(); i++)
+   {
+      cout << "Subject " << i+1 <<": " << list.subjects[i] << endl;
+   }
+}
+void cachedRead(int create_socket, char* buffer, int size)
+{
+   cout << "Message number: ";
+   input(buffer, BUF);
+   string number = buffer;
+   CachedList list;
+   if (!cacheRefresh(create_socket, buffer, size, list))
+   {
+      string request = string("read") + '\0' + number + '\0';
+      sendFrames(create_socket, request);
+      readReceive(create_socket, buffer, size);
+      return;
+   }
+   unsigned long long index = strtoull(number.c_str(), NULL, 10);
+   bool known = index >= 1 && index <= list.ids.size();
+   vector<string> message;
+   if (known && cache.loadMessage(list.ids[index - 1], message))
+   {
+      printf("<< OK\n"); // ignore error
+      printMessage(message);
+      return;
+   }
+   // the number means list.ids[index - 1] only if the mailbox stayed as it
+   // was until the READ, the listing behind it tells
+   string requests = string("read") + '\0' + number + '\0' + "list since "
+                     + to_string(list.ids.empty() ? 0 : list.ids.back()) + '\0';
+   sendFrames(create_socket, requests);
+   bool found = readFrames(create_socket, buffer, size, message);
+   CachedList delta;
+   receiveDelta(create_socket, buffer, size, delta);
+   if (found && known && delta.version == list.version)
+   {
+      cache.storeMessage(list.ids[index - 1], message);
+   }
+}
+void statsReceive(int create_socket, char* buffer, int size) //the report may span several packets
+{
+   string report;
+   while(report.size() < 3 || report.compare(report.size() - 3, 3, "\n.\n") != 0)
+   {
+      const char* reply = receive(create_socket, buffer, size);
+      if (report.empty() && refused(reply))
+      {
+         printf("<< %s\n", reply);
+         return;
+      }
+      report += reply;
+   }
+   report.resize(report.size() - 2);
+   cout << report;
+}
+bool refused(const char* reply)
+{
+   return strcmp(reply, "ERR") == 0 || strcmp(reply, "BUSY") == 0 || strcmp(reply, "LIMIT") == 0
+          || strcmp(reply, "QUOTA") == 0;
 }
 int getch()
 {
@@ -515,3 +1118,671 @@ const char *getpass()
     printf("\n");
     return password.c_str();
 }
+
+///////////////////////////////////////////////////////////////////////////////
+// BATCH MODE
+// Reads requests from a script or a JSONL stream and pipelines them over the
+// connection: up to TWMAILER_BATCH_WINDOW requests (default 64) and
+// BATCH_BYTES of them are in flight before the oldest reply is awaited; a
+// larger request waits until all before it were answered. The replies are
+// only read between writes, so the requests in flight must fit into the
+// socket buffers: a server blocked writing replies reads no further. Every
+// request produces one JSON line
+// on stdout. Credentials come from TWMAILER_CREDENTIALS (file with the user
+// on the first and the password on the second line) or from TWMAILER_USER
+// and TWMAILER_PASSWORD; when a user is given the batch starts with a LOGIN.
+//
+// script lines:                       JSONL lines:
+//    send <receiver> <subject>           {"command":"send","to":"..","subject":"..","body":".."}
+//    <body lines>                        {"command":"read","id":1}
+//    .                                   {"command":"del","id":1}
+//    read <n> / del <n>                  {"command":"list"}
+//    list / stats / usage / quit         {"command":"login","user":"..","password":".."}
+//    login [user]                        {"command":"import","file":".."}
+//    import <mbox-file>                  {"command":"export","file":"..","mailbox":".."}
+//    export <archive-file> [mailbox]     {"command":"search","query":".."}
+//    search <words>                      {"command":"list","limit":10,"offset":0}
+//    list <limit> [offset]               {"command":"list","since":42}
+//    list since <id> [limit]             {"command":"idle","timeout":60,"since":42}
+//    idle [seconds] [last id]
+// Empty lines and lines starting with '#' are skipped. Nothing is sent behind
+// an IDLE until it ended, a request behind it would end it right away.
+
+struct BatchRequest
+{
+   long sequence;
+   Command command;
+   vector<string> frames; // verb followed by its arguments
+   string error;          // set when the request is rejected before sending
+   string output;         // archive file of an EXPORT
+   size_t bytes = 0;      // of its frames, in flight until its reply arrived
+};
+
+string jsonEscape(const string& text)
+{
+   string out = "\"";
+   for (unsigned char c : text)
+   {
+      switch (c)
+      {
+         case '"': out += "\\\""; break;
+         case '\\': out += "\\\\"; break;
+         case '\n': out += "\\n"; break;
+         case '\r': out += "\\r"; break;
+         case '\t': out += "\\t"; break;
+         default:
+            if (c < 0x20)
+            {
+               char escaped[8];
+               snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+               out += escaped;
+            }
+            else
+            {
+               out += (char)c;
+            }
+      }
+   }
+   return out + "\"";
+}
+
+// flat objects only: string, number, true/false/null values
+bool parseJsonObject(const char* text, map<string, string>& fields)
+{
+   const char* p = text;
+   auto skip = [&p]() { while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++; };
+   auto parseString = [&p](string& out) -> bool
+   {
+      if (*p != '"')
+      {
+         return false;
+      }
+      p++;
+      while (*p != '"')
+      {
+         if (*p == '\0')
+         {
+            return false;
+         }
+         if (*p != '\\')
+         {
+            out += *p++;
+            continue;
+         }
+         p++;
+         switch (*p)
+         {
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'u':
+            {
+               unsigned code = 0;
+               for (int i = 1; i <= 4; i++)
+               {
+                  if (!isxdigit((unsigned char)p[i]))
+                  {
+                     return false;
+                  }
+                  code = code * 16 + (isdigit((unsigned char)p[i]) ? p[i] - '0' : (tolower(p[i]) - 'a' + 10));
+               }
+               p += 4;
+               // basic multilingual plane only, encoded as UTF-8
+               if (code < 0x80)
+               {
+                  out += (char)code;
+               }
+               else if (code < 0x800)
+               {
+                  out += (char)(0xC0 | (code >> 6));
+                  out += (char)(0x80 | (code & 0x3F));
+               }
+               else
+               {
+                  out += (char)(0xE0 | (code >> 12));
+                  out += (char)(0x80 | ((code >> 6) & 0x3F));
+                  out += (char)(0x80 | (code & 0x3F));
+               }
+               break;
+            }
+            case '\0': return false;
+            default: out += *p; break;
+         }
+         p++;
+      }
+      p++;
+      return true;
+   };
+
+   skip();
+   if (*p++ != '{')
+   {
+      return false;
+   }
+   skip();
+   if (*p == '}')
+   {
+      return true;
+   }
+   for (;;)
+   {
+      string key;
+      string value;
+      skip();
+      if (!parseString(key))
+      {
+         return false;
+      }
+      skip();
+      if (*p++ != ':')
+      {
+         return false;
+      }
+      skip();
+      if (*p == '"')
+      {
+         if (!parseString(value))
+         {
+            return false;
+         }
+      }
+      else
+      {
+         while (*p != '\0' && *p != ',' && *p != '}' && *p != ' ')
+         {
+            value += *p++;
+         }
+         if (value.empty())
+         {
+            return false;
+         }
+      }
+      fields[key] = value;
+      skip();
+      if (*p == ',')
+      {
+         p++;
+         continue;
+      }
+      return *p == '}';
+   }
+}
+
+void loadCredentials(string& user, string& password)
+{
+   const char* file = getenv("TWMAILER_CREDENTIALS");
+   if (file != NULL)
+   {
+      FILE* credentials = fopen(file, "r");
+      if (credentials == NULL)
+      {
+         perror("open credentials file");
+         return;
+      }
+      char line[BUF];
+      if (fgets(line, sizeof(line), credentials) != NULL)
+      {
+         line[strcspn(line, "\r\n")] = '\0';
+         user = line;
+      }
+      if (fgets(line, sizeof(line), credentials) != NULL)
+      {
+         line[strcspn(line, "\r\n")] = '\0';
+         password = line;
+      }
+      fclose(credentials);
+      return;
+   }
+   if (getenv("TWMAILER_USER") != NULL)
+   {
+      user = getenv("TWMAILER_USER");
+   }
+   if (getenv("TWMAILER_PASSWORD") != NULL)
+   {
+      password = getenv("TWMAILER_PASSWORD");
+   }
+}
+
+// body text to frames, a lone "." would end the message early
+bool appendBody(BatchRequest& request, const string& body)
+{
+   size_t start = 0;
+   while (start <= body.size() && !body.empty())
+   {
+      size_t end = body.find('\n', start);
+      string line = body.substr(start, end == string::npos ? string::npos : end - start);
+      if (!line.empty() && line.back() == '\r')
+      {
+         line.pop_back();
+      }
+      if (line == ".")
+      {
+         request.error = "body line \".\" is reserved as terminator";
+         return false;
+      }
+      request.frames.push_back(line);
+      if (end == string::npos)
+      {
+         break;
+      }
+      start = end + 1;
+   }
+   request.frames.push_back(".");
+   return true;
+}
+
+void parseJsonRequest(const char* line, BatchRequest& request, const string& password)
+{
+   map<string, string> fields;
+   if (!parseJsonObject(line, fields))
+   {
+      request.error = "malformed JSON";
+      return;
+   }
+   string verb = fields.count("command") ? fields["command"] : fields["cmd"];
+   request.command = parseCommand(verb).command;
+   request.frames.push_back(verb);
+   if (request.command == Command::Idle)
+   {
+      if (fields.count("timeout") || fields.count("since"))
+      {
+         request.frames[0] += " " + (fields.count("timeout") ? fields["timeout"] : "0");
+         request.frames[0] += fields.count("since") ? " " + fields["since"] : "";
+      }
+   }
+   if (request.command == Command::List)
+   {
+      if (fields.count("since"))
+      {
+         request.frames[0] += " since " + fields["since"] + (fields.count("limit") ? " " + fields["limit"] : "");
+      }
+      else if (fields.count("limit"))
+      {
+         request.frames[0] += " " + fields["limit"] + (fields.count("offset") ? " " + fields["offset"] : "");
+      }
+   }
+   switch (request.command)
+   {
+      case Command::Send:
+         request.frames.push_back(fields["to"]);
+         request.frames.push_back(fields["subject"].substr(0, 80));
+         appendBody(request, fields["body"]);
+         break;
+      case Command::Read:
+      case Command::Del:
+      {
+         string number = fields.count("id") ? fields["id"] : fields["number"];
+         if (number.empty())
+         {
+            request.error = "missing message id";
+         }
+         request.frames.push_back(number);
+         break;
+      }
+      case Command::Login:
+         request.frames.push_back(fields["user"]);
+         request.frames.push_back(fields.count("password") ? fields["password"] : password);
+         break;
+      case Command::Import:
+         if (!appendArchive(request.frames, fields["file"].c_str()))
+         {
+            request.error = "cannot read " + fields["file"];
+         }
+         request.frames.push_back(".");
+         break;
+      case Command::Search:
+         request.frames.push_back(fields["query"]);
+         break;
+      case Command::Export:
+         request.frames.push_back(fields["mailbox"]);
+         request.output = fields["file"];
+         if (request.output.empty() || request.output == "-")
+         {
+            request.error = "export needs an archive file"; // stdout carries the results
+         }
+         break;
+      case Command::Unknown:
+         request.error = "unknown command";
+         break;
+      default:
+         break;
+   }
+}
+
+void parseScriptRequest(const char* line, FILE* script, BatchRequest& request, const string& user, const string& password)
+{
+   ParsedCommand parsed = parseCommand(line);
+   string arguments(parsed.arguments);
+   request.command = parsed.command;
+   request.frames.push_back(commandName(parsed.command));
+   if ((request.command == Command::List || request.command == Command::Idle) && !arguments.empty())
+   {
+      request.frames[0] += " " + arguments;
+   }
+   switch (request.command)
+   {
+      case Command::Send:
+      {
+         size_t space = arguments.find(' ');
+         if (arguments.empty())
+         {
+            request.error = "send needs a receiver";
+         }
+         request.frames.push_back(arguments.substr(0, space));
+         request.frames.push_back(space == string::npos ? "" : arguments.substr(space + 1, 80));
+         // body lines follow the command up to a single "."
+         char* body = NULL;
+         size_t capacity = 0;
+         ssize_t length;
+         bool terminated = false;
+         while ((length = getline(&body, &capacity, script)) != -1)
+         {
+            body[strcspn(body, "\r\n")] = '\0';
+            request.frames.push_back(body);
+            if (strcmp(body, ".") == 0)
+            {
+               terminated = true;
+               break;
+            }
+         }
+         free(body);
+         if (!terminated)
+         {
+            request.error = "message body is not terminated by \".\"";
+         }
+         break;
+      }
+      case Command::Read:
+      case Command::Del:
+         if (arguments.empty())
+         {
+            request.error = "missing message number";
+         }
+         request.frames.push_back(arguments);
+         break;
+      case Command::Login:
+         request.frames.push_back(arguments.empty() ? user : arguments);
+         request.frames.push_back(password);
+         break;
+      case Command::Import:
+         if (!appendArchive(request.frames, arguments.c_str()))
+         {
+            request.error = "cannot read " + arguments;
+         }
+         request.frames.push_back(".");
+         break;
+      case Command::Search:
+         request.frames.push_back(arguments);
+         break;
+      case Command::Export:
+      {
+         size_t space = arguments.find(' ');
+         request.output = arguments.substr(0, space);
+         request.frames.push_back(space == string::npos ? "" : arguments.substr(space + 1));
+         if (request.output.empty() || request.output == "-")
+         {
+            request.error = "export needs an archive file"; // stdout carries the results
+         }
+         break;
+      }
+      case Command::Unknown:
+         request.error = "unknown command";
+         break;
+      default:
+         break;
+   }
+}
+
+// reads the complete reply of one request and prints it as a JSON line
+bool collectResponse(int create_socket, char* buffer, const BatchRequest& request)
+{
+   string result = "{\"seq\":" + to_string(request.sequence) + ",\"command\":\"" + commandName(request.command) + "\"";
+   receiveFrame(create_socket, buffer, '\0');
+   // BUSY (server overloaded) and LIMIT (rate exceeded) are worth a retry,
+   // QUOTA (mailbox full) is not
+   bool ok = !refused(buffer);
+   result += ok ? ",\"status\":\"OK\"" : ",\"status\":" + jsonEscape(buffer);
+   if (ok)
+   {
+      switch (request.command)
+      {
+         case Command::List:
+         {
+            if (request.frames[0].find(' ') != string::npos)
+            {
+               unsigned long long count = 0, version = 0, total = 0;
+               sscanf(buffer, "%llu %llu %llu", &count, &version, &total);
+               result += ",\"count\":" + to_string(count) + ",\"version\":" + to_string(version)
+                         + ",\"total\":" + to_string(total) + ",\"messages\":[";
+               for (unsigned long long i = 0; i < count; i++)
+               {
+                  unsigned long long number = 0, id = 0;
+                  int subject = 0;
+                  receiveFrame(create_socket, buffer, '\0');
+                  sscanf(buffer, "%llu %llu %n", &number, &id, &subject);
+                  result += (i ? "," : "") + string("{\"number\":") + to_string(number) + ",\"id\":" + to_string(id)
+                            + ",\"subject\":" + jsonEscape(buffer + subject) + "}";
+               }
+               result += "]";
+               break;
+            }
+            int count = atoi(buffer);
+            result += ",\"count\":" + to_string(count) + ",\"subjects\":[";
+            for (int i = 0; i < count; i++)
+            {
+               receiveFrame(create_socket, buffer, '\0');
+               result += (i ? "," : "") + jsonEscape(buffer);
+            }
+            result += "]";
+            break;
+         }
+         case Command::Read:
+         {
+            vector<string> lines;
+            for (;;)
+            {
+               receiveFrame(create_socket, buffer, '\0');
+               if (strcmp(buffer, ".") == 0)
+               {
+                  break;
+               }
+               lines.push_back(buffer);
+            }
+            string body;
+            for (size_t i = 2; i < lines.size(); i++)
+            {
+               body += (i > 2 ? "\n" : "") + lines[i];
+            }
+            result += ",\"receiver\":" + jsonEscape(lines.size() > 0 ? lines[0] : "");
+            result += ",\"subject\":" + jsonEscape(lines.size() > 1 ? lines[1] : "");
+            result += ",\"body\":" + jsonEscape(body);
+            break;
+         }
+         case Command::Search:
+         {
+            int count = atoi(buffer);
+            result += ",\"count\":" + to_string(count) + ",\"matches\":[";
+            for (int i = 0; i < count; i++)
+            {
+               receiveFrame(create_socket, buffer, '\0');
+               char* subject = strchr(buffer, ' ');
+               if (subject != NULL)
+               {
+                  *subject++ = '\0';
+               }
+               result += (i ? "," : "") + string("{\"number\":") + to_string(atol(buffer))
+                         + ",\"subject\":" + jsonEscape(subject != NULL ? subject : "") + "}";
+            }
+            result += "]";
+            break;
+         }
+         case Command::Export:
+         {
+            long long total = 0;
+            ok = receiveArchive(create_socket, buffer, request.output, &total);
+            result.resize(result.rfind(",\"status\""));
+            result += ok ? ",\"status\":\"OK\"" : ",\"status\":\"ERR\"";
+            result += ",\"file\":" + jsonEscape(request.output) + ",\"bytes\":" + to_string(total);
+            break;
+         }
+         case Command::Idle:
+         {
+            receiveFrame(create_socket, buffer, '\0');
+            unsigned long long id = 0;
+            char event[16] = "";
+            sscanf(buffer, "%15s %llu", event, &id);
+            result += ",\"event\":" + jsonEscape(event);
+            if (strcmp(event, "NEW") == 0)
+            {
+               result += ",\"id\":" + to_string(id);
+            }
+            break;
+         }
+         case Command::Stats:
+         case Command::Usage:
+         {
+            string report = buffer;
+            while (report.size() < 3 || report.compare(report.size() - 3, 3, "\n.\n") != 0)
+            {
+               receiveFrame(create_socket, buffer, '\0');
+               report += buffer;
+            }
+            report.resize(report.size() - 2);
+            result += ",\"report\":" + jsonEscape(report);
+            break;
+         }
+         default:
+            break;
+      }
+   }
+   result += "}\n";
+   fputs(result.c_str(), stdout);
+   return ok;
+}
+
+int runBatch(int create_socket, FILE* script)
+{
+   char buffer[BUF];
+   string user;
+   string password;
+   string outgoing;
+   deque<BatchRequest> inflight;
+   size_t inflightBytes = 0;
+   size_t window = 64;
+   long sequence = 0;
+   int failures = 0;
+
+   if (getenv("TWMAILER_BATCH_WINDOW") != NULL && atoi(getenv("TWMAILER_BATCH_WINDOW")) > 0)
+   {
+      window = atoi(getenv("TWMAILER_BATCH_WINDOW"));
+   }
+   loadCredentials(user, password);
+
+   // frames are collected and written with as few send calls as possible
+   auto flush = [&]()
+   {
+      sendFrames(create_socket, outgoing);
+   };
+   auto collect = [&]()
+   {
+      flush();
+      failures += !collectResponse(create_socket, buffer, inflight.front());
+      inflightBytes -= inflight.front().bytes;
+      inflight.pop_front();
+   };
+   auto submit = [&](BatchRequest& request)
+   {
+      if (!request.error.empty())
+      {
+         printf("{\"seq\":%ld,\"command\":\"%s\",\"status\":\"ERR\",\"error\":%s}\n",
+                request.sequence, commandName(request.command), jsonEscape(request.error).c_str());
+         failures++;
+         return;
+      }
+      for (const string& frame : request.frames)
+      {
+         request.bytes += frame.size() + 1;
+      }
+      while (!inflight.empty() && inflightBytes + request.bytes > BATCH_BYTES)
+      {
+         collect();
+      }
+      for (const string& frame : request.frames)
+      {
+         outgoing.append(frame.c_str(), frame.size() + 1);
+      }
+      inflightBytes += request.bytes;
+      inflight.push_back(move(request));
+      if (outgoing.size() >= BATCH_BYTES)
+      {
+         flush();
+      }
+      // nothing may follow an IDLE before it ended
+      while (inflight.size() >= window || (!inflight.empty() && inflight.back().command == Command::Idle))
+      {
+         collect();
+      }
+   };
+
+   try
+   {
+      receiveWelcome(create_socket, buffer, false);
+      if (!user.empty())
+      {
+         username = user;
+         BatchRequest login{++sequence, Command::Login, {"login", user, password}, ""};
+         submit(login);
+      }
+
+      char* line = NULL;
+      size_t capacity = 0;
+      while (getline(&line, &capacity, script) != -1)
+      {
+         line[strcspn(line, "\r\n")] = '\0';
+         const char* text = line;
+         while (*text == ' ' || *text == '\t')
+         {
+            text++;
+         }
+         if (*text == '\0' || *text == '#')
+         {
+            continue;
+         }
+         BatchRequest request{++sequence, Command::Unknown, {}, ""};
+         if (*text == '{')
+         {
+            parseJsonRequest(text, request, password);
+         }
+         else
+         {
+            parseScriptRequest(text, script, request, user, password);
+         }
+         if (request.command == Command::Quit)
+         {
+            break;
+         }
+         submit(request);
+      }
+      free(line);
+
+      while (!inflight.empty())
+      {
+         collect();
+      }
+      flush();
+      sendLine(create_socket, "quit");
+   }
+   catch (const invalid_argument& except)
+   {
+      cerr << except.what() << endl;
+      failures += inflight.size() + 1;
+   }
+   fflush(stdout);
+   if (script != stdin)
+   {
+      fclose(script);
+   }
+   return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,580 @@
+#ifndef TWMAILER_CORO_H
+#define TWMAILER_CORO_H
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "twmailer-stats.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// COROUTINES
+// Sessions are C++20 coroutines on an event loop, one loop per thread. A
+// Task<T> starts when it is awaited and hands its result, or its exception,
+// to the awaiting coroutine; a chain of them reads like the blocking calls
+// it replaces. Where a call would block, the coroutine suspends instead:
+// on a descriptor (EventLoop::wait), a timer (EventLoop::sleep) or work
+// handed to a WorkerPool (offload), and the loop resumes it once that is
+// done. A loop thread therefore carries as many sessions as it has
+// descriptors, a parked one costs its coroutine frames and nothing else.
+
+#define LOOP_EVENTS 256 // epoll events taken at once
+
+struct TaskPromiseBase
+{
+   std::coroutine_handle<> continuation = std::noop_coroutine();
+   std::exception_ptr error;
+   bool starting = false; // inside the resume() of Task::await_suspend
+   bool finished = false;
+
+   struct Finished
+   {
+      bool await_ready() const noexcept
+      {
+         return false;
+      }
+
+      template <typename Promise>
+      std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> done) noexcept
+      {
+         TaskPromiseBase &promise = done.promise();
+         promise.finished = true;
+         return promise.starting ? std::noop_coroutine() : promise.continuation;
+      }
+
+      void await_resume() const noexcept
+      {
+      }
+   };
+
+   std::suspend_always initial_suspend() const noexcept
+   {
+      return {};
+   }
+
+   Finished final_suspend() const noexcept
+   {
+      return {};
+   }
+
+   void unhandled_exception() noexcept
+   {
+      error = std::current_exception();
+   }
+};
+
+template <typename T>
+struct TaskPromise;
+
+template <typename T = void>
+class [[nodiscard]] Task
+{
+ public:
+   using promise_type = TaskPromise<T>;
+
+   explicit Task(std::coroutine_handle<promise_type> handle) : coroutine(handle)
+   {
+   }
+
+   Task(Task &&other) noexcept : coroutine(std::exchange(other.coroutine, nullptr))
+   {
+   }
+
+   Task(const Task &) = delete;
+   Task &operator=(const Task &) = delete;
+
+   ~Task()
+   {
+      if (coroutine)
+      {
+         coroutine.destroy();
+      }
+   }
+
+   bool await_ready() const noexcept
+   {
+      return false;
+   }
+
+   // the task runs right away; one that finishes without suspending lets
+   // the caller go on without a suspension either, so a loop over calls
+   // that complete at once (a buffered frame) does not nest on the stack
+   bool await_suspend(std::coroutine_handle<> caller)
+   {
+      TaskPromiseBase &promise = coroutine.promise();
+      promise.continuation = caller;
+      promise.starting = true;
+      coroutine.resume();
+      promise.starting = false;
+      return !promise.finished;
+   }
+
+   T await_resume()
+   {
+      return coroutine.promise().result();
+   }
+
+ private:
+   std::coroutine_handle<promise_type> coroutine;
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase
+{
+   T value{};
+
+   Task<T> get_return_object()
+   {
+      return Task<T>(std::coroutine_handle<TaskPromise>::from_promise(*this));
+   }
+
+   void return_value(T result)
+   {
+      value = std::move(result);
+   }
+
+   T result()
+   {
+      if (error)
+      {
+         std::rethrow_exception(error);
+      }
+      return std::move(value);
+   }
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase
+{
+   Task<void> get_return_object()
+   {
+      return Task<void>(std::coroutine_handle<TaskPromise>::from_promise(*this));
+   }
+
+   void return_void() const noexcept
+   {
+   }
+
+   void result()
+   {
+      if (error)
+      {
+         std::rethrow_exception(error);
+      }
+   }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+class EventLoop
+{
+ public:
+   // resumed once the descriptor has one of events, or an error or hangup
+   struct IoWait
+   {
+      EventLoop *loop;
+      int descriptor;
+      uint32_t events;
+      std::coroutine_handle<> waiting;
+
+      bool await_ready() const noexcept
+      {
+         return false;
+      }
+
+      // one shot, so an event never finds a coroutine that stopped waiting
+      bool await_suspend(std::coroutine_handle<> handle) noexcept
+      {
+         waiting = handle;
+         struct epoll_event event = {};
+         event.events = events | EPOLLONESHOT;
+         event.data.ptr = this;
+         return epoll_ctl(loop->epoll, EPOLL_CTL_MOD, descriptor, &event) == 0
+                || (errno == ENOENT && epoll_ctl(loop->epoll, EPOLL_CTL_ADD, descriptor, &event) == 0);
+      }
+
+      void await_resume() const noexcept
+      {
+      }
+   };
+
+   struct TimerWait
+   {
+      EventLoop *loop;
+      uint64_t due; // monotonicNanos()
+
+      bool await_ready() const noexcept
+      {
+         return due <= monotonicNanos();
+      }
+
+      void await_suspend(std::coroutine_handle<> handle)
+      {
+         loop->timers.push(Timer{due, handle});
+      }
+
+      void await_resume() const noexcept
+      {
+      }
+   };
+
+   // lets the coroutines that are ready now run first
+   struct Yield
+   {
+      EventLoop *loop;
+
+      bool await_ready() const noexcept
+      {
+         return false;
+      }
+
+      void await_suspend(std::coroutine_handle<> handle)
+      {
+         loop->ready.push_back(handle);
+      }
+
+      void await_resume() const noexcept
+      {
+      }
+   };
+
+   EventLoop()
+   {
+      epoll = epoll_create1(EPOLL_CLOEXEC);
+      wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+      struct epoll_event event = {};
+      event.events = EPOLLIN;
+      event.data.ptr = nullptr; // the wakeup of post()
+      if (epoll != -1 && wake != -1)
+      {
+         epoll_ctl(epoll, EPOLL_CTL_ADD, wake, &event);
+      }
+   }
+
+   ~EventLoop()
+   {
+      if (epoll != -1)
+      {
+         close(epoll);
+      }
+      if (wake != -1)
+      {
+         close(wake);
+      }
+   }
+
+   EventLoop(const EventLoop &) = delete;
+   EventLoop &operator=(const EventLoop &) = delete;
+
+   bool valid() const
+   {
+      return epoll != -1 && wake != -1;
+   }
+
+   IoWait wait(int descriptor, uint32_t events)
+   {
+      return IoWait{this, descriptor, events, nullptr};
+   }
+
+   TimerWait sleep(uint64_t nanos)
+   {
+      return TimerWait{this, monotonicNanos() + nanos};
+   }
+
+   // resumed in the next round, after a look at the descriptors
+   Yield yield()
+   {
+      return Yield{this};
+   }
+
+   // task runs on this loop from its next round on; what it throws ends it
+   void spawn(Task<> task)
+   {
+      live++;
+      ready.push_back(start(this, std::move(task)).handle);
+   }
+
+   // resumes handle on the loop thread, callable from any thread
+   void post(std::coroutine_handle<> handle)
+   {
+      {
+         std::lock_guard<std::mutex> lock(postMutex);
+         posted.push_back(handle);
+      }
+      uint64_t one = 1;
+      if (write(wake, &one, sizeof(one)) == -1 && errno != EAGAIN)
+      {
+         perror("event loop wakeup");
+      }
+   }
+
+   // from the loop thread: run() returns once no spawned task is left
+   void stop()
+   {
+      stopping = true;
+   }
+
+   size_t tasks() const
+   {
+      return live;
+   }
+
+   void run()
+   {
+      struct epoll_event events[LOOP_EVENTS];
+      for (;;)
+      {
+         // only what is ready now, so a busy session can not starve the others
+         for (size_t count = ready.size(); count > 0; count--)
+         {
+            std::coroutine_handle<> handle = ready.front();
+            ready.pop_front();
+            handle.resume();
+         }
+         if (stopping && live == 0)
+         {
+            return;
+         }
+         int timeout = -1;
+         if (!ready.empty())
+         {
+            timeout = 0;
+         }
+         else if (!timers.empty())
+         {
+            uint64_t now = monotonicNanos();
+            uint64_t due = timers.top().due;
+            timeout = due <= now ? 0 : (int)((due - now) / 1000000 + 1);
+         }
+         int count = epoll_wait(epoll, events, LOOP_EVENTS, timeout);
+         for (int i = 0; i < count; i++)
+         {
+            if (events[i].data.ptr == nullptr)
+            {
+               uint64_t value;
+               if (read(wake, &value, sizeof(value)) == -1 && errno != EAGAIN)
+               {
+                  perror("event loop wakeup");
+               }
+               std::lock_guard<std::mutex> lock(postMutex);
+               ready.insert(ready.end(), posted.begin(), posted.end());
+               posted.clear();
+               continue;
+            }
+            ready.push_back(static_cast<IoWait *>(events[i].data.ptr)->waiting);
+         }
+         uint64_t now = monotonicNanos();
+         while (!timers.empty() && timers.top().due <= now)
+         {
+            ready.push_back(timers.top().waiting);
+            timers.pop();
+         }
+      }
+   }
+
+ private:
+   struct Timer
+   {
+      uint64_t due;
+      std::coroutine_handle<> waiting;
+
+      bool operator>(const Timer &other) const
+      {
+         return due > other.due;
+      }
+   };
+
+   // the frame that owns a spawned task, it frees itself at the end
+   struct Spawned
+   {
+      struct promise_type
+      {
+         Spawned get_return_object()
+         {
+            return Spawned{std::coroutine_handle<promise_type>::from_promise(*this)};
+         }
+
+         std::suspend_always initial_suspend() const noexcept
+         {
+            return {};
+         }
+
+         std::suspend_never final_suspend() const noexcept
+         {
+            return {};
+         }
+
+         void return_void() const noexcept
+         {
+         }
+
+         void unhandled_exception() const noexcept
+         {
+            std::terminate();
+         }
+      };
+
+      std::coroutine_handle<> handle;
+   };
+
+   static Spawned start(EventLoop *loop, Task<> task)
+   {
+      try
+      {
+         co_await task;
+      }
+      catch (...)
+      {
+         // a task handles its own errors, one that escapes only ends it
+      }
+      loop->live--;
+   }
+
+   int epoll = -1;
+   int wake = -1; // eventfd, post() from other threads
+   bool stopping = false;
+   size_t live = 0;
+   std::deque<std::coroutine_handle<>> ready;
+   std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+   std::mutex postMutex;
+   std::vector<std::coroutine_handle<>> posted;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// WORKER POOL
+// Threads for the work that blocks a loop thread: file system calls, a
+// lock on a mailbox that another session holds. The coroutine awaits
+// offload(), the work runs on a worker and the coroutine continues on its
+// own loop. Without threads the work runs inline, on the loop.
+
+class WorkerPool
+{
+ public:
+   void start(unsigned threads)
+   {
+      for (unsigned i = 0; i < threads; i++)
+      {
+         workers++;
+         std::thread(&WorkerPool::work, queue).detach();
+      }
+   }
+
+   bool runsInline() const
+   {
+      return workers == 0;
+   }
+
+   void submit(std::function<void()> job)
+   {
+      {
+         std::lock_guard<std::mutex> lock(queue->mutex);
+         queue->jobs.push_back(std::move(job));
+      }
+      queue->queued.notify_one();
+   }
+
+ private:
+   struct Queue
+   {
+      std::mutex mutex;
+      std::condition_variable queued;
+      std::deque<std::function<void()>> jobs;
+   };
+
+   static void work(Queue *queue)
+   {
+      for (;;)
+      {
+         std::function<void()> job;
+         {
+            std::unique_lock<std::mutex> lock(queue->mutex);
+            queue->queued.wait(lock, [queue]() { return !queue->jobs.empty(); });
+            job = std::move(queue->jobs.front());
+            queue->jobs.pop_front();
+         }
+         job();
+      }
+   }
+
+   unsigned workers = 0;
+   // the workers are detached and wait on it until the process exits, so
+   // it is never freed
+   Queue *queue = new Queue();
+};
+
+template <typename Work>
+struct OffloadWait
+{
+   using Result = std::invoke_result_t<Work &>;
+
+   WorkerPool *pool;
+   EventLoop *loop;
+   Work work;
+   std::conditional_t<std::is_void_v<Result>, bool, Result> result{};
+   std::exception_ptr error;
+
+   bool await_ready() const noexcept
+   {
+      return pool->runsInline();
+   }
+
+   void await_suspend(std::coroutine_handle<> handle)
+   {
+      pool->submit([this, handle]()
+      {
+         try
+         {
+            if constexpr (std::is_void_v<Result>)
+            {
+               work();
+            }
+            else
+            {
+               result = work();
+            }
+         }
+         catch (...)
+         {
+            error = std::current_exception();
+         }
+         loop->post(handle);
+      });
+   }
+
+   Result await_resume()
+   {
+      if (pool->runsInline())
+      {
+         return work();
+      }
+      if (error)
+      {
+         std::rethrow_exception(error);
+      }
+      if constexpr (!std::is_void_v<Result>)
+      {
+         return std::move(result);
+      }
+   }
+};
+
+// co_await offload(pool, loop, work): the result of work(), run on a worker
+template <typename Work>
+OffloadWait<Work> offload(WorkerPool &pool, EventLoop &loop, Work work)
+{
+   return OffloadWait<Work>{&pool, &loop, std::move(work)};
+}
+
+#endif
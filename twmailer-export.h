@@ -0,0 +1,277 @@
+#ifndef TWMAILER_EXPORT_H
+#define TWMAILER_EXPORT_H
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <filesystem>
+#include <string>
+#include <vector>
+#include "twmailer-spool.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// SPOOL EXPORT
+// A snapshot of one or all mailboxes is taken by hard linking every message
+// into a private directory under the spool, one flat directory per user.
+// A mailbox is linked while its version file is locked (spoolMetaLocked):
+// SEND, DEL and the retention sweep change a mailbox only under that lock,
+// so each mailbox is taken at one point in time, exactly the messages its
+// version stood for, and the version goes into the archive as
+// "<user>/.version". The lock is held for one mailbox at a time, a session
+// waits for the linking of its own mailbox at most. For "*" every mailbox
+// is consistent in itself, but they are taken one after the other and
+// share no point in time: a message stored in two mailboxes meanwhile may
+// be in the archive for one of them only; the versions tell which state of
+// each mailbox it holds. The snapshot is then streamed as a POSIX ustar
+// archive, "<user>/<file>" entries in inode order, which keeps reads mostly
+// sequential on disk.
+
+#define EXPORT_CHUNK 65536
+#define TAR_BLOCK 512
+
+struct ExportEntry
+{
+   std::string name; // <user>/<file>, relative to the snapshot
+   ino_t inode;
+};
+
+// links the messages of mailbox ("*" = every mailbox) into snapshot
+inline bool exportSnapshot(const std::string &spool, const std::string &mailbox, const std::string &snapshot,
+                           std::vector<ExportEntry> &entries)
+{
+   namespace fs = std::filesystem;
+   std::error_code error;
+   if (!fs::create_directory(snapshot, error))
+   {
+      return false;
+   }
+   std::vector<std::pair<std::string, std::string>> users; // user, mailbox directory
+   if (mailbox == "*")
+   {
+      spoolScanUsers(spool, [&users](const std::string &user, const std::string &path) { users.emplace_back(user, path); });
+   }
+   else
+   {
+      users.emplace_back(mailbox, spoolMailboxPath(spool, mailbox));
+   }
+   for (const auto &user : users)
+   {
+      std::string target = snapshot + "/" + user.first;
+      if (!fs::create_directory(target, error))
+      {
+         continue; // a flat and a sharded mailbox of one user: the first wins
+      }
+      // the archive is flat, <user>/<file>, whatever bucket a message is in
+      auto linkMailbox = [&](uint64_t)
+      {
+         spoolScanMailbox(user.second, [&](const char *name)
+         {
+            const char *slash = strrchr(name, '/');
+            std::string file = slash != NULL ? slash + 1 : name;
+            struct stat status;
+            std::string linked = target + "/" + file;
+            if (link((user.second + "/" + name).c_str(), linked.c_str()) == 0 && stat(linked.c_str(), &status) == 0)
+            {
+               entries.push_back(ExportEntry{user.first + "/" + file, status.st_ino});
+            }
+         });
+         return true;
+      };
+      uint64_t version = 0;
+      if (!spoolMetaLocked(user.second, 0, 0, 0, nullptr, &version, nullptr, false, 0, linkMailbox))
+      {
+         // a mailbox that never had a version file: linked as it is
+         linkMailbox(0);
+         continue;
+      }
+      std::string versionFile = target + "/" SPOOL_VERSION_FILE;
+      FILE *file = fopen(versionFile.c_str(), "we");
+      struct stat status;
+      if (file == NULL)
+      {
+         return false;
+      }
+      bool written = fprintf(file, "%llu\n", (unsigned long long)version) > 0;
+      if (fclose(file) != 0 || !written || stat(versionFile.c_str(), &status) != 0)
+      {
+         return false;
+      }
+      entries.push_back(ExportEntry{user.first + "/" SPOOL_VERSION_FILE, status.st_ino});
+   }
+   std::sort(entries.begin(), entries.end(),
+             [](const ExportEntry &a, const ExportEntry &b) { return a.inode < b.inode; });
+   return true;
+}
+
+inline void exportRemoveSnapshot(const std::string &snapshot)
+{
+   std::error_code error;
+   std::filesystem::remove_all(snapshot, error);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// octal field without terminator overflow, as tar expects it
+inline void tarOctal(char *field, size_t length, unsigned long long value)
+{
+   field[length - 1] = '\0';
+   for (size_t i = length - 1; i-- > 0;)
+   {
+      field[i] = (char)('0' + (value & 7));
+      value >>= 3;
+   }
+}
+
+inline bool tarHeader(char *block, const std::string &name, unsigned long long size, long long mtime)
+{
+   memset(block, 0, TAR_BLOCK);
+   // names longer than 100 bytes are split into prefix and name at a '/'
+   if (name.size() <= 100)
+   {
+      memcpy(block, name.data(), name.size());
+   }
+   else
+   {
+      size_t slash = name.rfind('/', 155);
+      if (slash == std::string::npos || name.size() - slash - 1 > 100)
+      {
+         return false;
+      }
+      memcpy(block + 345, name.data(), slash);
+      memcpy(block, name.data() + slash + 1, name.size() - slash - 1);
+   }
+   tarOctal(block + 100, 8, 0644);
+   tarOctal(block + 108, 8, 0);
+   tarOctal(block + 116, 8, 0);
+   tarOctal(block + 124, 12, size);
+   tarOctal(block + 136, 12, mtime > 0 ? mtime : 0);
+   block[156] = '0';
+   memcpy(block + 257, "ustar", 6);
+   memcpy(block + 263, "00", 2);
+   memset(block + 148, ' ', 8);
+   unsigned checksum = 0;
+   for (int i = 0; i < TAR_BLOCK; i++)
+   {
+      checksum += (unsigned char)block[i];
+   }
+   snprintf(block + 148, 8, "%06o", checksum);
+   block[155] = ' ';
+   return true;
+}
+
+// reads the snapshot as ustar piece by piece, so the caller decides where
+// the reads run and where the pieces go; fill() returns 0 at the end
+class ExportReader
+{
+ public:
+   ExportReader(const std::string &snapshot, const std::vector<ExportEntry> &entries)
+       : snapshot(snapshot), entries(entries)
+   {
+   }
+
+   ExportReader(const ExportReader &) = delete;
+   ExportReader &operator=(const ExportReader &) = delete;
+
+   ~ExportReader()
+   {
+      if (file != -1)
+      {
+         close(file);
+      }
+   }
+
+   // the next up to capacity bytes of the archive into chunk
+   size_t fill(char *chunk, size_t capacity)
+   {
+      size_t used = 0;
+      while (used < capacity && !finished)
+      {
+         if (pendingOffset < pendingLength)
+         {
+            // a header, the padding of a file or the end of the archive
+            size_t part = std::min(pendingLength - pendingOffset, capacity - used);
+            memcpy(chunk + used, pending + pendingOffset, part);
+            pendingOffset += part;
+            used += part;
+         }
+         else if (file != -1 && remaining > 0)
+         {
+            // large messages are copied through in pieces, the size in the
+            // header is kept even if the file came up short
+            size_t wanted = (size_t)std::min<off_t>(remaining, capacity - used);
+            ssize_t size = read(file, chunk + used, wanted);
+            if (size <= 0)
+            {
+               memset(chunk + used, 0, wanted);
+               size = (ssize_t)wanted;
+            }
+            used += size;
+            remaining -= size;
+         }
+         else if (file != -1)
+         {
+            close(file);
+            file = -1;
+            memset(pending, 0, TAR_BLOCK);
+            pendingOffset = 0;
+            pendingLength = fileSize % TAR_BLOCK != 0 ? TAR_BLOCK - fileSize % TAR_BLOCK : 0;
+         }
+         else if (next < entries.size())
+         {
+            open(entries[next++]);
+         }
+         else if (!trailed)
+         {
+            // end of archive: two zero blocks
+            memset(pending, 0, sizeof(pending));
+            pendingOffset = 0;
+            pendingLength = sizeof(pending);
+            trailed = true;
+         }
+         else
+         {
+            finished = true;
+         }
+      }
+      return used;
+   }
+
+ private:
+   const std::string &snapshot;
+   const std::vector<ExportEntry> &entries;
+   size_t next = 0;
+   int file = -1;
+   off_t fileSize = 0;
+   off_t remaining = 0;
+   char pending[2 * TAR_BLOCK];
+   size_t pendingOffset = 0;
+   size_t pendingLength = 0;
+   bool trailed = false;
+   bool finished = false;
+
+   // a file that can not be read or named in a header is skipped
+   void open(const ExportEntry &entry)
+   {
+      file = ::open((snapshot + "/" + entry.name).c_str(), O_RDONLY | O_CLOEXEC);
+      if (file == -1)
+      {
+         return;
+      }
+      struct stat status;
+      if (fstat(file, &status) == -1 || !tarHeader(pending, entry.name, status.st_size, (long long)status.st_mtime))
+      {
+         close(file);
+         file = -1;
+         return;
+      }
+      fileSize = status.st_size;
+      remaining = status.st_size;
+      pendingOffset = 0;
+      pendingLength = TAR_BLOCK;
+   }
+};
+
+#endif
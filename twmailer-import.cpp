@@ -0,0 +1,268 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "twmailer-spool.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// TWMAILER-IMPORT
+// Offline bulk import of mbox files and Maildir directories into a mailbox:
+//    twmailer-import <spool-directory> <user> <mbox-file|maildir>...
+// Messages are parsed on all cores (TWMAILER_IMPORT_THREADS overrides) and
+// written straight into the mailbox of <user> in the layout sendMessage() uses.
+// An mbox is mapped into memory and cut at "From " lines into one range per
+// thread, Maildir files are handed out one by one. Every thread stores its
+// messages in batches of IMPORT_BATCH, which take the lock of the mailbox
+// version once (see SPOOL BATCH).
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define IMPORT_BATCH 256 // messages placed under one lock
+
+///////////////////////////////////////////////////////////////////////////////
+
+using namespace std;
+using namespace std::filesystem;
+
+///////////////////////////////////////////////////////////////////////////////
+
+string mailboxPath;
+string mailboxUser;
+atomic<uint64_t> imported{0};
+atomic<uint64_t> failed{0};
+
+///////////////////////////////////////////////////////////////////////////////
+
+void storeMessage(MailParser& parser, SpoolBatch& batch);
+void storeBatch(SpoolBatch& batch);
+void importRange(string_view text);
+int importMbox(const char* filename, int threads);
+int importMaildir(const path& directory, int threads);
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv)
+{
+   if (argc < 4)
+   {
+      cerr << "Usage: " << argv[0] << " <spool-directory> <user> <mbox-file|maildir>..." << endl;
+      return EXIT_FAILURE;
+   }
+   mailboxUser = argv[2];
+   mailboxPath = spoolMailboxPath(argv[1], mailboxUser);
+   if (!spoolCreateDirectories(mailboxPath))
+   {
+      cerr << "failed to create directory " << mailboxPath << endl;
+      return EXIT_FAILURE;
+   }
+
+   int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+   if (getenv("TWMAILER_IMPORT_THREADS") != NULL && atoi(getenv("TWMAILER_IMPORT_THREADS")) > 0)
+   {
+      threads = atoi(getenv("TWMAILER_IMPORT_THREADS"));
+   }
+   if (threads < 1)
+   {
+      threads = 1;
+   }
+
+   int result = EXIT_SUCCESS;
+   for (int i = 3; i < argc; i++)
+   {
+      if (is_directory(argv[i]))
+      {
+         result |= importMaildir(argv[i], threads);
+      }
+      else
+      {
+         result |= importMbox(argv[i], threads);
+      }
+   }
+
+   printf("imported %llu messages into %s, %llu failed\n",
+          (unsigned long long)imported.load(), mailboxPath.c_str(), (unsigned long long)failed.load());
+   return result != EXIT_SUCCESS || failed.load() != 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+void storeMessage(MailParser& parser, SpoolBatch& batch)
+{
+   SpoolMessage message = parser.finish(mailboxUser);
+   if (!batch.add(mailboxPath, message))
+   {
+      failed.fetch_add(1, memory_order_relaxed);
+   }
+   if (batch.size() >= IMPORT_BATCH)
+   {
+      storeBatch(batch);
+   }
+}
+
+void storeBatch(SpoolBatch& batch)
+{
+   size_t count = batch.size();
+   if (batch.commit(mailboxPath, mailboxUser))
+   {
+      imported.fetch_add(count, memory_order_relaxed);
+   }
+   else
+   {
+      perror(mailboxPath.c_str());
+      failed.fetch_add(count, memory_order_relaxed);
+   }
+}
+
+// parses the mbox messages in text, which starts at a "From " line
+void importRange(string_view text)
+{
+   MailParser parser;
+   SpoolBatch batch;
+   while (!text.empty())
+   {
+      size_t end = text.find('\n');
+      string_view line = text.substr(0, end);
+      if (mboxLine(parser, line))
+      {
+         storeMessage(parser, batch);
+      }
+      text.remove_prefix(end == string_view::npos ? text.size() : end + 1);
+   }
+   if (parser.started)
+   {
+      storeMessage(parser, batch);
+   }
+   storeBatch(batch);
+}
+
+int importMbox(const char* filename, int threads)
+{
+   int file = open(filename, O_RDONLY | O_CLOEXEC);
+   if (file == -1)
+   {
+      perror(filename);
+      return EXIT_FAILURE;
+   }
+   struct stat status;
+   if (fstat(file, &status) == -1)
+   {
+      perror(filename);
+      close(file);
+      return EXIT_FAILURE;
+   }
+   if (status.st_size == 0)
+   {
+      close(file);
+      return EXIT_SUCCESS;
+   }
+   void* mapped = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+   close(file);
+   if (mapped == MAP_FAILED)
+   {
+      perror(filename);
+      return EXIT_FAILURE;
+   }
+   madvise(mapped, status.st_size, MADV_SEQUENTIAL);
+   string_view text((const char*)mapped, status.st_size);
+
+   // cut points are moved forward to the next message start
+   vector<size_t> cuts = {0};
+   for (int i = 1; i < threads; i++)
+   {
+      size_t cut = text.size() / threads * i;
+      if (cut <= cuts.back())
+      {
+         continue;
+      }
+      cut = text.find("\nFrom ", cut - 1);
+      if (cut == string_view::npos)
+      {
+         break;
+      }
+      if (cut + 1 > cuts.back())
+      {
+         cuts.push_back(cut + 1);
+      }
+   }
+   cuts.push_back(text.size());
+
+   vector<thread> workers;
+   for (size_t i = 0; i + 1 < cuts.size(); i++)
+   {
+      workers.emplace_back(importRange, text.substr(cuts[i], cuts[i + 1] - cuts[i]));
+   }
+   for (auto &worker : workers)
+   {
+      worker.join();
+   }
+   munmap(mapped, status.st_size);
+   return EXIT_SUCCESS;
+}
+
+int importMaildir(const path& directory, int threads)
+{
+   // a Maildir keeps its messages in cur/ and new/, a plain directory of
+   // message files is accepted as well
+   vector<string> files;
+   for (const char* sub : {"cur", "new", ""})
+   {
+      path folder = directory / sub;
+      if (!is_directory(folder) || (*sub == '\0' && !files.empty()))
+      {
+         continue;
+      }
+      for (auto const& entry : directory_iterator{folder})
+      {
+         if (entry.is_regular_file())
+         {
+            files.push_back(entry.path().native());
+         }
+      }
+   }
+
+   atomic<size_t> next{0};
+   auto worker = [&files, &next]()
+   {
+      MailParser parser;
+      SpoolBatch batch;
+      for (size_t i = next.fetch_add(1); i < files.size(); i = next.fetch_add(1))
+      {
+         FILE* file = fopen(files[i].c_str(), "r");
+         if (file == NULL)
+         {
+            failed.fetch_add(1, memory_order_relaxed);
+            continue;
+         }
+         char* line = NULL;
+         size_t capacity = 0;
+         ssize_t length;
+         while ((length = getline(&line, &capacity, file)) != -1)
+         {
+            parser.line(string_view(line, length > 0 && line[length - 1] == '\n' ? length - 1 : length));
+         }
+         free(line);
+         fclose(file);
+         storeMessage(parser, batch);
+      }
+      storeBatch(batch);
+   };
+
+   vector<thread> workers;
+   for (int i = 0; i < threads; i++)
+   {
+      workers.emplace_back(worker);
+   }
+   for (auto &thread : workers)
+   {
+      thread.join();
+   }
+   return EXIT_SUCCESS;
+}
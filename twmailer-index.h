@@ -0,0 +1,474 @@
+#ifndef TWMAILER_INDEX_H
+#define TWMAILER_INDEX_H
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "twmailer-spool.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// MAILBOX INDEX
+// The sorted message names of a mailbox are kept in memory together with the
+// mailbox version they were listed at, so a command only lists the directory
+// again once .version moved on. The server forgets an index after its own
+// writes, other writers (twmailer-import, twmailer-migrate) advance the
+// version.
+//
+// All indexes are saved to <spool>/.index on shutdown and periodically. At
+// startup that snapshot is mapped, not read: only the header and the slot
+// table are checked. A record is verified when its mailbox is first used
+// (checksum, and its version against .version), while a background pass
+// checks all of them on several threads and lists again only the mailboxes
+// that changed since the snapshot was taken.
+//    header   "TWIDX001", slot count, table offset, table checksum
+//    records  checksum, version, path length, name count, byte count, then
+//             the path and the names, each '\0' terminated, 8 byte aligned
+//    slots    (hash of the path, record offset), sorted by hash
+
+#define INDEX_SNAPSHOT_FILE ".index"
+#define INDEX_MAGIC "TWIDX001"
+
+// FNV-1a over 8 byte words, catches torn and damaged records
+inline uint64_t indexChecksum(const char *data, size_t length)
+{
+   uint64_t hash = 14695981039346656037ull;
+   uint64_t word;
+   size_t i = 0;
+   for (; i + 8 <= length; i += 8)
+   {
+      memcpy(&word, data + i, 8);
+      hash = (hash ^ word) * 1099511628211ull;
+   }
+   for (; i < length; i++)
+   {
+      hash = (hash ^ (unsigned char)data[i]) * 1099511628211ull;
+   }
+   return hash ^ (hash >> 29);
+}
+
+struct IndexHeader
+{
+   char magic[8];
+   uint64_t count;
+   uint64_t tableOffset;
+   uint64_t tableChecksum;
+};
+
+struct IndexSlot
+{
+   uint64_t hash;
+   uint64_t offset;
+};
+
+struct IndexRecord
+{
+   uint64_t checksum; // of everything after it, path and names included
+   uint64_t version;
+   uint32_t pathLength;
+   uint32_t count;
+   uint64_t bytes; // path and names
+};
+
+struct MailboxNames
+{
+   uint64_t version = 0;
+   std::vector<std::string> names; // in spoolSortMessages() order
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+class IndexSnapshot
+{
+ public:
+   enum State : uint8_t
+   {
+      Unchecked = 0,
+      Valid,
+      Stale // damaged, outdated or replaced by an index in memory
+   };
+
+   IndexSnapshot() = default;
+   IndexSnapshot(const IndexSnapshot &) = delete;
+   IndexSnapshot &operator=(const IndexSnapshot &) = delete;
+
+   // once, before the first lookup
+   bool map(const std::string &filename)
+   {
+      int file = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+      if (file == -1)
+      {
+         return false;
+      }
+      struct stat status;
+      void *mapped = MAP_FAILED;
+      if (fstat(file, &status) == 0 && status.st_size >= (off_t)sizeof(IndexHeader))
+      {
+         mapped = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+      }
+      close(file);
+      if (mapped == MAP_FAILED)
+      {
+         return false;
+      }
+      const char *data = (const char *)mapped;
+      size_t size = status.st_size;
+      IndexHeader header;
+      memcpy(&header, data, sizeof(header));
+      if (memcmp(header.magic, INDEX_MAGIC, sizeof(header.magic)) != 0 || header.tableOffset > size
+          || header.count > (size - header.tableOffset) / sizeof(IndexSlot)
+          || indexChecksum(data + header.tableOffset, header.count * sizeof(IndexSlot)) != header.tableChecksum)
+      {
+         munmap(mapped, size);
+         return false;
+      }
+      base = data;
+      length = size;
+      count = header.count;
+      table = data + header.tableOffset;
+      states = std::make_unique<std::atomic<uint8_t>[]>(count);
+      return true;
+   }
+
+   size_t size() const
+   {
+      return count;
+   }
+
+   IndexSlot slot(size_t i) const
+   {
+      IndexSlot slot;
+      memcpy(&slot, table + i * sizeof(IndexSlot), sizeof(slot));
+      return slot;
+   }
+
+   std::atomic<uint8_t> &state(size_t i)
+   {
+      return states[i];
+   }
+
+   // slot of the record of mailbox, size() if there is none
+   size_t find(std::string_view mailbox) const
+   {
+      uint64_t hash = indexChecksum(mailbox.data(), mailbox.size());
+      size_t low = 0;
+      size_t high = count;
+      while (low < high)
+      {
+         size_t middle = low + (high - low) / 2;
+         if (slot(middle).hash < hash)
+         {
+            low = middle + 1;
+         }
+         else
+         {
+            high = middle;
+         }
+      }
+      for (; low < count && slot(low).hash == hash; low++)
+      {
+         IndexRecord record;
+         const char *payload = locate(low, record);
+         if (payload != nullptr && std::string_view(payload, record.pathLength) == mailbox)
+         {
+            return low;
+         }
+      }
+      return count;
+   }
+
+   // the record of slot i if its checksum holds; names may be null when
+   // only path and version are wanted
+   bool read(size_t i, std::string &path, uint64_t &version, MailboxNames *names) const
+   {
+      IndexRecord record;
+      const char *payload = locate(i, record);
+      if (payload == nullptr
+          || indexChecksum(payload - sizeof(record) + sizeof(record.checksum),
+                           sizeof(record) - sizeof(record.checksum) + record.bytes) != record.checksum)
+      {
+         return false;
+      }
+      path.assign(payload, record.pathLength);
+      version = record.version;
+      if (names == nullptr)
+      {
+         return true;
+      }
+      names->version = record.version;
+      names->names.clear();
+      names->names.reserve(record.count);
+      const char *name = payload + record.pathLength + 1;
+      const char *end = payload + record.bytes;
+      for (uint32_t n = 0; n < record.count; n++)
+      {
+         const char *terminator = (const char *)memchr(name, '\0', end - name);
+         if (terminator == nullptr)
+         {
+            return false;
+         }
+         names->names.emplace_back(name, terminator - name);
+         name = terminator + 1;
+      }
+      return true;
+   }
+
+   // the record of slot i as it is stored, for the next snapshot
+   std::string_view raw(size_t i) const
+   {
+      IndexRecord record;
+      const char *payload = locate(i, record);
+      return payload == nullptr ? std::string_view() : std::string_view(payload - sizeof(record), sizeof(record) + record.bytes);
+   }
+
+ private:
+   const char *base = nullptr;
+   size_t length = 0;
+   size_t count = 0;
+   const char *table = nullptr;
+   std::unique_ptr<std::atomic<uint8_t>[]> states;
+
+   const char *locate(size_t i, IndexRecord &record) const
+   {
+      uint64_t offset = slot(i).offset;
+      if (offset < sizeof(IndexHeader) || offset > length || length - offset < sizeof(record))
+      {
+         return nullptr;
+      }
+      memcpy(&record, base + offset, sizeof(record));
+      if (record.bytes > length - offset - sizeof(record) || record.pathLength >= record.bytes)
+      {
+         return nullptr;
+      }
+      return base + offset + sizeof(record);
+   }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+struct IndexEntry
+{
+   std::shared_ptr<const MailboxNames> names; // null until listed, or forgotten
+   uint64_t generation = 0;                   // counts indexForget() calls
+};
+
+inline std::mutex indexMutex;
+inline std::unordered_map<std::string, IndexEntry> indexEntries;
+inline IndexSnapshot indexSnapshot;
+
+inline std::shared_ptr<const MailboxNames> indexList(const std::string &mailbox, uint64_t version)
+{
+   auto listed = std::make_shared<MailboxNames>();
+   listed->version = version;
+   spoolScanMailbox(mailbox, [&listed](const char *name) { listed->names.emplace_back(name); });
+   spoolSortMessages(listed->names);
+   return listed;
+}
+
+// kept unless the mailbox was written since generation was taken, a listing
+// that raced with a write could miss its message
+inline void indexStore(const std::string &mailbox, std::shared_ptr<const MailboxNames> names, uint64_t generation)
+{
+   std::lock_guard<std::mutex> lock(indexMutex);
+   IndexEntry &entry = indexEntries[mailbox];
+   if (entry.generation == generation)
+   {
+      entry.names = std::move(names);
+   }
+}
+
+// after SEND, IMPORT and DEL, once the file is in place or gone
+inline void indexForget(const std::string &mailbox)
+{
+   std::lock_guard<std::mutex> lock(indexMutex);
+   IndexEntry &entry = indexEntries[mailbox];
+   entry.names = nullptr;
+   entry.generation++;
+}
+
+// the names of mailbox from memory, the snapshot or the directory. A mailbox
+// without .version (older layouts) is listed every time.
+inline std::shared_ptr<const MailboxNames> indexGet(const std::string &mailbox)
+{
+   std::shared_ptr<const MailboxNames> cached;
+   uint64_t generation;
+   {
+      std::lock_guard<std::mutex> lock(indexMutex);
+      IndexEntry &entry = indexEntries[mailbox];
+      cached = entry.names;
+      generation = entry.generation;
+   }
+   uint64_t version = spoolVersion(mailbox);
+   if (version != 0 && cached != nullptr && cached->version == version)
+   {
+      return cached;
+   }
+   size_t slot = cached == nullptr && version != 0 ? indexSnapshot.find(mailbox) : indexSnapshot.size();
+   if (slot < indexSnapshot.size() && indexSnapshot.state(slot) != IndexSnapshot::Stale)
+   {
+      auto stored = std::make_shared<MailboxNames>();
+      std::string path;
+      uint64_t storedVersion;
+      bool current = indexSnapshot.read(slot, path, storedVersion, stored.get()) && storedVersion == version;
+      indexSnapshot.state(slot) = IndexSnapshot::Stale; // the entry in memory takes over
+      if (current)
+      {
+         indexStore(mailbox, stored, generation);
+         return stored;
+      }
+   }
+   auto listed = indexList(mailbox, version);
+   indexStore(mailbox, listed, generation);
+   return listed;
+}
+
+// checks every snapshot record against its mailbox on threads threads and
+// lists the changed mailboxes again; counts the intact and the listed ones
+inline void indexWarm(unsigned threads, uint64_t &intact, uint64_t &listed)
+{
+   std::atomic<size_t> next{0};
+   std::atomic<uint64_t> valid{0};
+   std::atomic<uint64_t> changed{0};
+   auto check = [&]()
+   {
+      for (size_t slot; (slot = next.fetch_add(1, std::memory_order_relaxed)) < indexSnapshot.size();)
+      {
+         if (indexSnapshot.state(slot) != IndexSnapshot::Unchecked)
+         {
+            continue; // used meanwhile
+         }
+         std::string path;
+         uint64_t version;
+         if (indexSnapshot.read(slot, path, version, nullptr) && version != 0 && spoolVersion(path) == version)
+         {
+            uint8_t unchecked = IndexSnapshot::Unchecked;
+            indexSnapshot.state(slot).compare_exchange_strong(unchecked, IndexSnapshot::Valid);
+            valid.fetch_add(1, std::memory_order_relaxed);
+            continue;
+         }
+         indexSnapshot.state(slot) = IndexSnapshot::Stale;
+         struct stat status;
+         if (!path.empty() && stat(path.c_str(), &status) == 0 && S_ISDIR(status.st_mode))
+         {
+            indexGet(path);
+            changed.fetch_add(1, std::memory_order_relaxed);
+         }
+      }
+   };
+   std::vector<std::thread> workers;
+   for (unsigned i = 1; i < threads; i++)
+   {
+      workers.emplace_back(check);
+   }
+   check();
+   for (std::thread &worker : workers)
+   {
+      worker.join();
+   }
+   intact = valid.load();
+   listed = changed.load();
+}
+
+// writes the indexes in memory and the snapshot records they did not replace
+// to <spool>/.index; the number of mailboxes, -1 on failure
+inline long indexSave(const std::string &spool)
+{
+   static std::mutex saving;
+   std::lock_guard<std::mutex> once(saving);
+   std::vector<std::pair<std::string, std::shared_ptr<const MailboxNames>>> current;
+   {
+      std::lock_guard<std::mutex> lock(indexMutex);
+      for (const auto &entry : indexEntries)
+      {
+         if (entry.second.names != nullptr && entry.second.names->version != 0)
+         {
+            current.emplace_back(entry.first, entry.second.names);
+         }
+      }
+   }
+   std::unordered_set<std::string_view> replaced;
+   for (const auto &entry : current)
+   {
+      replaced.insert(entry.first);
+   }
+
+   std::string filename = spool + "/" INDEX_SNAPSHOT_FILE;
+   std::string temporary = spoolTemporaryPath(filename);
+   FILE *file = fopen(temporary.c_str(), "w");
+   if (file == NULL)
+   {
+      return -1;
+   }
+   std::vector<IndexSlot> slots;
+   uint64_t offset = sizeof(IndexHeader);
+   IndexHeader header = {};
+   bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+   auto emit = [&](uint64_t hash, const char *data, size_t length)
+   {
+      static const char padding[8] = {};
+      size_t padded = (length + 7) & ~(size_t)7;
+      written = written && fwrite(data, 1, length, file) == length && fwrite(padding, 1, padded - length, file) == padded - length;
+      slots.push_back(IndexSlot{hash, offset});
+      offset += padded;
+   };
+   std::string record;
+   for (const auto &entry : current)
+   {
+      IndexRecord head = {};
+      head.version = entry.second->version;
+      head.pathLength = (uint32_t)entry.first.size();
+      head.count = (uint32_t)entry.second->names.size();
+      record.assign(sizeof(head), '\0');
+      record.append(entry.first).push_back('\0');
+      for (const std::string &name : entry.second->names)
+      {
+         record.append(name).push_back('\0');
+      }
+      head.bytes = record.size() - sizeof(head);
+      memcpy(&record[0], &head, sizeof(head));
+      head.checksum = indexChecksum(record.data() + sizeof(head.checksum), record.size() - sizeof(head.checksum));
+      memcpy(&record[0], &head.checksum, sizeof(head.checksum));
+      emit(indexChecksum(entry.first.data(), entry.first.size()), record.data(), record.size());
+   }
+   for (size_t i = 0; i < indexSnapshot.size(); i++)
+   {
+      std::string path;
+      uint64_t version;
+      if (indexSnapshot.state(i) == IndexSnapshot::Stale || !indexSnapshot.read(i, path, version, nullptr)
+          || replaced.count(path) != 0)
+      {
+         continue;
+      }
+      std::string_view raw = indexSnapshot.raw(i);
+      emit(indexSnapshot.slot(i).hash, raw.data(), raw.size());
+   }
+   std::sort(slots.begin(), slots.end(), [](const IndexSlot &a, const IndexSlot &b) { return a.hash < b.hash; });
+   memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+   header.count = slots.size();
+   header.tableOffset = offset;
+   header.tableChecksum = indexChecksum((const char *)slots.data(), slots.size() * sizeof(IndexSlot));
+   written = written && fwrite(slots.data(), sizeof(IndexSlot), slots.size(), file) == slots.size()
+             && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1
+             && fflush(file) == 0 && fsync(fileno(file)) == 0;
+   if (fclose(file) != 0 || !written || rename(temporary.c_str(), filename.c_str()) != 0)
+   {
+      unlink(temporary.c_str());
+      return -1;
+   }
+   return (long)slots.size();
+}
+
+#endif
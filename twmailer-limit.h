@@ -0,0 +1,165 @@
+#ifndef TWMAILER_LIMIT_H
+#define TWMAILER_LIMIT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+///////////////////////////////////////////////////////////////////////////////
+// RATE LIMITS
+// Token buckets per user and per source address: one for commands, one for
+// received bytes. A command over its rate is refused, bytes over their rate
+// are not refused but delayed, which slows the sender down through TCP. The
+// limits are read from a file of "<name> <value>" lines (see limitsLoad)
+// and can be reloaded at any time; 0 means unlimited.
+
+#define LIMIT_SHARDS 16
+#define LIMIT_DELAY_MAX 1.0 // seconds a single receive is held back at most
+
+struct LimitConfig
+{
+   std::atomic<double> commandRate{0}; // commands per second
+   std::atomic<double> commandBurst{0};
+   std::atomic<double> byteRate{0}; // received bytes per second
+   std::atomic<double> byteBurst{0};
+   std::atomic<int64_t> maxSessions{0}; // open sessions, more are turned away
+   std::atomic<int64_t> maxCommands{0}; // commands running at once
+};
+
+struct TokenBucket
+{
+   double tokens = 0;
+   uint64_t last = 0; // 0 = never used, starts full
+
+   void refill(double rate, double burst, uint64_t now)
+   {
+      tokens = last == 0 ? burst : std::min(burst, tokens + (double)(now - last) / 1e9 * rate);
+      last = now;
+   }
+
+   // takes cost if it is there
+   bool admit(double cost, double rate, double burst, uint64_t now)
+   {
+      refill(rate, burst, now);
+      if (tokens < cost)
+      {
+         return false;
+      }
+      tokens -= cost;
+      return true;
+   }
+
+   // always takes cost, returns the seconds until the debt is paid off
+   double charge(double cost, double rate, double burst, uint64_t now)
+   {
+      refill(rate, burst, now);
+      tokens -= cost;
+      return tokens < 0 ? -tokens / rate : 0;
+   }
+};
+
+struct LimitEntry
+{
+   TokenBucket commands;
+   TokenBucket bytes;
+};
+
+// buckets by key (user or address), sharded so sessions rarely share a lock
+class LimitTable
+{
+ public:
+   template <class Use>
+   auto with(const std::string &key, Use use)
+   {
+      Shard &shard = shards[std::hash<std::string>()(key) % LIMIT_SHARDS];
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      return use(shard.entries[key]);
+   }
+
+   // forgets buckets unused for longer than idle, they would be full again
+   void prune(uint64_t now, uint64_t idle)
+   {
+      for (Shard &shard : shards)
+      {
+         std::lock_guard<std::mutex> lock(shard.mutex);
+         for (auto entry = shard.entries.begin(); entry != shard.entries.end();)
+         {
+            uint64_t last = std::max(entry->second.commands.last, entry->second.bytes.last);
+            entry = now - last > idle ? shard.entries.erase(entry) : std::next(entry);
+         }
+      }
+   }
+
+ private:
+   struct Shard
+   {
+      std::mutex mutex;
+      std::unordered_map<std::string, LimitEntry> entries;
+   };
+   Shard shards[LIMIT_SHARDS];
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+// commands_per_second, command_burst, bytes_per_second, byte_burst,
+// max_sessions, max_commands; '#' starts a comment. A burst below its rate
+// is raised to the rate.
+inline bool limitsLoad(const char *filename, LimitConfig &config)
+{
+   FILE *file = fopen(filename, "r");
+   if (file == NULL)
+   {
+      return false;
+   }
+   double values[6] = {0, 0, 0, 0, 0, 0};
+   const char *names[6] = {"commands_per_second", "command_burst", "bytes_per_second", "byte_burst",
+                           "max_sessions", "max_commands"};
+   char line[256];
+   bool valid = true;
+   while (fgets(line, sizeof(line), file) != NULL)
+   {
+      line[strcspn(line, "#\r\n")] = '\0';
+      char name[64];
+      double value;
+      int fields = sscanf(line, "%63s %lf", name, &value);
+      if (fields <= 0)
+      {
+         continue;
+      }
+      int found = -1;
+      for (int i = 0; i < 6; i++)
+      {
+         if (strcmp(name, names[i]) == 0)
+         {
+            found = i;
+         }
+      }
+      if (fields != 2 || found == -1 || value < 0)
+      {
+         fprintf(stderr, "%s: invalid line \"%s\"\n", filename, line);
+         valid = false;
+         continue;
+      }
+      values[found] = value;
+   }
+   fclose(file);
+   if (!valid)
+   {
+      return false; // the running limits stay
+   }
+   config.commandRate.store(values[0]);
+   config.commandBurst.store(std::max(values[1], values[0]));
+   config.byteRate.store(values[2]);
+   config.byteBurst.store(std::max(values[3], values[2]));
+   config.maxSessions.store((int64_t)values[4]);
+   config.maxCommands.store((int64_t)values[5]);
+   return true;
+}
+
+#endif
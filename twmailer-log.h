@@ -0,0 +1,219 @@
+#ifndef TWMAILER_LOG_H
+#define TWMAILER_LOG_H
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+
+///////////////////////////////////////////////////////////////////////////////
+// ASYNCHRONOUS LOGGER
+// Request threads only format the line into a slot of a bounded lock-free
+// ring buffer (Vyukov MPMC queue); a background thread writes the slots out.
+// When the ring is full the line is dropped and counted instead of blocking.
+//
+// TWMAILER_LOG_LEVEL: error, warn, info (default), debug, trace
+// TWMAILER_LOG_FILE:  append to this file instead of stderr
+// Message bodies are only logged at trace level.
+
+#define LOG_SLOTS 4096 // must be a power of two
+#define LOG_LINE 256
+
+enum LogLevel
+{
+   LOG_LEVEL_ERROR = 0,
+   LOG_LEVEL_WARN,
+   LOG_LEVEL_INFO,
+   LOG_LEVEL_DEBUG,
+   LOG_LEVEL_TRACE
+};
+
+struct LogSlot
+{
+   std::atomic<size_t> sequence;
+   char line[LOG_LINE];
+};
+
+struct LogRing
+{
+   LogSlot slots[LOG_SLOTS];
+   alignas(64) std::atomic<size_t> head{0}; // next slot to write
+   alignas(64) std::atomic<size_t> tail{0}; // next slot to drain
+   std::atomic<uint64_t> dropped{0};
+
+   LogRing()
+   {
+      for (size_t i = 0; i < LOG_SLOTS; i++)
+      {
+         slots[i].sequence.store(i, std::memory_order_relaxed);
+      }
+   }
+};
+
+inline LogRing logRing;
+inline std::atomic<int> logLevel{LOG_LEVEL_INFO};
+inline std::atomic<int> logRunning{0};
+inline std::thread logThread;
+inline FILE *logOutput = stderr;
+
+inline const char *logLevelName(int level)
+{
+   static const char *names[] = {"ERROR", "WARN", "INFO", "DEBUG", "TRACE"};
+   return names[level];
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+inline void logWrite(int level, const char *format, ...)
+{
+   size_t position = logRing.head.load(std::memory_order_relaxed);
+   LogSlot *slot;
+   for (;;)
+   {
+      slot = &logRing.slots[position & (LOG_SLOTS - 1)];
+      size_t sequence = slot->sequence.load(std::memory_order_acquire);
+      intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+      if (difference == 0)
+      {
+         if (logRing.head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+         {
+            break;
+         }
+      }
+      else if (difference < 0)
+      {
+         logRing.dropped.fetch_add(1, std::memory_order_relaxed);
+         return;
+      }
+      else
+      {
+         position = logRing.head.load(std::memory_order_relaxed);
+      }
+   }
+
+   struct timespec now;
+   struct tm local;
+   clock_gettime(CLOCK_REALTIME, &now);
+   localtime_r(&now.tv_sec, &local);
+   int length = (int)strftime(slot->line, LOG_LINE, "%H:%M:%S", &local);
+   length += snprintf(slot->line + length, LOG_LINE - length, ".%03ld %-5s ",
+                      now.tv_nsec / 1000000, logLevelName(level));
+   va_list arguments;
+   va_start(arguments, format);
+   vsnprintf(slot->line + length, LOG_LINE - length, format, arguments);
+   va_end(arguments);
+
+   slot->sequence.store(position + 1, std::memory_order_release);
+}
+
+#define LOG_AT(level, ...)                                                      \
+   do                                                                          \
+   {                                                                           \
+      if (logLevel.load(std::memory_order_relaxed) >= (level))                 \
+      {                                                                        \
+         logWrite((level), __VA_ARGS__);                                       \
+      }                                                                        \
+   } while (0)
+
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_TRACE(...) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
+
+///////////////////////////////////////////////////////////////////////////////
+
+// writes every committed slot, returns the number of lines written
+inline int logDrain()
+{
+   int written = 0;
+   size_t position = logRing.tail.load(std::memory_order_relaxed);
+   for (;;)
+   {
+      LogSlot &slot = logRing.slots[position & (LOG_SLOTS - 1)];
+      if (slot.sequence.load(std::memory_order_acquire) != position + 1)
+      {
+         break;
+      }
+      fputs(slot.line, logOutput);
+      fputc('\n', logOutput);
+      slot.sequence.store(position + LOG_SLOTS, std::memory_order_release);
+      position++;
+      written++;
+   }
+   logRing.tail.store(position, std::memory_order_relaxed);
+
+   uint64_t dropped = logRing.dropped.exchange(0, std::memory_order_relaxed);
+   if (dropped != 0)
+   {
+      fprintf(logOutput, "logger dropped %llu lines\n", (unsigned long long)dropped);
+   }
+   if (written != 0 || dropped != 0)
+   {
+      fflush(logOutput);
+   }
+   return written;
+}
+
+inline void logStart()
+{
+   const char *level = getenv("TWMAILER_LOG_LEVEL");
+   if (level != NULL)
+   {
+      for (int i = LOG_LEVEL_ERROR; i <= LOG_LEVEL_TRACE; i++)
+      {
+         if (strcasecmp(level, logLevelName(i)) == 0)
+         {
+            logLevel = i;
+         }
+      }
+   }
+   const char *filename = getenv("TWMAILER_LOG_FILE");
+   if (filename != NULL)
+   {
+      FILE *file = fopen(filename, "a");
+      if (file == NULL)
+      {
+         perror("open log file");
+      }
+      else
+      {
+         logOutput = file;
+      }
+   }
+
+   logRunning = 1;
+   logThread = std::thread([]()
+   {
+      while (logRunning.load(std::memory_order_relaxed))
+      {
+         if (logDrain() == 0)
+         {
+            usleep(2000);
+         }
+      }
+      logDrain();
+   });
+}
+
+inline void logStop()
+{
+   logRunning = 0;
+   if (logThread.joinable())
+   {
+      logThread.join();
+   }
+   if (logOutput != stderr)
+   {
+      fclose(logOutput);
+      logOutput = stderr;
+   }
+}
+
+#endif
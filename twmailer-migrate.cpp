@@ -0,0 +1,168 @@
+#include <sys/stat.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "twmailer-spool.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// TWMAILER-MIGRATE
+// Moves a spool from the flat layout (<spool>/<user>/<file>) into the
+// sharded one (see SHARDED LAYOUT in twmailer-spool.h) while the server
+// keeps running:
+//    twmailer-migrate <spool-directory>
+// Every step is a single rename() inside the spool, so a mailbox or message
+// is always complete at either its old or its new place. The server looks
+// a mailbox up again for every command and follows it; only a command that
+// runs in the very moment its mailbox or message moves can fail with ERR.
+// Running it again is harmless, it continues where it stopped.
+
+///////////////////////////////////////////////////////////////////////////////
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+uint64_t mailboxes = 0;
+uint64_t moved = 0; // messages
+uint64_t failed = 0;
+
+///////////////////////////////////////////////////////////////////////////////
+
+bool moveMailbox(const string& spool, const string& user, const string& flat);
+void mergeMailbox(const string& user, const string& flat, const string& sharded);
+void bucketMessages(const string& mailbox);
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv)
+{
+   if (argc != 2)
+   {
+      cerr << "Usage: " << argv[0] << " <spool-directory>" << endl;
+      return EXIT_FAILURE;
+   }
+   string spool = argv[1];
+
+   vector<pair<string, string>> users;
+   spoolScanUsers(spool, [&users](const string& user, const string& path) { users.emplace_back(user, path); });
+   for (const auto& user : users)
+   {
+      string mailbox = user.second;
+      if (mailbox == spool + "/" + user.first)
+      {
+         if (!moveMailbox(spool, user.first, mailbox))
+         {
+            continue;
+         }
+         mailbox = spoolShardedPath(spool, user.first);
+      }
+      bucketMessages(mailbox);
+   }
+
+   printf("moved %llu mailboxes and %llu messages in %s, %llu failed\n",
+          (unsigned long long)mailboxes, (unsigned long long)moved, spool.c_str(), (unsigned long long)failed);
+   return failed != 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// the whole mailbox with one rename, merged file by file if the sharded one
+// exists already
+bool moveMailbox(const string& spool, const string& user, const string& flat)
+{
+   string sharded = spoolShardedPath(spool, user);
+   if (!spoolCreateDirectories(sharded.substr(0, sharded.rfind('/'))))
+   {
+      perror(sharded.c_str());
+      failed++;
+      return false;
+   }
+   if (rename(flat.c_str(), sharded.c_str()) == 0)
+   {
+      mailboxes++;
+      return true;
+   }
+   if (errno != EEXIST && errno != ENOTEMPTY)
+   {
+      perror(flat.c_str());
+      failed++;
+      return false;
+   }
+   mergeMailbox(user, flat, sharded);
+   return true;
+}
+
+void mergeMailbox(const string& user, const string& flat, const string& sharded)
+{
+   // both mailboxes count ids on their own, every message gets a new one
+   vector<string> names;
+   spoolScanMailbox(flat, [&names](const char* name) { names.emplace_back(name); });
+   spoolSortMessages(names);
+   for (const string& name : names)
+   {
+      string source = flat + "/" + name;
+      string target;
+      struct stat status;
+      if (stat(source.c_str(), &status) == 0 && spoolPlaceMessage(sharded, user, status.st_size, [&source](const string& path)
+          {
+             return link(source.c_str(), path.c_str()) == 0;
+          }, target) && unlink(source.c_str()) == 0)
+      {
+         moved++;
+      }
+      else
+      {
+         perror(source.c_str());
+         failed++;
+      }
+   }
+   // the old mailbox goes away once it is empty
+   spoolScanMailbox(flat, [&flat](const char* name)
+   {
+      if (strchr(name, '/') == NULL)
+      {
+         return;
+      }
+      string bucket = flat + "/" + string(name, strchr(name, '/') - name);
+      rmdir(bucket.c_str());
+   });
+   unlink((flat + "/" SPOOL_VERSION_FILE).c_str());
+   if (rmdir(flat.c_str()) == 0)
+   {
+      mailboxes++;
+   }
+}
+
+// flat messages with an id into their buckets, legacy names stay. The
+// version moves on, so the server lists the mailbox again.
+void bucketMessages(const string& mailbox)
+{
+   uint64_t before = moved;
+   vector<string> names;
+   spoolScanMailbox(mailbox, [&names](const char* name)
+   {
+      if (strchr(name, '/') == NULL && spoolMessageId(name) != 0)
+      {
+         names.emplace_back(name);
+      }
+   });
+   for (const string& name : names)
+   {
+      string bucket = mailbox + "/" + spoolBucket(spoolMessageId(name));
+      if ((mkdir(bucket.c_str(), 0755) != 0 && errno != EEXIST)
+          || rename((mailbox + "/" + name).c_str(), (bucket + "/" + name).c_str()) != 0)
+      {
+         perror((mailbox + "/" + name).c_str());
+         failed++;
+         continue;
+      }
+      moved++;
+   }
+   if (moved != before)
+   {
+      spoolAdvance(mailbox);
+   }
+}
@@ -0,0 +1,181 @@
+#ifndef TWMAILER_PROTOCOL_H
+#define TWMAILER_PROTOCOL_H
+
+#include <array>
+#include <string_view>
+
+///////////////////////////////////////////////////////////////////////////////
+// PROTOCOL
+// Shared by client and server. A command line is "<verb>[ <arguments>]",
+// the verb is matched case-insensitively without copying the line: a perfect
+// hash over the verbs is generated at compile time, so a lookup is one hash
+// of at most PROTOCOL_VERB_MAX characters plus one compare.
+
+enum class Command
+{
+   Unknown = -1,
+   Quit = 0,
+   Send,
+   List,
+   Read,
+   Del,
+   Login,
+   Stats,
+   Import,
+   Export,
+   Search,
+   Idle,
+   Usage,
+   Count
+};
+
+constexpr const char *commandNames[] = {"quit", "send", "list", "read", "del", "login", "stats", "import", "export", "search", "idle", "usage"};
+constexpr int COMMAND_COUNT = (int)Command::Count;
+static_assert(sizeof(commandNames) / sizeof(commandNames[0]) == COMMAND_COUNT, "one name per command");
+
+constexpr const char *commandName(Command command)
+{
+   return command == Command::Unknown ? "unknown" : commandNames[(int)command];
+}
+
+struct ParsedCommand
+{
+   Command command;
+   std::string_view arguments; // rest of the line after the verb, may be empty
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define PROTOCOL_VERB_MAX 8
+#define PROTOCOL_HASH_SIZE 64
+
+constexpr char lowerAscii(char c)
+{
+   return (c >= 'A' && c <= 'Z') ? (char)(c - 'A' + 'a') : c;
+}
+
+constexpr unsigned verbHash(std::string_view verb, unsigned seed)
+{
+   unsigned hash = seed;
+   for (char c : verb)
+   {
+      hash = hash * 31 + (unsigned char)lowerAscii(c);
+   }
+   return hash % PROTOCOL_HASH_SIZE;
+}
+
+// smallest seed under which no two verbs share a slot
+constexpr unsigned findVerbSeed()
+{
+   for (unsigned seed = 1; seed < 100000; seed++)
+   {
+      bool used[PROTOCOL_HASH_SIZE] = {};
+      bool collision = false;
+      for (int i = 0; i < COMMAND_COUNT && !collision; i++)
+      {
+         unsigned slot = verbHash(commandNames[i], seed);
+         collision = used[slot];
+         used[slot] = true;
+      }
+      if (!collision)
+      {
+         return seed;
+      }
+   }
+   return 0;
+}
+
+constexpr unsigned VERB_SEED = findVerbSeed();
+static_assert(VERB_SEED != 0, "no perfect hash for the verbs, raise PROTOCOL_HASH_SIZE");
+
+constexpr std::array<signed char, PROTOCOL_HASH_SIZE> buildVerbTable()
+{
+   std::array<signed char, PROTOCOL_HASH_SIZE> table = {};
+   for (auto &slot : table)
+   {
+      slot = -1;
+   }
+   for (int i = 0; i < COMMAND_COUNT; i++)
+   {
+      table[verbHash(commandNames[i], VERB_SEED)] = (signed char)i;
+   }
+   return table;
+}
+
+constexpr std::array<signed char, PROTOCOL_HASH_SIZE> verbTable = buildVerbTable();
+
+///////////////////////////////////////////////////////////////////////////////
+
+constexpr bool equalsIgnoreCase(std::string_view text, std::string_view lower)
+{
+   if (text.size() != lower.size())
+   {
+      return false;
+   }
+   for (size_t i = 0; i < text.size(); i++)
+   {
+      if (lowerAscii(text[i]) != lower[i])
+      {
+         return false;
+      }
+   }
+   return true;
+}
+
+constexpr Command lookupVerb(std::string_view verb)
+{
+   if (verb.empty() || verb.size() > PROTOCOL_VERB_MAX)
+   {
+      return Command::Unknown;
+   }
+   int index = verbTable[verbHash(verb, VERB_SEED)];
+   if (index < 0 || !equalsIgnoreCase(verb, commandNames[index]))
+   {
+      return Command::Unknown;
+   }
+   return (Command)index;
+}
+
+// line without its terminator, trailing CR/LF and blanks are ignored
+constexpr ParsedCommand parseCommand(std::string_view line)
+{
+   while (!line.empty() && (line.back() == '\n' || line.back() == '\r' || line.back() == ' '))
+   {
+      line.remove_suffix(1);
+   }
+   size_t space = line.find(' ');
+   std::string_view verb = line.substr(0, space);
+   std::string_view arguments;
+   if (space != std::string_view::npos)
+   {
+      arguments = line.substr(space + 1);
+      while (!arguments.empty() && arguments.front() == ' ')
+      {
+         arguments.remove_prefix(1);
+      }
+   }
+   return ParsedCommand{lookupVerb(verb), arguments};
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// the parser is constexpr, so its behaviour is checked at compile time
+
+static_assert(parseCommand("quit").command == Command::Quit);
+static_assert(parseCommand("SEND").command == Command::Send);
+static_assert(parseCommand("LiSt\r\n").command == Command::List);
+static_assert(parseCommand("read").command == Command::Read);
+static_assert(parseCommand("Del").command == Command::Del);
+static_assert(parseCommand("login").command == Command::Login);
+static_assert(parseCommand("stats").command == Command::Stats);
+static_assert(parseCommand("IMPORT").command == Command::Import);
+static_assert(parseCommand("export *").command == Command::Export);
+static_assert(parseCommand("search").command == Command::Search);
+static_assert(parseCommand("idle 60").command == Command::Idle);
+static_assert(parseCommand("USAGE").command == Command::Usage);
+static_assert(parseCommand("").command == Command::Unknown);
+static_assert(parseCommand("lis").command == Command::Unknown);
+static_assert(parseCommand("lists").command == Command::Unknown);
+static_assert(parseCommand("quit now").arguments == "now");
+static_assert(parseCommand("list  10 20 ").arguments == "10 20");
+
+#endif
@@ -0,0 +1,537 @@
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "twmailer-protocol.h"
+#include "twmailer-tls.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// TWMAILER-PROXY
+// Spreads the users over several servers, each with a spool of its own:
+//    twmailer-proxy <port> <host:port>...
+//    twmailer-proxy --route <host:port>...   (user names on stdin)
+// A session goes to the backend that homes its user, found by consistent
+// hashing: every backend owns PROXY_POINTS points on a 64 bit ring, a user
+// belongs to the first point at or after the hash of the name. Adding a
+// backend to N takes over about 1/(N+1) of the users and leaves the rest
+// where they are; --route prints the backend of every name, so the moved
+// mailboxes can be found.
+// The proxy greets the client like a server and reads the first command
+// itself: a LOGIN picks the backend by its user, anything else goes to the
+// one of the server's default user. The backend's own greeting is dropped,
+// a BUSY in its place becomes the reply to that first command. From
+// then on both directions are spliced through a pipe, the bytes do not pass
+// through the proxy. A session stays with its backend, a later LOGIN under
+// another name is answered there.
+// TLS ends at the proxy, configured like on the server and the client (see
+// twmailer-tls.h): with TWMAILER_TLS_CERT the clients' sessions are TLS,
+// with TWMAILER_TLS or TWMAILER_TLS_CA the ones to the backends; a backend
+// given by name has to have it in its certificate. Where either side is TLS
+// the bytes are copied through the proxy instead of spliced. A TLS client
+// at a proxy without a certificate is turned away and logged, a TLS
+// backend sends no greeting to a plain proxy and the session ends with ERR
+// after PROXY_WELCOME_TIMEOUT. SEND stores into the mailbox of the
+// sender (see sendMessage()), which lives on the same backend, so no
+// message has to cross to another one.
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define PROXY_POINTS 160 // per backend, more points spread the users more evenly
+#define PROXY_DEFAULT_USER "test" // Session::user of the server before a LOGIN
+#define PROXY_CHUNK 65536 // bytes moved by one splice()
+#define PROXY_HEADER_MAX 4096 // bytes of the first command the proxy reads
+#define PROXY_WELCOME_TIMEOUT 10 // seconds a backend has for its handshake and greeting
+#define PROXY_WELCOME "Welcome to twmailer!\r\nPlease enter your commands...\r\n" // as the server's
+
+///////////////////////////////////////////////////////////////////////////////
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+struct RingPoint
+{
+   uint64_t hash;
+   size_t backend;
+
+   bool operator<(const RingPoint &other) const
+   {
+      return hash < other.hash;
+   }
+};
+
+vector<string> backends;
+vector<RingPoint> ring;
+SSL_CTX *tlsContext = NULL; // of the clients, NULL for plain TCP
+SSL_CTX *backendContext = NULL; // of the backends, NULL for plain TCP
+
+///////////////////////////////////////////////////////////////////////////////
+
+uint64_t ringHash(string_view text);
+void ringBuild();
+size_t ringRoute(string_view user);
+bool readFrame(int client, string& pending, size_t& offset, string& frame);
+bool skipWelcome(int server, bool& busy);
+void proxySession(int client);
+void proxyRelay(int client, int server);
+void proxyCopy(int client, int server);
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv)
+{
+   if (argc < 3)
+   {
+      cerr << "Usage: " << argv[0] << " <port> <host:port>..." << endl;
+      cerr << "       " << argv[0] << " --route <host:port>...   (user names on stdin)" << endl;
+      return EXIT_FAILURE;
+   }
+   backends.assign(argv + 2, argv + argc);
+   ringBuild();
+
+   if (strcmp(argv[1], "--route") == 0)
+   {
+      string user;
+      while (getline(cin, user))
+      {
+         cout << user << " " << backends[ringRoute(user)] << "\n";
+      }
+      return EXIT_SUCCESS;
+   }
+
+   signal(SIGPIPE, SIG_IGN); // SSL_write() has no MSG_NOSIGNAL
+   struct rlimit files;
+   if (getrlimit(RLIMIT_NOFILE, &files) == -1 || files.rlim_cur == RLIM_INFINITY || files.rlim_cur > (1 << 20))
+   {
+      files.rlim_cur = 1 << 20;
+   }
+   tlsInit(files.rlim_cur); // every session thread sets only the slots of its own descriptors
+   if (getenv("TWMAILER_TLS_CERT") != NULL && (tlsContext = tlsServerContext()) == NULL)
+   {
+      return EXIT_FAILURE;
+   }
+   if (tlsRequested() && (backendContext = tlsClientContext()) == NULL)
+   {
+      return EXIT_FAILURE;
+   }
+   // proxyCopy() writes what it has, which may grow before a write is retried
+   for (SSL_CTX *context : {tlsContext, backendContext})
+   {
+      if (context != NULL)
+      {
+         SSL_CTX_set_mode(context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+      }
+   }
+   struct sockaddr_in address;
+   memset(&address, 0, sizeof(address));
+   address.sin_family = AF_INET;
+   address.sin_addr.s_addr = INADDR_ANY;
+   address.sin_port = htons(atoi(argv[1]));
+   int listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   int reuseValue = 1;
+   if (listener == -1 || setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuseValue, sizeof(reuseValue)) == -1
+       || bind(listener, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(listener, 128) == -1)
+   {
+      perror("listen");
+      return EXIT_FAILURE;
+   }
+   printf("proxy at port %s for %zu backends, TLS to clients %s, to backends %s\n", argv[1], backends.size(),
+          tlsContext != NULL ? "on" : "off", backendContext != NULL ? "on" : "off");
+   fflush(stdout);
+
+   for (;;)
+   {
+      int client = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+      if (client == -1)
+      {
+         if (errno != EINTR)
+         {
+            perror("accept");
+         }
+         continue;
+      }
+      // relayed replies go on as they arrive, like netConnect() sets it
+      // towards the backend
+      int noDelay = 1;
+      setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+      thread(proxySession, client).detach();
+   }
+}
+
+// FNV-1a with a final mix, plain FNV leaves similar names close on the ring
+uint64_t ringHash(string_view text)
+{
+   uint64_t hash = 14695981039346656037ull;
+   for (char c : text)
+   {
+      hash = (hash ^ (unsigned char)c) * 1099511628211ull;
+   }
+   hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+   hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+   return hash ^ (hash >> 31);
+}
+
+// the points of a backend follow from its address only, so they stay put
+// when other backends come or go
+void ringBuild()
+{
+   ring.clear();
+   for (size_t backend = 0; backend < backends.size(); backend++)
+   {
+      for (int i = 0; i < PROXY_POINTS; i++)
+      {
+         ring.push_back(RingPoint{ringHash(backends[backend] + "#" + to_string(i)), backend});
+      }
+   }
+   sort(ring.begin(), ring.end());
+}
+
+size_t ringRoute(string_view user)
+{
+   auto point = lower_bound(ring.begin(), ring.end(), RingPoint{ringHash(user), 0});
+   return point == ring.end() ? ring.front().backend : point->backend;
+}
+
+// the frame at offset, which ends at '\0' or '\n' like on the server
+bool readFrame(int client, string& pending, size_t& offset, string& frame)
+{
+   size_t end;
+   while ((end = pending.find_first_of(string_view("\0\n", 2), offset)) == string::npos)
+   {
+      char buffer[PROXY_HEADER_MAX];
+      ssize_t size = netRecv(client, buffer, sizeof(buffer));
+      if (size <= 0 || pending.size() > PROXY_HEADER_MAX)
+      {
+         return false;
+      }
+      pending.append(buffer, size);
+   }
+   frame.assign(pending, offset, end - offset);
+   while (!frame.empty() && frame.back() == '\r')
+   {
+      frame.pop_back();
+   }
+   offset = end + 1;
+   return true;
+}
+
+void proxySession(int client)
+{
+   // the bytes read to find the user are passed on unchanged
+   string pending;
+   size_t offset = 0;
+   string verb;
+   string user = PROXY_DEFAULT_USER;
+   if (tlsContext != NULL && tlsAccept(tlsContext, client) != 1)
+   {
+      fprintf(stderr, "TLS handshake of a client failed\n");
+      close(client);
+      return;
+   }
+   if (netSend(client, PROXY_WELCOME, strlen(PROXY_WELCOME)) == -1)
+   {
+      tlsClose(client);
+      close(client);
+      return;
+   }
+   if (readFrame(client, pending, offset, verb) && parseCommand(verb).command == Command::Login)
+   {
+      string name;
+      if (readFrame(client, pending, offset, name) && !name.empty())
+      {
+         user = name;
+      }
+   }
+   // a TLS record where a command belongs: the client started a handshake
+   // and gave up on the plain greeting
+   if (tlsContext == NULL && pending.compare(0, 2, "\x16\x03") == 0)
+   {
+      fprintf(stderr, "TLS client turned away, the proxy has no TWMAILER_TLS_CERT\n");
+      pending.clear();
+   }
+   if (pending.empty())
+   {
+      tlsClose(client);
+      close(client);
+      return;
+   }
+   const string& backend = backends[ringRoute(user)];
+   int server = netConnect(backend);
+   if (server != -1)
+   {
+      // neither a handshake nor a greeting may hold the session forever
+      struct timeval timeout = {PROXY_WELCOME_TIMEOUT, 0};
+      setsockopt(server, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      if (backendContext != NULL && !tlsConnect(backendContext, server, backend.substr(0, backend.rfind(':')).c_str()))
+      {
+         close(server);
+         server = -1;
+         errno = EPROTO;
+      }
+   }
+   if (server == -1)
+   {
+      fprintf(stderr, "backend %s of %s: %s\n", backend.c_str(), user.c_str(), strerror(errno));
+      netSend(client, "ERR", 4); // one reply frame with its '\0'
+      tlsClose(client);
+      close(client);
+      return;
+   }
+   bool busy = false;
+   if (!skipWelcome(server, busy) || busy)
+   {
+      if (!busy)
+      {
+         fprintf(stderr, "backend %s sent no greeting%s\n", backend.c_str(),
+                 backendContext == NULL ? ", a TLS backend needs TWMAILER_TLS or TWMAILER_TLS_CA" : "");
+      }
+      netSend(client, busy ? "BUSY" : "ERR", busy ? 5 : 4);
+   }
+   else if (netSend(server, pending.data(), pending.size()) == (ssize_t)pending.size())
+   {
+      if (tlsStream(client) == nullptr && tlsStream(server) == nullptr)
+      {
+         proxyRelay(client, server);
+      }
+      else
+      {
+         proxyCopy(client, server);
+      }
+   }
+   tlsClose(server);
+   tlsClose(client);
+   close(server);
+   close(client);
+}
+
+// the greeting lines end with the one that asks for commands, the server
+// sends nothing more before the first command arrives
+bool skipWelcome(int server, bool& busy)
+{
+   string welcome;
+   while (welcome.find("commands") == string::npos || welcome.back() != '\n')
+   {
+      char buffer[256];
+      ssize_t size = netRecv(server, buffer, sizeof(buffer));
+      if (size <= 0 || welcome.size() > PROXY_HEADER_MAX)
+      {
+         return false;
+      }
+      welcome.append(buffer, size);
+      if (welcome.compare(0, 4, "BUSY") == 0)
+      {
+         busy = true;
+         return true;
+      }
+   }
+   return true;
+}
+
+// moves the bytes of both directions until both are closed; a direction
+// that ends is passed on as a half close. Both sockets are non-blocking and
+// each direction waits for its own target, what a target does not take yet
+// stays in the pipe: a client that does not read its replies never stops
+// the requests going the other way.
+void proxyRelay(int client, int server)
+{
+   int pipes[2][2];
+   if (pipe2(pipes[0], O_CLOEXEC | O_NONBLOCK) == -1)
+   {
+      return;
+   }
+   if (pipe2(pipes[1], O_CLOEXEC | O_NONBLOCK) == -1)
+   {
+      close(pipes[0][0]);
+      close(pipes[0][1]);
+      return;
+   }
+   fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+   fcntl(server, F_SETFL, fcntl(server, F_GETFL) | O_NONBLOCK);
+   // direction i reads sockets[i] and writes sockets[1 - i]
+   int sources[2] = {client, server};
+   int targets[2] = {server, client};
+   size_t buffered[2] = {0, 0}; // bytes in the pipe of a direction
+   bool full[2] = {false, false}; // its pipe took nothing more
+   bool ended[2] = {false, false}; // its source is closed
+   bool shut[2] = {false, false}; // and its target half closed
+   bool failed = false;
+   while (!failed && !(shut[0] && shut[1]))
+   {
+      struct pollfd sockets[2] = {{client, 0, 0}, {server, 0, 0}};
+      for (int i = 0; i < 2; i++)
+      {
+         if (!ended[i] && !full[i])
+         {
+            sockets[i].events |= POLLIN;
+         }
+         if (buffered[i] > 0)
+         {
+            sockets[1 - i].events |= POLLOUT;
+         }
+      }
+      if (poll(sockets, 2, -1) == -1)
+      {
+         failed = errno != EINTR;
+         continue;
+      }
+      bool moved = false;
+      for (int i = 0; i < 2 && !failed; i++)
+      {
+         if (!ended[i] && !full[i] && sockets[i].revents != 0)
+         {
+            ssize_t size = splice(sources[i], NULL, pipes[i][1], NULL, PROXY_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (size > 0)
+            {
+               buffered[i] += size;
+               moved = true;
+            }
+            else if (size == -1 && errno == EAGAIN)
+            {
+               full[i] = buffered[i] > 0; // readable, so the pipe is what blocks
+            }
+            else
+            {
+               ended[i] = true;
+               moved = true;
+            }
+         }
+         if (buffered[i] > 0)
+         {
+            ssize_t size = splice(pipes[i][0], NULL, targets[i], NULL, buffered[i], SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (size > 0)
+            {
+               buffered[i] -= size;
+               full[i] = false;
+               moved = true;
+            }
+            else if (size == 0 || errno != EAGAIN)
+            {
+               failed = true;
+            }
+         }
+         if (ended[i] && buffered[i] == 0 && !shut[i])
+         {
+            shutdown(targets[i], SHUT_WR);
+            shut[i] = true;
+         }
+      }
+      // a socket that only reports an error or a hang up would wake poll forever
+      failed = failed || (!moved && ((sockets[0].revents | sockets[1].revents) & (POLLERR | POLLHUP | POLLNVAL)) != 0);
+   }
+   for (auto& pipe : pipes)
+   {
+      close(pipe[0]);
+      close(pipe[1]);
+   }
+}
+
+// proxyRelay() for sessions with TLS on either side: the bytes are read and
+// written through a buffer per direction. A TLS call that has to wait may
+// need the other direction of its socket than the one it moves bytes in,
+// and decrypted bytes already in a stream are not seen by poll().
+void proxyCopy(int client, int server)
+{
+   char buffers[2][PROXY_CHUNK];
+   fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+   fcntl(server, F_SETFL, fcntl(server, F_GETFL) | O_NONBLOCK);
+   int sources[2] = {client, server};
+   int targets[2] = {server, client};
+   size_t start[2] = {0, 0}; // the bytes of a direction not written yet
+   size_t end[2] = {0, 0};
+   bool readWaitsForInput[2] = {true, true};
+   bool writeWaitsForInput[2] = {false, false};
+   bool ended[2] = {false, false};
+   bool shut[2] = {false, false};
+   bool failed = false;
+   while (!failed && !(shut[0] && shut[1]))
+   {
+      struct pollfd sockets[2] = {{client, 0, 0}, {server, 0, 0}};
+      bool ready = false;
+      for (int i = 0; i < 2; i++)
+      {
+         if (!ended[i] && end[i] < PROXY_CHUNK)
+         {
+            sockets[i].events |= readWaitsForInput[i] ? POLLIN : POLLOUT;
+            ready = ready || netPending(sources[i]);
+         }
+         if (end[i] > start[i])
+         {
+            sockets[1 - i].events |= writeWaitsForInput[i] ? POLLIN : POLLOUT;
+         }
+      }
+      if (poll(sockets, 2, ready ? 0 : -1) == -1)
+      {
+         failed = errno != EINTR;
+         continue;
+      }
+      bool moved = false;
+      for (int i = 0; i < 2 && !failed; i++)
+      {
+         if (!ended[i] && end[i] < PROXY_CHUNK)
+         {
+            ssize_t size = netRecv(sources[i], buffers[i] + end[i], PROXY_CHUNK - end[i]);
+            if (size > 0)
+            {
+               end[i] += size;
+               moved = true;
+            }
+            else if (size == -1 && errno == EAGAIN)
+            {
+               readWaitsForInput[i] = netWaitsForInput(sources[i], true);
+            }
+            else
+            {
+               ended[i] = true;
+               moved = true;
+            }
+         }
+         if (end[i] > start[i])
+         {
+            ssize_t size = netSend(targets[i], buffers[i] + start[i], end[i] - start[i]);
+            if (size > 0)
+            {
+               start[i] += size;
+               if (start[i] == end[i])
+               {
+                  start[i] = end[i] = 0;
+               }
+               moved = true;
+            }
+            else if (size == -1 && errno == EAGAIN)
+            {
+               writeWaitsForInput[i] = netWaitsForInput(targets[i], false);
+            }
+            else
+            {
+               failed = true;
+            }
+         }
+         if (ended[i] && end[i] == start[i] && !shut[i])
+         {
+            SSL *ssl = tlsStream(targets[i]);
+            if (ssl != nullptr)
+            {
+               SSL_shutdown(ssl); // close_notify, the stream is still read
+               ERR_clear_error();
+            }
+            shutdown(targets[i], SHUT_WR);
+            shut[i] = true;
+         }
+      }
+      // a socket that only reports an error or a hang up would wake poll forever
+      failed = failed || (!moved && !ready && ((sockets[0].revents | sockets[1].revents) & (POLLERR | POLLHUP | POLLNVAL)) != 0);
+   }
+}
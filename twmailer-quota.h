@@ -0,0 +1,114 @@
+#ifndef TWMAILER_QUOTA_H
+#define TWMAILER_QUOTA_H
+
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "twmailer-spool.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// QUOTAS
+// Limits on the messages and bytes of a mailbox, read from a file of
+// "<user> <messages> <bytes>" lines; "*" is the limit of everyone without a
+// line of their own, 0 means unlimited. The usage itself is kept in the
+// mailbox metadata (see MAILBOX VERSION), the server mirrors it per user in
+// memory, so USAGE is answered without touching the spool.
+
+class QuotaTable
+{
+ public:
+   SpoolUsage limit(const std::string &user) const
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto found = limits.find(user);
+      return found != limits.end() ? found->second : fallback;
+   }
+
+   // '#' starts a comment; an invalid file leaves the running quotas
+   bool load(const char *filename)
+   {
+      FILE *file = fopen(filename, "r");
+      if (file == NULL)
+      {
+         return false;
+      }
+      std::unordered_map<std::string, SpoolUsage> loaded;
+      SpoolUsage everyone;
+      char line[512];
+      bool valid = true;
+      while (fgets(line, sizeof(line), file) != NULL)
+      {
+         line[strcspn(line, "#\r\n")] = '\0';
+         char user[256];
+         unsigned long long messages, bytes;
+         int fields = sscanf(line, "%255s %llu %llu", user, &messages, &bytes);
+         if (fields <= 0)
+         {
+            continue;
+         }
+         if (fields != 3)
+         {
+            fprintf(stderr, "%s: invalid line \"%s\"\n", filename, line);
+            valid = false;
+            continue;
+         }
+         (strcmp(user, "*") == 0 ? everyone : loaded[user]) = SpoolUsage{messages, bytes};
+      }
+      fclose(file);
+      if (!valid)
+      {
+         return false;
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      limits.swap(loaded);
+      fallback = everyone;
+      return true;
+   }
+
+   // the counters of a mailbox after every change
+   void record(const std::string &user, const SpoolUsage &usage)
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      usages[user] = usage;
+   }
+
+   // "<user> <messages> <bytes> <message limit> <byte limit>" per line
+   std::string report() const
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      std::string text;
+      char line[384];
+      for (const auto &entry : usages)
+      {
+         auto found = limits.find(entry.first);
+         const SpoolUsage &limit = found != limits.end() ? found->second : fallback;
+         snprintf(line, sizeof(line), "%s %llu %llu %llu %llu\n", entry.first.c_str(),
+                  (unsigned long long)entry.second.messages, (unsigned long long)entry.second.bytes,
+                  (unsigned long long)limit.messages, (unsigned long long)limit.bytes);
+         text += line;
+      }
+      return text;
+   }
+
+ private:
+   mutable std::mutex mutex;
+   std::unordered_map<std::string, SpoolUsage> limits;
+   SpoolUsage fallback;
+   std::map<std::string, SpoolUsage> usages; // sorted for the report
+};
+
+// full before the next message arrives, SEND refuses it before the body
+inline bool quotaFull(const SpoolUsage &usage, const SpoolUsage &limit)
+{
+   return (limit.messages != 0 && usage.messages >= limit.messages) || (limit.bytes != 0 && usage.bytes >= limit.bytes);
+}
+
+inline bool quotaLimited(const SpoolUsage &limit)
+{
+   return limit.messages != 0 || limit.bytes != 0;
+}
+
+#endif
@@ -0,0 +1,461 @@
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "twmailer-capture.h"
+#include "twmailer-protocol.h"
+#include "twmailer-stats.h"
+#include "twmailer-tls.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// TWMAILER-REPLAY
+// Drives a server with the sessions of a capture (see TRAFFIC CAPTURE):
+//    twmailer-replay <ip> <port> <capture-file> [speed]
+// speed 1 (default) keeps the captured timing, 2 plays twice as fast and so
+// on, 0 as fast as possible: every request of a session is then sent
+// without waiting for the replies before it, an IDLE ends at once with
+// DONE. A thread per core plays its share of the sessions, each session
+// connects, sends its frames and disconnects at their captured times over
+// a non-blocking socket, all of them are polled together. Replies are read
+// while sending and taken apart by the command they answer: LIST and
+// SEARCH by their count, READ up to its "." line, EXPORT by the lengths of
+// its chunks. The time from the last frame of a request to the end of its
+// reply goes into a histogram (IDLE waits on purpose and is left out),
+// printed with the throughput at the end.
+// The frames are anonymized, so messages are read and deleted by number
+// in mailboxes of pseudonymous users: replay against a spool the same
+// capture was replayed into before, or expect ERR replies to READ and DEL.
+
+///////////////////////////////////////////////////////////////////////////////
+
+#define REPLAY_DRAIN 10000 // ms to wait for the last replies of a session
+#define REPLAY_FRAME 32 // bytes kept of a reply frame, enough for a count or a length
+
+///////////////////////////////////////////////////////////////////////////////
+
+using namespace std;
+
+///////////////////////////////////////////////////////////////////////////////
+
+struct Reply
+{
+   Command command;
+   uint64_t sent = 0; // monotonicNanos() of the last frame of the request
+   int frames = 0; // received so far
+   uint64_t lines = 0; // LIST and SEARCH lines still to come
+};
+
+struct Player
+{
+   const vector<CaptureRecord>* records;
+   size_t next = 0; // the record to play next
+   int server = -1;
+   bool welcomed = false;
+   bool closing = false; // every record is played, the replies drain
+   bool finished = false;
+   chrono::steady_clock::time_point deadline; // of the drain
+   string output; // frames the socket did not take yet
+   size_t written = 0;
+   string frame; // start of the reply frame being read, the welcome before
+   uint64_t raw = 0; // bytes of an EXPORT chunk still to skip
+   deque<Reply> replies; // oldest first, the server answers in order
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+string target;
+double speed = 1.0;
+chrono::steady_clock::time_point replayStart;
+LatencyHistogram replyLatency;
+atomic<uint64_t> commands{0};
+atomic<uint64_t> errors{0}; // ERR replies
+atomic<uint64_t> failed{0}; // sessions that lost their connection
+
+///////////////////////////////////////////////////////////////////////////////
+
+void replayWorker(vector<Player*> players);
+int replayAdvance(Player& player, chrono::steady_clock::time_point now);
+void replayQueue(Player& player, const CaptureRecord& record);
+bool replayFlush(Player& player);
+void replayEnd(Player& player);
+bool readReplies(Player& player);
+void replyFrame(Player& player);
+
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char **argv)
+{
+   if (argc < 4 || argc > 5)
+   {
+      cerr << "Usage: " << argv[0] << " <ip> <port> <capture-file> [speed, 0 = as fast as possible]" << endl;
+      return EXIT_FAILURE;
+   }
+   target = string(argv[1]) + ":" + argv[2];
+   if (argc == 5)
+   {
+      speed = atof(argv[4]);
+   }
+   FILE* file = fopen(argv[3], "re");
+   if (file == NULL || !captureCheck(file))
+   {
+      cerr << argv[3] << ": not a capture file" << endl;
+      return EXIT_FAILURE;
+   }
+   map<uint64_t, vector<CaptureRecord>> sessions;
+   CaptureRecord record;
+   uint64_t clock = 0;
+   uint64_t frames = 0;
+   while (captureRead(file, record, clock))
+   {
+      sessions[record.session].push_back(record);
+      frames++;
+   }
+   fclose(file);
+   printf("%zu sessions with %llu records over %.3f s\n", sessions.size(), (unsigned long long)frames, clock / 1e6);
+
+   signal(SIGPIPE, SIG_IGN);
+   // sessions that overlap hold a descriptor each
+   struct rlimit files;
+   if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max)
+   {
+      files.rlim_cur = files.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &files);
+   }
+   vector<Player> players(sessions.size());
+   size_t count = 0;
+   for (const auto& session : sessions)
+   {
+      players[count++].records = &session.second;
+   }
+   size_t workers = min<size_t>(max(1u, thread::hardware_concurrency()), players.size());
+   vector<vector<Player*>> shares(workers);
+   for (size_t i = 0; i < players.size(); i++)
+   {
+      shares[i % workers].push_back(&players[i]);
+   }
+   replayStart = chrono::steady_clock::now();
+   vector<thread> threads;
+   for (auto& share : shares)
+   {
+      threads.emplace_back(replayWorker, move(share));
+   }
+   for (auto& worker : threads)
+   {
+      worker.join();
+   }
+   double elapsed = chrono::duration<double>(chrono::steady_clock::now() - replayStart).count();
+
+   string report;
+   char line[256];
+   snprintf(line, sizeof(line), "replayed %zu sessions, %llu commands in %.3f s (%.0f commands/s), %llu ERR, %llu sessions failed\n",
+            sessions.size(), (unsigned long long)commands.load(), elapsed, commands.load() / (elapsed > 0 ? elapsed : 1),
+            (unsigned long long)errors.load(), (unsigned long long)failed.load());
+   report += line;
+   statsAppendHistogram(report, "reply", replyLatency);
+   fputs(report.c_str(), stdout);
+   return failed.load() != 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// plays its sessions until all of them ended; poll() sleeps until the next
+// record is due or a socket is ready
+void replayWorker(vector<Player*> players)
+{
+   vector<struct pollfd> waits;
+   vector<Player*> polled;
+   while (!players.empty())
+   {
+      auto now = chrono::steady_clock::now();
+      int wait = REPLAY_DRAIN;
+      waits.clear();
+      polled.clear();
+      for (size_t i = 0; i < players.size();)
+      {
+         Player* player = players[i];
+         int due = replayAdvance(*player, now);
+         if (due < 0)
+         {
+            players[i] = players.back();
+            players.pop_back();
+            continue;
+         }
+         wait = min(wait, due);
+         if (player->server != -1)
+         {
+            short events = POLLIN | (player->written < player->output.size() ? POLLOUT : 0);
+            waits.push_back({player->server, events, 0});
+            polled.push_back(player);
+         }
+         i++;
+      }
+      if (players.empty())
+      {
+         break;
+      }
+      if (poll(waits.data(), waits.size(), wait) <= 0)
+      {
+         continue;
+      }
+      for (size_t i = 0; i < waits.size(); i++)
+      {
+         Player& player = *polled[i];
+         if ((waits[i].revents & POLLOUT) != 0 && !replayFlush(player))
+         {
+            failed++;
+            replayEnd(player);
+         }
+         else if ((waits[i].revents & (POLLIN | POLLERR | POLLHUP)) != 0 && !readReplies(player))
+         {
+            // closed by the server, after QUIT or a timeout; the records
+            // left are not sent
+            close(player.server);
+            player.server = -1;
+            player.replies.clear();
+         }
+      }
+   }
+}
+
+// plays the records that are due; the ms until the next one is, -1 once
+// the session ended
+int replayAdvance(Player& player, chrono::steady_clock::time_point now)
+{
+   const vector<CaptureRecord>& records = *player.records;
+   while (!player.finished && !player.closing && player.next < records.size())
+   {
+      const CaptureRecord& record = records[player.next];
+      if (speed > 0)
+      {
+         auto due = replayStart + chrono::microseconds((uint64_t)(record.time / speed));
+         if (due > now)
+         {
+            return (int)chrono::ceil<chrono::milliseconds>(due - now).count();
+         }
+      }
+      player.next++;
+      if (record.type == CaptureOpen)
+      {
+         player.server = netConnect(target);
+         if (player.server == -1 || fcntl(player.server, F_SETFL, O_NONBLOCK) == -1)
+         {
+            perror(target.c_str());
+            failed++;
+            replayEnd(player);
+         }
+      }
+      else if (record.type == CaptureClose)
+      {
+         break;
+      }
+      else if (player.server != -1)
+      {
+         replayQueue(player, record);
+         if (!replayFlush(player))
+         {
+            failed++;
+            replayEnd(player);
+         }
+      }
+   }
+   if (player.finished)
+   {
+      return -1;
+   }
+   // a capture cut short has no close record, its sessions end here too
+   if (!player.closing)
+   {
+      player.closing = true;
+      player.deadline = now + chrono::milliseconds(REPLAY_DRAIN);
+   }
+   // the replies still outstanding, then the connection goes
+   if (player.server == -1 || (player.replies.empty() && player.written == player.output.size()) || now >= player.deadline)
+   {
+      replayEnd(player);
+      return -1;
+   }
+   return (int)chrono::ceil<chrono::milliseconds>(player.deadline - now).count();
+}
+
+// the frame goes behind the ones not sent yet; a verb starts the reply it
+// awaits, the arguments that follow move its start
+void replayQueue(Player& player, const CaptureRecord& record)
+{
+   if (record.type == CaptureCommand)
+   {
+      Command command = parseCommand(record.frame).command;
+      if (command != Command::Quit) // QUIT is not answered
+      {
+         Reply reply;
+         reply.command = command;
+         reply.sent = monotonicNanos();
+         player.replies.push_back(reply);
+         commands++;
+      }
+   }
+   else if (!player.replies.empty() && player.replies.back().frames == 0)
+   {
+      player.replies.back().sent = monotonicNanos();
+   }
+   player.output.append(record.frame.c_str(), record.frame.size() + 1);
+}
+
+// false once the connection is gone
+bool replayFlush(Player& player)
+{
+   while (player.written < player.output.size())
+   {
+      ssize_t size = send(player.server, player.output.data() + player.written, player.output.size() - player.written,
+                          MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (size == -1)
+      {
+         return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+      }
+      player.written += size;
+   }
+   player.output.clear();
+   player.written = 0;
+   return true;
+}
+
+void replayEnd(Player& player)
+{
+   if (player.server != -1)
+   {
+      close(player.server);
+      player.server = -1;
+   }
+   player.finished = true;
+}
+
+// false once the connection is gone
+bool readReplies(Player& player)
+{
+   char buffer[65536];
+   ssize_t size = recv(player.server, buffer, sizeof(buffer), MSG_DONTWAIT);
+   if (size == 0 || (size == -1 && errno != EAGAIN && errno != EINTR))
+   {
+      return false;
+   }
+   ssize_t i = 0;
+   while (i < size)
+   {
+      if (!player.welcomed)
+      {
+         // the greeting is plain lines, the last one asks for commands
+         char c = buffer[i++];
+         if (c != '\n')
+         {
+            player.frame += c;
+            continue;
+         }
+         player.welcomed = player.frame.find("commands") != string::npos;
+         player.frame.clear();
+         continue;
+      }
+      if (player.raw != 0)
+      {
+         uint64_t skip = min<uint64_t>(player.raw, size - i);
+         player.raw -= skip;
+         i += skip;
+         continue;
+      }
+      const char* end = (const char*)memchr(buffer + i, '\0', size - i);
+      size_t length = end != NULL ? end - (buffer + i) : size - i;
+      if (player.frame.size() < REPLAY_FRAME)
+      {
+         player.frame.append(buffer + i, min(length, REPLAY_FRAME - player.frame.size()));
+      }
+      i += length;
+      if (end == NULL)
+      {
+         break;
+      }
+      i++;
+      replyFrame(player);
+      player.frame.clear();
+   }
+   return true;
+}
+
+// one whole frame of the oldest reply; the reply is complete when its
+// command expects no more
+void replyFrame(Player& player)
+{
+   if (player.replies.empty())
+   {
+      return;
+   }
+   Reply& reply = player.replies.front();
+   string_view frame = player.frame;
+   bool complete = true;
+   reply.frames++;
+   if (reply.frames == 1)
+   {
+      if (frame == "ERR")
+      {
+         errors++;
+      }
+      else if (frame != "BUSY" && frame != "LIMIT")
+      {
+         switch (reply.command)
+         {
+            case Command::List:
+            case Command::Search:
+               // the count, for a ranged LIST the first number of its header
+               reply.lines = strtoull(player.frame.c_str(), NULL, 10);
+               complete = reply.lines == 0;
+               break;
+            case Command::Read:
+            case Command::Export:
+            case Command::Idle:
+               complete = false; // "OK", the message, the archive or the event follows
+               break;
+            default:
+               break;
+         }
+      }
+   }
+   else
+   {
+      switch (reply.command)
+      {
+         case Command::List:
+         case Command::Search:
+            complete = --reply.lines == 0;
+            break;
+         case Command::Read:
+            // receiver and subject come first, a body line is never a lone "."
+            complete = reply.frames >= 4 && frame == ".";
+            break;
+         case Command::Export:
+            // the length of the next chunk of the archive, 0 after the last
+            player.raw = strtoull(player.frame.c_str(), NULL, 10);
+            complete = player.raw == 0;
+            break;
+         default:
+            break;
+      }
+   }
+   if (complete)
+   {
+      if (reply.command != Command::Idle)
+      {
+         replyLatency.record(monotonicNanos() - reply.sent);
+      }
+      player.replies.pop_front();
+   }
+}
@@ -0,0 +1,186 @@
+#ifndef TWMAILER_REPLICATION_H
+#define TWMAILER_REPLICATION_H
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "twmailer-tls.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// REPLICATION
+// A primary ships every change of its spool to one standby over TCP, the
+// standby applies it to its own spool and takes over once promoted. The
+// stream is the log of mailbox mutations in the order they were made:
+//    STORE <sequence> <time> <user> <name> <length>\n<the message file>
+//    DELETE <sequence> <time> <user> <name>\n
+// and the standby answers "ACK <sequence> <time>\n" for every record it
+// applied. time is the primary's clock (ns since the epoch) at the change,
+// echoed back so the primary measures the lag by its own clock.
+// The request paths only append to the log in memory; a shipper thread reads
+// the message files and sends them. Records stay until they are
+// acknowledged and are sent again after a reconnect, applying one twice
+// does no harm. The standby starts from a copy of the spool, the log only
+// carries what changed after the primary started.
+
+#define REPLICATION_QUEUE 1000000 // records kept for a standby that lags
+
+struct ReplicationRecord
+{
+   uint64_t sequence;
+   uint64_t time;
+   bool store; // else a deletion
+   std::string user;
+   std::string name; // relative to the mailbox of user
+};
+
+inline uint64_t replicationClock()
+{
+   struct timespec now;
+   clock_gettime(CLOCK_REALTIME, &now);
+   return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+class ReplicationLog
+{
+ public:
+   // from the request paths, after the change is on disk
+   void append(bool store, const std::string &user, const std::string &name)
+   {
+      {
+         std::lock_guard<std::mutex> lock(mutex);
+         if (records.size() == REPLICATION_QUEUE)
+         {
+            records.pop_front(); // the standby will miss it, see after()
+         }
+         records.push_back(ReplicationRecord{++last, replicationClock(), store, user, name});
+      }
+      appended.notify_one();
+   }
+
+   // up to max records following sequence, waits up to timeout for the
+   // first; false when records following sequence were dropped
+   bool after(uint64_t sequence, std::vector<ReplicationRecord> &out, size_t max, std::chrono::milliseconds timeout)
+   {
+      std::unique_lock<std::mutex> lock(mutex);
+      appended.wait_for(lock, timeout, [this, sequence]() { return last > sequence; });
+      if (records.empty() || last <= sequence)
+      {
+         return true;
+      }
+      bool complete = records.front().sequence <= sequence + 1;
+      size_t first = complete ? sequence + 1 - records.front().sequence : 0;
+      for (size_t i = first; i < records.size() && out.size() < max; i++)
+      {
+         out.push_back(records[i]);
+      }
+      return complete;
+   }
+
+   void acknowledge(uint64_t sequence)
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      while (!records.empty() && records.front().sequence <= sequence)
+      {
+         records.pop_front();
+      }
+      acknowledged = sequence > acknowledged ? sequence : acknowledged;
+   }
+
+   uint64_t confirmed() const
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      return acknowledged;
+   }
+
+   uint64_t pending() const
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      return last - acknowledged;
+   }
+
+ private:
+   mutable std::mutex mutex;
+   std::condition_variable appended;
+   std::deque<ReplicationRecord> records;
+   uint64_t last = 0;
+   uint64_t acknowledged = 0;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+inline bool replicationSend(int descriptor, const char *data, size_t length)
+{
+   while (length > 0)
+   {
+      ssize_t sent = netSend(descriptor, data, length);
+      if (sent <= 0)
+      {
+         return false;
+      }
+      data += sent;
+      length -= sent;
+   }
+   return true;
+}
+
+// the next line without its "\n"; bytes read past it stay in pending
+inline bool replicationLine(int descriptor, std::string &pending, std::string &line)
+{
+   size_t end;
+   while ((end = pending.find('\n')) == std::string::npos)
+   {
+      char buffer[65536];
+      ssize_t size = netRecv(descriptor, buffer, sizeof(buffer));
+      if (size <= 0 || pending.size() > 4096)
+      {
+         return false;
+      }
+      pending.append(buffer, size);
+   }
+   line.assign(pending, 0, end);
+   pending.erase(0, end + 1);
+   return true;
+}
+
+inline bool replicationBytes(int descriptor, std::string &pending, size_t length, std::string &bytes)
+{
+   while (pending.size() < length)
+   {
+      char buffer[65536];
+      ssize_t size = netRecv(descriptor, buffer, sizeof(buffer));
+      if (size <= 0)
+      {
+         return false;
+      }
+      pending.append(buffer, size);
+   }
+   bytes.assign(pending, 0, length);
+   pending.erase(0, length);
+   return true;
+}
+
+// a user and message name as the spool makes them: no way out of the
+// mailbox and no hidden files
+inline bool replicationValid(const std::string &user, const std::string &name)
+{
+   if (user.empty() || user[0] == '.' || user.find('/') != std::string::npos)
+   {
+      return false;
+   }
+   size_t slash = name.find('/');
+   std::string file = slash == std::string::npos ? name : name.substr(slash + 1);
+   return !name.empty() && name[0] != '.' && name[0] != '/' && !file.empty() && file[0] != '.'
+          && file.find('/') == std::string::npos;
+}
+
+#endif
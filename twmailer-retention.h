@@ -0,0 +1,163 @@
+#ifndef TWMAILER_RETENTION_H
+#define TWMAILER_RETENTION_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// RETENTION
+// Messages older than a maximum age, and those beyond the newest maximum
+// count of a mailbox, are removed by a background sweeper. The policies come
+// from a file of "<user> <max age in seconds> <max count>" lines, "*" for
+// everyone without a line of their own, 0 = no limit.
+// Ids grow with arrival, so the oldest message of a mailbox is always its
+// first one. The queue therefore holds a single entry per mailbox, in a
+// min-heap on the time that first message expires; a mailbox over its
+// count is due at once. The sweeper pops what is due and removes messages
+// from the front of each mailbox until the first one that may stay, so its
+// work follows the number of expired messages, not the size of the spool.
+
+struct RetentionPolicy
+{
+   uint64_t maxAge = 0; // seconds
+   uint64_t maxCount = 0;
+};
+
+inline bool retentionActive(const RetentionPolicy &policy)
+{
+   return policy.maxAge != 0 || policy.maxCount != 0;
+}
+
+class RetentionTable
+{
+ public:
+   RetentionPolicy policy(const std::string &user) const
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto found = policies.find(user);
+      return found != policies.end() ? found->second : fallback;
+   }
+
+   // '#' starts a comment; an invalid file leaves the running policies
+   bool load(const char *filename)
+   {
+      FILE *file = fopen(filename, "r");
+      if (file == NULL)
+      {
+         return false;
+      }
+      std::unordered_map<std::string, RetentionPolicy> loaded;
+      RetentionPolicy everyone;
+      char line[512];
+      bool valid = true;
+      while (fgets(line, sizeof(line), file) != NULL)
+      {
+         line[strcspn(line, "#\r\n")] = '\0';
+         char user[256];
+         unsigned long long age, count;
+         int fields = sscanf(line, "%255s %llu %llu", user, &age, &count);
+         if (fields <= 0)
+         {
+            continue;
+         }
+         if (fields != 3)
+         {
+            fprintf(stderr, "%s: invalid line \"%s\"\n", filename, line);
+            valid = false;
+            continue;
+         }
+         (strcmp(user, "*") == 0 ? everyone : loaded[user]) = RetentionPolicy{age, count};
+      }
+      fclose(file);
+      if (!valid)
+      {
+         return false;
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      policies.swap(loaded);
+      fallback = everyone;
+      return true;
+   }
+
+ private:
+   mutable std::mutex mutex;
+   std::unordered_map<std::string, RetentionPolicy> policies;
+   RetentionPolicy fallback;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+class RetentionQueue
+{
+ public:
+   struct Entry
+   {
+      uint64_t due; // seconds since the epoch
+      std::string mailbox;
+      std::string user;
+
+      bool operator>(const Entry &other) const
+      {
+         return std::tie(due, mailbox) > std::tie(other.due, other.mailbox);
+      }
+   };
+
+   // swept at due at the latest; an earlier entry of the mailbox stays
+   void schedule(const std::string &mailbox, const std::string &user, uint64_t due)
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      auto found = scheduled.find(mailbox);
+      if (found != scheduled.end() && found->second <= due)
+      {
+         return;
+      }
+      scheduled[mailbox] = due;
+      heap.push(Entry{due, mailbox, user});
+   }
+
+   // the next mailbox due by now, it leaves the queue until rescheduled.
+   // Entries replaced by an earlier one are dropped on the way.
+   bool pop(uint64_t now, Entry &entry)
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      while (!heap.empty() && heap.top().due <= now)
+      {
+         entry = heap.top();
+         heap.pop();
+         auto found = scheduled.find(entry.mailbox);
+         if (found != scheduled.end() && found->second == entry.due)
+         {
+            scheduled.erase(found);
+            return true;
+         }
+      }
+      return false;
+   }
+
+   void clear()
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      heap = decltype(heap)();
+      scheduled.clear();
+   }
+
+   size_t size() const
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      return scheduled.size();
+   }
+
+ private:
+   mutable std::mutex mutex;
+   std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> heap;
+   std::unordered_map<std::string, uint64_t> scheduled; // mailbox, due of its live entry
+};
+
+#endif
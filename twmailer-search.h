@@ -0,0 +1,343 @@
+#ifndef TWMAILER_SEARCH_H
+#define TWMAILER_SEARCH_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// FULL-TEXT SEARCH
+// One inverted index per mailbox, kept in memory. It is built from the
+// message files on the first SEARCH and then kept current by SEND and IMPORT
+// (new documents) and DEL (tombstones), so a query never opens a message.
+// Document ids grow with every insert, which keeps every posting list
+// sorted: lists are delta + varint encoded with a skip entry every
+// SEARCH_SKIP postings, and multi-term queries intersect the lists
+// leapfrog style, starting from the shortest one.
+
+#define SEARCH_SKIP 64
+#define SEARCH_TERM_MAX 64 // longer words are cut
+
+// lowercase words of ASCII letters/digits, bytes >= 0x80 count as letters so
+// UTF-8 words stay whole
+template <class Emit>
+inline void searchTokenize(std::string_view text, Emit emit)
+{
+   std::string term;
+   for (size_t i = 0; i <= text.size(); i++)
+   {
+      unsigned char c = i < text.size() ? (unsigned char)text[i] : ' ';
+      if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 0x80)
+      {
+         if (term.size() < SEARCH_TERM_MAX)
+         {
+            term += (char)c;
+         }
+      }
+      else if (c >= 'A' && c <= 'Z')
+      {
+         if (term.size() < SEARCH_TERM_MAX)
+         {
+            term += (char)(c - 'A' + 'a');
+         }
+      }
+      else if (!term.empty())
+      {
+         emit(term);
+         term.clear();
+      }
+   }
+}
+
+// distinct terms of one document, collected while it is written
+struct SearchTerms
+{
+   std::unordered_set<std::string> terms;
+
+   void add(std::string_view text)
+   {
+      searchTokenize(text, [this](const std::string &term) { terms.insert(term); });
+   }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+struct PostingList
+{
+   std::vector<uint8_t> bytes;
+   // (document before the block, byte offset of the block) per SEARCH_SKIP postings
+   std::vector<std::pair<uint32_t, uint32_t>> skips;
+   uint32_t last = 0;
+   uint32_t count = 0;
+
+   void add(uint32_t document)
+   {
+      if (count % SEARCH_SKIP == 0)
+      {
+         skips.emplace_back(last, (uint32_t)bytes.size());
+      }
+      uint32_t delta = document - last;
+      while (delta >= 0x80)
+      {
+         bytes.push_back((uint8_t)(delta | 0x80));
+         delta >>= 7;
+      }
+      bytes.push_back((uint8_t)delta);
+      last = document;
+      count++;
+   }
+};
+
+struct PostingCursor
+{
+   const PostingList *list;
+   uint32_t position = 0; // postings decoded so far
+   size_t offset = 0;
+   uint32_t document = 0; // current posting, valid while !done
+
+   explicit PostingCursor(const PostingList *postings) : list(postings)
+   {
+      next();
+   }
+
+   bool done() const
+   {
+      return position > list->count;
+   }
+
+   void next()
+   {
+      if (position >= list->count)
+      {
+         position = list->count + 1;
+         return;
+      }
+      uint32_t delta = 0;
+      int shift = 0;
+      uint8_t byte;
+      do
+      {
+         byte = list->bytes[offset++];
+         delta |= (uint32_t)(byte & 0x7F) << shift;
+         shift += 7;
+      } while (byte & 0x80);
+      document += delta;
+      position++;
+   }
+
+   // first posting >= target, whole blocks are skipped
+   void seek(uint32_t target)
+   {
+      if (done() || document >= target)
+      {
+         return;
+      }
+      size_t block = (position - 1) / SEARCH_SKIP;
+      size_t last = block;
+      while (last + 1 < list->skips.size() && list->skips[last + 1].first < target)
+      {
+         last++;
+      }
+      if (last != block)
+      {
+         position = (uint32_t)(last * SEARCH_SKIP);
+         offset = list->skips[last].second;
+         document = list->skips[last].first;
+         next();
+      }
+      while (!done() && document < target)
+      {
+         next();
+      }
+   }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+struct MailboxIndex
+{
+   std::shared_mutex mutex;
+   std::unordered_map<std::string, PostingList> terms;
+   std::unordered_map<std::string, uint32_t> ids;
+   std::vector<std::string> names;
+   std::vector<std::string> subjects;
+   std::vector<bool> deleted;
+   size_t live = 0;
+
+   // caller holds the mutex exclusively
+   void add(const std::string &name, const std::string &subject, const SearchTerms &document)
+   {
+      if (ids.count(name) != 0)
+      {
+         return;
+      }
+      uint32_t id = (uint32_t)names.size();
+      ids[name] = id;
+      names.push_back(name);
+      subjects.push_back(subject);
+      deleted.push_back(false);
+      live++;
+      for (const std::string &term : document.terms)
+      {
+         terms[term].add(id);
+      }
+   }
+
+   // tombstone, the postings stay until the index is rebuilt
+   void remove(const std::string &name)
+   {
+      auto found = ids.find(name);
+      if (found != ids.end() && !deleted[found->second])
+      {
+         deleted[found->second] = true;
+         live--;
+      }
+   }
+
+   // ids of the live documents containing every term, caller holds the mutex
+   std::vector<uint32_t> query(const std::vector<std::string> &words) const
+   {
+      std::vector<uint32_t> hits;
+      std::vector<PostingCursor> cursors;
+      for (const std::string &word : words)
+      {
+         auto found = terms.find(word);
+         if (found == terms.end())
+         {
+            return hits;
+         }
+         cursors.emplace_back(&found->second);
+      }
+      if (cursors.empty())
+      {
+         return hits;
+      }
+      std::sort(cursors.begin(), cursors.end(),
+                [](const PostingCursor &a, const PostingCursor &b) { return a.list->count < b.list->count; });
+      PostingCursor &lead = cursors[0];
+      while (!lead.done())
+      {
+         uint32_t candidate = lead.document;
+         bool match = true;
+         for (size_t i = 1; i < cursors.size(); i++)
+         {
+            cursors[i].seek(candidate);
+            if (cursors[i].done())
+            {
+               return hits;
+            }
+            if (cursors[i].document != candidate)
+            {
+               lead.seek(cursors[i].document);
+               match = false;
+               break;
+            }
+         }
+         if (match)
+         {
+            if (!deleted[candidate])
+            {
+               hits.push_back(candidate);
+            }
+            lead.next();
+         }
+      }
+      return hits;
+   }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// indexes by mailbox directory, created on the first SEARCH of a mailbox
+
+inline std::mutex searchRegistryMutex;
+inline std::unordered_map<std::string, std::shared_ptr<MailboxIndex>> searchIndexes;
+
+inline std::shared_ptr<MailboxIndex> searchFind(const std::string &mailbox)
+{
+   std::lock_guard<std::mutex> lock(searchRegistryMutex);
+   auto found = searchIndexes.find(mailbox);
+   return found == searchIndexes.end() ? nullptr : found->second;
+}
+
+// reads subject and body of one message file into the index
+inline void searchIndexFile(MailboxIndex &index, const std::string &mailbox, const std::string &name)
+{
+   std::ifstream file(mailbox + "/" + name);
+   std::string line;
+   std::string subject;
+   SearchTerms document;
+   int number = 0;
+   while (std::getline(file, line))
+   {
+      if (number == 1)
+      {
+         subject = line;
+      }
+      if (number >= 1 && line != ".")
+      {
+         document.add(line);
+      }
+      number++;
+   }
+   if (number > 0)
+   {
+      index.add(name, subject, document);
+   }
+}
+
+// (re)builds the index of a mailbox from its files
+template <class Names>
+inline std::shared_ptr<MailboxIndex> searchBuild(const std::string &mailbox, const Names &files)
+{
+   auto index = std::make_shared<MailboxIndex>();
+   for (const auto &name : files)
+   {
+      searchIndexFile(*index, mailbox, std::string(name.data(), name.size()));
+   }
+   std::lock_guard<std::mutex> lock(searchRegistryMutex);
+   searchIndexes[mailbox] = index;
+   return index;
+}
+
+// SEND/IMPORT: only mailboxes that were searched before have an index
+inline void searchAdd(const std::string &mailbox, const std::string &name, const std::string &subject,
+                      const SearchTerms &document)
+{
+   std::shared_ptr<MailboxIndex> index = searchFind(mailbox);
+   if (index != nullptr)
+   {
+      std::unique_lock<std::shared_mutex> lock(index->mutex);
+      index->add(name, subject, document);
+   }
+}
+
+// a message that arrived as a file, from a primary
+inline void searchAddFile(const std::string &mailbox, const std::string &name)
+{
+   std::shared_ptr<MailboxIndex> index = searchFind(mailbox);
+   if (index != nullptr)
+   {
+      std::unique_lock<std::shared_mutex> lock(index->mutex);
+      searchIndexFile(*index, mailbox, name);
+   }
+}
+
+inline void searchRemove(const std::string &mailbox, const std::string &name)
+{
+   std::shared_ptr<MailboxIndex> index = searchFind(mailbox);
+   if (index != nullptr)
+   {
+      std::unique_lock<std::shared_mutex> lock(index->mutex);
+      index->remove(name);
+   }
+}
+
+#endif
@@ -1,12 +1,20 @@
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <sched.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <signal.h>
+#include <errno.h>
 #include <ctype.h>
 #include <time.h>
 #include <stdexcept>
@@ -14,13 +22,98 @@
 #include <fstream> 
 #include <iostream>
 #include <vector>
+#include <thread>
+#include <memory_resource>
+#include <mutex>
+#include <queue>
+#include <unordered_map>
+#include <unordered_set>
 #include <ldap.h>
+#include "twmailer-capture.h"
+#include "twmailer-coro.h"
+#include "twmailer-export.h"
+#include "twmailer-index.h"
+#include "twmailer-limit.h"
+#include "twmailer-log.h"
+#include "twmailer-protocol.h"
+#include "twmailer-quota.h"
+#include "twmailer-replication.h"
+#include "twmailer-retention.h"
+#include "twmailer-search.h"
+#include "twmailer-spool.h"
+#include "twmailer-stats.h"
+#include "twmailer-timer.h"
+#include "twmailer-tls.h"
+#include "twmailer-trace.h"
 
 ///////////////////////////////////////////////////////////////////////////////
 
 #define BUF 1024
 #define PORT 6543
-#define LEN 6
+#define MAX_ACCEPTORS 256
+#define ARENA 4096 // first arena block of a command, the next ones grow from it
+#define ARENA_POOLED 65536 // arena blocks up to this size are kept for reuse
+#define IDLE_TIMEOUT 300 // seconds, default of IDLE
+#define IDLE_TIMEOUT_MAX 3600
+#define READ_CHUNK 65536 // READ sends the message file in pieces of this size
+#define TIMER_TICK 100000000ull // ns, resolution of the session timeouts
+#define TIMEOUT_IDLE 300 // seconds, waiting for the next command
+#define TIMEOUT_READ 30 // seconds, waiting for the rest of a command
+#define TIMEOUT_WRITE 30 // seconds, a reply blocked by a client not reading
+#define INDEX_INTERVAL 300 // seconds between snapshots of the mailbox indexes
+#define RETENTION_RATE 200 // messages the sweeper removes per second at most
+#define RETENTION_BATCH 64 // messages removed from one mailbox at a time
+#define RETENTION_RETRY 60 // seconds until a mailbox that failed is swept again
+#define STORAGE_THREADS 4 // workers for the file system calls of the sessions
+
+///////////////////////////////////////////////////////////////////////////////
+
+struct Session;
+
+// receive state of one client, looked up by its descriptor
+struct Connection
+{
+   char pending[BUF * 4];
+   size_t start = 0;
+   size_t end = 0;
+   int descriptor = -1;
+   bool awaitingCommand = false; // next frame is a verb: idle, not read timeout
+   bool failed = false; // the running command answered ERR
+   bool split = false; // the last frame was cut at BUF - 1, its rest follows
+   CaptureSession capture; // in the traffic capture, number 0 = none
+   uint64_t request = 0; // trace id of the running command
+   TimerNode timer;
+   Session *owner = NULL;
+   EventLoop *loop = NULL; // the one the session runs on
+};
+
+enum TimeoutReason
+{
+   TimeoutIdle = 0,
+   TimeoutRead,
+   TimeoutWrite
+};
+
+// the arena blocks of all sessions; between commands and while IDLE parks it
+// a session holds none. Storage workers allocate from the arenas as well.
+std::pmr::synchronized_pool_resource arenaPool(std::pmr::pool_options{0, ARENA_POOLED});
+
+// one client session, its coroutine suspends while IDLE parks it
+struct Session
+{
+   int socket = -1;
+   std::string user = "test";
+   bool admin = false; // logged in as adminUser with its password
+   std::string address; // of the client, for the rate limits
+   Connection connection;
+   uint64_t idleTicket = 0;
+   std::string idleMailbox;
+   uint64_t idleSince = 0; // NEW is sent for a message with a higher id
+   std::coroutine_handle<> idleWaiting; // resumed by the idle reactor
+   std::string idleReply; // NEW <id>, TIMEOUT or DONE
+   // request-scoped containers allocate from here, released after every command
+   std::pmr::monotonic_buffer_resource arena{ARENA, &arenaPool};
+};
 
 ///////////////////////////////////////////////////////////////////////////////
 
@@ -30,9 +123,61 @@ using namespace std::filesystem;
 ///////////////////////////////////////////////////////////////////////////////
 
 int abortRequested = 0;
-int create_socket = -1;
-int new_socket = -1;
+volatile sig_atomic_t reloadRequested = 0;
+volatile sig_atomic_t promoteRequested = 0;
+int acceptorCount = 1;
+int listenSockets[MAX_ACCEPTORS];
+// indexed by descriptor, set while a session runs
+vector<Connection *> connections;
 string spoolDirectoryPath = "";
+SSL_CTX *tlsContext = NULL;
+
+// every wait of a session for its socket is covered by one timer of the
+// wheel, the reaper thread shuts the socket down once it expires
+TimerWheel sessionTimers(TIMER_TICK);
+uint64_t sessionTimeouts[] = {TIMEOUT_IDLE * 1000000000ull, TIMEOUT_READ * 1000000000ull, TIMEOUT_WRITE * 1000000000ull};
+
+// rate limits by user and by address, admission control server-wide
+LimitConfig limits;
+LimitTable userLimits;
+LimitTable addressLimits;
+atomic<int64_t> commandsRunning{0};
+
+// mailbox quotas and the usage of every mailbox seen
+QuotaTable quotas;
+
+// retention policies and the mailboxes in the order they expire
+RetentionTable retention;
+RetentionQueue retentionQueue;
+
+// changes shipped to a standby (TWMAILER_REPLICA), or applied as one
+ReplicationLog replicationLog;
+bool replicating = false;
+atomic<bool> standby{false};
+mutex standbyMutex; // the two sockets below, promotion shuts them down
+int standbyListener = -1;
+int standbyConnection = -1;
+
+// STATS, USAGE and EXPORT of other mailboxes are only answered for this
+// user (env TWMAILER_ADMIN), who has to log in with adminPassword (env
+// TWMAILER_ADMIN_PASSWORD); without a password nobody can log in as it
+string adminUser = "admin";
+string adminPassword;
+
+// the file system calls of the sessions run here, not on their event loops
+WorkerPool storagePool;
+
+// parked IDLE sessions by ticket, their mailboxes and deadlines
+mutex idleMutex;
+once_flag idleStarted;
+int idleEpoll = -1;
+int idleWake = -1; // eventfd, wakes the reactor after a change
+uint64_t idleTickets = 0;
+unordered_map<uint64_t, Session *> idleSessions;
+unordered_map<string, unordered_set<uint64_t>> idleWaiters;
+priority_queue<pair<uint64_t, uint64_t>, vector<pair<uint64_t, uint64_t>>, greater<pair<uint64_t, uint64_t>>> idleDeadlines;
+vector<pair<uint64_t, uint64_t>> idleNotified; // (ticket, message id)
+unordered_map<string, uint64_t> idleNewest; // id of the last message stored in a mailbox
 
 /*
 ////////////////////////////////////////////////////////////////////////////
@@ -53,68 +198,91 @@ void readPassword(char* password);
 */
 ///////////////////////////////////////////////////////////////////////////////
 
-char* receive(char* buffer, int *current_socket);
-void sendMessage(char* buffer,path directorypath,vector<string> index,string user, int* current_socket);
-void listMessages(char* buffer,path directorypath,vector<string> index, int* current_socket);
-void readMessage(char* buffer,path directorypath,vector<string> index, int* current_socket);
-void deleteMessage(char* buffer, path directorypath,vector<string> index, int* current_socket);
-void *clientCommunication(void *data);
+int createListener(struct sockaddr_in *address, int backlog);
+void acceptorLoop(int acceptor);
+void acceptorThread(int acceptor, int cpu);
+Task<> acceptConnections(EventLoop* loop, int acceptor);
+Task<char*> receive(char* buffer, int *current_socket);
+Task<bool> transmit(int* current_socket, const char* data, size_t length);
+Task<bool> answer(int* current_socket, const char* reply);
+Task<bool> transmitLine(int* current_socket, const char* line);
+Task<> sendMessage(char* buffer,const path& directorypath,pmr::memory_resource* arena,const string& user, int* current_socket);
+Task<> listMessages(char* buffer,const path& directorypath,const vector<string>& index,pmr::memory_resource* arena, int* current_socket);
+Task<> listRange(string_view arguments,const path& directorypath,const vector<string>& index,pmr::memory_resource* arena, int* current_socket);
+Task<> importMessages(char* buffer,const path& directorypath,const string& user, int* current_socket);
+Task<> exportMessages(char* buffer,const string& user,bool admin, int* current_socket);
+Task<> searchMessages(char* buffer,const path& directorypath,const vector<string>& index,pmr::memory_resource* arena, int* current_socket);
+Task<> readMessage(char* buffer,const path& directorypath,const vector<string>& index,pmr::memory_resource* arena, int* current_socket);
+Task<> deleteMessage(char* buffer,const path& directorypath,const vector<string>& index,pmr::memory_resource* arena, int* current_socket);
+pmr::string mailPath(const path& directorypath, string_view filename, pmr::memory_resource* arena);
+Task<> clientCommunication(EventLoop* loop, int socket);
+Task<> runSession(Session *session);
+void endSession(Session *session);
+void idleStart();
+Session *idleTake(uint64_t ticket);
+void idleReactor();
+Task<uint64_t> idleMessage(char* buffer,const path& directorypath,const vector<string>& index, Session *session);
+bool idlePark(Session *session, uint64_t seconds, coroutine_handle<> waiting);
+void idleNotify(const string& mailbox, uint64_t id);
+void timeoutArm(Connection* connection, int reason);
+void timeoutCancel(Connection* connection);
+void timeoutReaper();
+const char* admitCommand(Session* session);
+Task<> dropArguments(Command command, char* buffer, int* current_socket);
+double limitBytes(Session* session, size_t bytes);
+void limitsReload();
 void signalHandler(int sig);
-void loginMessage(char* buffer, int* current_socket);
+Task<> loginMessage(char* buffer, string& user, bool& admin, int* current_socket);
+Task<> statsMessage(bool admin, int* current_socket);
+Task<> usageMessage(bool admin, int* current_socket);
+void quotasReload();
+void quotaScan();
+void retentionAdded(const string& mailbox, const string& user, const SpoolUsage& usage);
+void retentionReload();
+void retentionScan();
+size_t retentionSweep(const RetentionQueue::Entry& entry, size_t budget);
+void retentionSweeper(int rate);
+void replicate(bool store, const string& user, const string& name);
+void replicationShipper(string target);
+bool replicationShip(int replica, const ReplicationRecord& record);
+void replicationAcks(int replica, atomic<bool>* broken);
+void replicationReceiver();
+bool replicationApply(const string& line, int primary, string& pending);
+void replicationPromote();
+void statsDump(string filename, int interval);
+void indexWarmStart(unsigned threads);
+void indexWriter(int interval);
 
 ///////////////////////////////////////////////////////////////////////////////
 
 int main(int argc, char **argv)
 {
-   socklen_t addrlen;
-   struct sockaddr_in address, cliaddress;
+   struct sockaddr_in address;
    string spoolDirectory = "";
-   int reuseValue = 1;
+   int backlog = 128;
 
-   ////////////////////////////////////////////////////////////////////////////
-   // SIGNAL HANDLER
-   // SIGINT (Interrup: ctrl+c)
-   // https://man7.org/linux/man-pages/man2/signal.2.html
-   if (signal(SIGINT, signalHandler) == SIG_ERR)
+   for (int i = 0; i < MAX_ACCEPTORS; i++)
    {
-      perror("signal can not be registered");
-      return EXIT_FAILURE;
+      listenSockets[i] = -1;
    }
 
-   ////////////////////////////////////////////////////////////////////////////
-   // CREATE A SOCKET
-   // https://man7.org/linux/man-pages/man2/socket.2.html
-   // https://man7.org/linux/man-pages/man7/ip.7.html
-   // https://man7.org/linux/man-pages/man7/tcp.7.html
-   // IPv4, TCP (connection oriented), IP (same as client)
-   if ((create_socket = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+   // one slot per possible descriptor, so lookups never need a lock
+   struct rlimit files;
+   if (getrlimit(RLIMIT_NOFILE, &files) == -1 || files.rlim_cur == RLIM_INFINITY || files.rlim_cur > (1 << 20))
    {
-      perror("Socket error"); // errno set by socket()
-      return EXIT_FAILURE;
+      files.rlim_cur = 1 << 20;
    }
+   connections.resize(files.rlim_cur, NULL);
+   tlsInit(files.rlim_cur);
 
    ////////////////////////////////////////////////////////////////////////////
-   // SET SOCKET OPTIONS
-   // https://man7.org/linux/man-pages/man2/setsockopt.2.html
-   // https://man7.org/linux/man-pages/man7/socket.7.html
-   // socket, level, optname, optvalue, optlen
-   if (setsockopt(create_socket,
-                  SOL_SOCKET,
-                  SO_REUSEADDR,
-                  &reuseValue,
-                  sizeof(reuseValue)) == -1)
-   {
-      perror("set socket options - reuseAddr");
-      return EXIT_FAILURE;
-   }
-
-   if (setsockopt(create_socket,
-                  SOL_SOCKET,
-                  SO_REUSEPORT,
-                  &reuseValue,
-                  sizeof(reuseValue)) == -1)
+   // SIGNAL HANDLER
+   // SIGINT (Interrup: ctrl+c)
+   // https://man7.org/linux/man-pages/man2/signal.2.html
+   if (signal(SIGINT, signalHandler) == SIG_ERR || signal(SIGHUP, signalHandler) == SIG_ERR
+       || signal(SIGUSR1, signalHandler) == SIG_ERR)
    {
-      perror("set socket options - reusePort");
+      perror("signal can not be registered");
       return EXIT_FAILURE;
    }
 
@@ -136,342 +304,1132 @@ int main(int argc, char **argv)
       spoolDirectory = argv[2];
    }
 
-   spoolDirectoryPath = "./" + spoolDirectory;
-   if (!exists(spoolDirectoryPath))
+   ////////////////////////////////////////////////////////////////////////////
+   // ACCEPTORS
+   // TWMAILER_ACCEPTORS: number of listeners sharing the port through
+   //    SO_REUSEPORT, each with its own event loop pinned to one CPU that
+   //    runs the sessions it accepts ("auto" = one per online CPU,
+   //    default 1 = single loop, no pinning)
+   // TWMAILER_BACKLOG: listen backlog of every listener
+   if (getenv("TWMAILER_ACCEPTORS") != NULL)
    {
-      try
+      if (strcmp(getenv("TWMAILER_ACCEPTORS"), "auto") == 0)
       {
-      create_directory(spoolDirectoryPath);
+         acceptorCount = (int)sysconf(_SC_NPROCESSORS_ONLN);
       }
-      catch (...)
+      else
       {
-         cerr << "failed to create directory" << endl;
+         acceptorCount = atoi(getenv("TWMAILER_ACCEPTORS"));
+      }
+      if (acceptorCount < 1)
+      {
+         acceptorCount = 1;
+      }
+      if (acceptorCount > MAX_ACCEPTORS)
+      {
+         acceptorCount = MAX_ACCEPTORS;
       }
    }
+   if (getenv("TWMAILER_BACKLOG") != NULL && atoi(getenv("TWMAILER_BACKLOG")) > 0)
+   {
+      backlog = atoi(getenv("TWMAILER_BACKLOG"));
+   }
 
    ////////////////////////////////////////////////////////////////////////////
-   // ASSIGN AN ADDRESS WITH PORT TO SOCKET
-   if (bind(create_socket, (struct sockaddr *)&address, sizeof(address)) == -1)
+   // STATISTICS
+   // TWMAILER_ADMIN / TWMAILER_ADMIN_PASSWORD: user allowed to run STATS
+   //    and its password, the admin can not log in without one
+   // TWMAILER_STATS_FILE / TWMAILER_STATS_INTERVAL: optional periodic dump
+   if (getenv("TWMAILER_ADMIN") != NULL)
    {
-      perror("bind error");
-      return EXIT_FAILURE;
+      adminUser = getenv("TWMAILER_ADMIN");
+   }
+   if (getenv("TWMAILER_ADMIN_PASSWORD") != NULL)
+   {
+      adminPassword = getenv("TWMAILER_ADMIN_PASSWORD");
+   }
+   if (getenv("TWMAILER_STATS_FILE") != NULL)
+   {
+      int interval = 60;
+      if (getenv("TWMAILER_STATS_INTERVAL") != NULL)
+      {
+         interval = atoi(getenv("TWMAILER_STATS_INTERVAL"));
+      }
+      thread(statsDump, string(getenv("TWMAILER_STATS_FILE")), interval > 0 ? interval : 60).detach();
    }
 
-   std::cout << "Started Server at port " << ntohs(address.sin_port) << " with " << spoolDirectory << " as the spool directory" << endl;
+   ////////////////////////////////////////////////////////////////////////////
+   // TRACING
+   // TWMAILER_TRACE_FILE: record request spans, written there on shutdown
+   if (getenv("TWMAILER_TRACE_FILE") != NULL)
+   {
+      traceEnabled = 1;
+   }
 
    ////////////////////////////////////////////////////////////////////////////
-   // ALLOW CONNECTION ESTABLISHING
-   // Socket, Backlog (= count of waiting connections allowed)
-   if (listen(create_socket, 5) == -1)
+   // CAPTURE
+   // TWMAILER_CAPTURE_FILE: record the anonymized request frames of every
+   //    session there, for twmailer-replay
+   if (getenv("TWMAILER_CAPTURE_FILE") != NULL && !captureStart(getenv("TWMAILER_CAPTURE_FILE")))
    {
-      perror("listen error");
+      cerr << "can not write the capture file " << getenv("TWMAILER_CAPTURE_FILE") << endl;
       return EXIT_FAILURE;
    }
 
-   while (!abortRequested)
+   ////////////////////////////////////////////////////////////////////////////
+   // TIMEOUTS
+   // TWMAILER_TIMEOUT_IDLE/READ/WRITE: seconds, 0 disables
+   const char* timeoutNames[] = {"TWMAILER_TIMEOUT_IDLE", "TWMAILER_TIMEOUT_READ", "TWMAILER_TIMEOUT_WRITE"};
+   for (int i = TimeoutIdle; i <= TimeoutWrite; i++)
    {
-      /////////////////////////////////////////////////////////////////////////
-      // ignore errors here... because only information message
-      // https://linux.die.net/man/3/printf
-      printf("Waiting for connections...\n");
-
-      /////////////////////////////////////////////////////////////////////////
-      // ACCEPTS CONNECTION SETUP
-      // blocking, might have an accept-error on ctrl+c
-      addrlen = sizeof(struct sockaddr_in);
-      if ((new_socket = accept(create_socket, (struct sockaddr *)&cliaddress, &addrlen)) == -1)
+      if (getenv(timeoutNames[i]) != NULL)
       {
-         if (abortRequested)
-         {
-            perror("accept error after aborted");
-         }
-         else
-         {
-            perror("accept error");
-         }
-         break;
+         sessionTimeouts[i] = strtoull(getenv(timeoutNames[i]), NULL, 10) * 1000000000ull;
       }
-
-      /////////////////////////////////////////////////////////////////////////
-      // START CLIENT
-      // ignore printf error handling
-      printf("Client connected from %s:%d...\n",
-             inet_ntoa(cliaddress.sin_addr),
-             ntohs(cliaddress.sin_port));
-      clientCommunication(&new_socket); // returnValue can be ignored
-      new_socket = -1;
    }
+   thread(timeoutReaper).detach();
 
-   // frees the descriptor
-   if (create_socket != -1)
+   ////////////////////////////////////////////////////////////////////////////
+   // LIMITS
+   // TWMAILER_LIMITS_FILE: rate limits and admission control, SIGHUP reloads
+   if (getenv("TWMAILER_LIMITS_FILE") != NULL && !limitsLoad(getenv("TWMAILER_LIMITS_FILE"), limits))
    {
-      if (shutdown(create_socket, SHUT_RDWR) == -1)
-      {
-         perror("shutdown create_socket");
-      }
-      if (close(create_socket) == -1)
-      {
-         perror("close create_socket");
-      }
-      create_socket = -1;
+      cerr << "can not load limits from " << getenv("TWMAILER_LIMITS_FILE") << endl;
+      return EXIT_FAILURE;
    }
 
-   return EXIT_SUCCESS;
-}
-char* receive(char* buffer, int *current_socket)
-{
-   /////////////////////////////////////////////////////////////////////////
-      // RECEIVE
-      int size;
-      size = recv(*current_socket, buffer, BUF - 1, 0);
-      if (size == -1)
-      {
-         if (abortRequested)
-         {
-            throw invalid_argument("recv error after aborted");
-         }
-         else
-         {
-            throw invalid_argument("recv error");
-         }
-         
-      }
-
-      if (size == 0)
-      {
-         throw invalid_argument("Client closed remote socket"); // ignore error
-         
-      }
+   ////////////////////////////////////////////////////////////////////////////
+   // QUOTAS
+   // TWMAILER_QUOTA_FILE: message and byte limits per mailbox, SIGHUP reloads
+   if (getenv("TWMAILER_QUOTA_FILE") != NULL && !quotas.load(getenv("TWMAILER_QUOTA_FILE")))
+   {
+      cerr << "can not load quotas from " << getenv("TWMAILER_QUOTA_FILE") << endl;
+      return EXIT_FAILURE;
+   }
 
-      // remove ugly debug message, because of the sent newline of client
-      if (buffer[size - 2] == '\r' && buffer[size - 1] == '\n')
-      {
-         size -= 2;
-      }
-      else if (buffer[size - 1] == '\n')
-      {
-         --size;
-      }
-      buffer[size] = '\0';
-   return buffer;
-}
-void sendMessage(char* buffer,path directorypath,vector<string> index,string user, int* current_socket)
-{
-   // sends Message to the server
-   string receiver;
-   string subject;
-   vector<string> messagetext;
-   path filepath;
-   try
+   ////////////////////////////////////////////////////////////////////////////
+   // RETENTION
+   // TWMAILER_RETENTION_FILE: maximum age and count of messages per mailbox,
+   //    SIGHUP reloads
+   // TWMAILER_RETENTION_RATE: messages removed per second at most (default 200)
+   int retentionRate = RETENTION_RATE;
+   if (getenv("TWMAILER_RETENTION_FILE") != NULL && !retention.load(getenv("TWMAILER_RETENTION_FILE")))
    {
-      strcpy(buffer,receive(buffer, current_socket));
-      printf("Content received: %s\n", buffer); // ignore error
+      cerr << "can not load retention policies from " << getenv("TWMAILER_RETENTION_FILE") << endl;
+      return EXIT_FAILURE;
    }
-   catch (const invalid_argument& except)
+   if (getenv("TWMAILER_RETENTION_RATE") != NULL && atoi(getenv("TWMAILER_RETENTION_RATE")) > 0)
    {
-      cerr << except.what() << endl;
+      retentionRate = atoi(getenv("TWMAILER_RETENTION_RATE"));
    }
-   receiver = buffer;
-   try
+
+   ////////////////////////////////////////////////////////////////////////////
+   // STORAGE
+   // TWMAILER_STORAGE_THREADS: workers for the file system calls of the
+   //    sessions, so a slow disk does not stall an event loop (default 4,
+   //    0 = on the event loops themselves)
+   int storageThreads = STORAGE_THREADS;
+   if (getenv("TWMAILER_STORAGE_THREADS") != NULL)
    {
-      strncpy(buffer,receive(buffer, current_socket),81);
-      printf("Content received: %s\n", buffer); // ignore error
+      storageThreads = atoi(getenv("TWMAILER_STORAGE_THREADS"));
    }
-   catch (const invalid_argument& except)
+   storagePool.start(storageThreads > 0 ? storageThreads : 0);
+
+   ////////////////////////////////////////////////////////////////////////////
+   // TLS
+   // TWMAILER_TLS_CERT/TWMAILER_TLS_KEY: accept TLS connections only
+   if (getenv("TWMAILER_TLS_CERT") != NULL)
    {
-      cerr << except.what() << endl;
+      if ((tlsContext = tlsServerContext()) == NULL)
+      {
+         return EXIT_FAILURE;
+      }
+      signal(SIGPIPE, SIG_IGN); // SSL_write() has no MSG_NOSIGNAL
+      LOG_INFO("TLS enabled with %s", getenv("TWMAILER_TLS_CERT"));
    }
-   subject = buffer;
-   while(strcmp(buffer, ".") != 0 &&  strlen(buffer) != 1) 
+
+   spoolDirectoryPath = "./" + spoolDirectory;
+   if (!exists(spoolDirectoryPath))
    {
       try
       {
-         strcpy(buffer,receive(buffer, current_socket));
-         printf("Content received: %s\n", buffer); // ignore error
+      create_directory(spoolDirectoryPath);
       }
-      catch (const invalid_argument& except)
+      catch (...)
       {
-         cerr << except.what() << endl;
+         cerr << "failed to create directory" << endl;
       }
-      if(strlen(buffer) != 0)
+   }
+
+   ////////////////////////////////////////////////////////////////////////////
+   // MAILBOX INDEX
+   // TWMAILER_INDEX_INTERVAL: seconds between snapshots of the mailbox
+   //    indexes (default 300, 0 = only on shutdown)
+   // TWMAILER_INDEX_THREADS: threads checking the snapshot after the start
+   //    (default one per online CPU)
+   uint64_t snapshotStarted = monotonicNanos();
+   if (indexSnapshot.map(spoolDirectoryPath + "/" INDEX_SNAPSHOT_FILE))
+   {
+      LOG_INFO("index snapshot of %zu mailboxes mapped in %.3f ms", indexSnapshot.size(),
+               (monotonicNanos() - snapshotStarted) / 1e6);
+      long threads = sysconf(_SC_NPROCESSORS_ONLN);
+      if (getenv("TWMAILER_INDEX_THREADS") != NULL)
       {
-         messagetext.push_back(buffer);
+         threads = atoi(getenv("TWMAILER_INDEX_THREADS"));
       }
+      thread(indexWarmStart, (unsigned)(threads > 0 ? threads : 1)).detach();
    }
-   //We use the the current + the username to give each mail a unique name
-   time_t timer;
-   time(&timer);
-   string filename = user+to_string(timer)+".txt";
-   filepath = directorypath/filename;
-   index.push_back(filename);
-   ofstream file(filepath);
-   try
+   thread(quotaScan).detach();
+   if (getenv("TWMAILER_RETENTION_FILE") != NULL)
    {
-      if (file.is_open()) 
-      { 
-         // Write data to the file 
-         file << receiver << endl;
-         file << subject << endl;
-         for(long unsigned int i = 0; i != messagetext.size(); i++)
-         {
-            file << messagetext[i] << endl;
-         }
-         file.close(); 
-         std::cout << "File created: " << filepath << endl; 
-      }
+      thread(retentionScan).detach();
+      thread(retentionSweeper, retentionRate).detach();
    }
-   catch (...)
+   int indexInterval = INDEX_INTERVAL;
+   if (getenv("TWMAILER_INDEX_INTERVAL") != NULL)
    {
-      cerr << "failed to create file" << endl;
+      indexInterval = atoi(getenv("TWMAILER_INDEX_INTERVAL"));
    }
-   if (send(*current_socket, "OK", 3, 0) == -1)
+   if (indexInterval > 0)
    {
-      perror("send answer failed");
+      thread(indexWriter, indexInterval).detach();
    }
-}
-void listMessages(char* buffer,path directorypath,vector<string> index, int* current_socket)
-{
-   int messagecount = 0;
-   vector<string> messages;
-   if(!filesystem::is_empty(directorypath))
+
+   ////////////////////////////////////////////////////////////////////////////
+   // REPLICATION
+   // TWMAILER_REPLICA=<host>:<port>: ship every change of the spool to the
+   //    standby listening there
+   // TWMAILER_STANDBY_PORT: run as standby, apply what a primary ships to
+   //    this port; SEND, DEL and IMPORT answer ERR until SIGUSR1 promotes it
+   if (getenv("TWMAILER_STANDBY_PORT") != NULL)
    {
-      for(long unsigned int i = 0; i < index.size();i++)
-      {
-         string subject;
-         ifstream message(directorypath/index[i]);
-         int counter = 0;
-         //We iterate through the mail taking the subject from each
-         while (getline (message, subject)) 
-         {
-            if(counter == 1)
-            {
-               messages.push_back(subject);
-               break;
-            }
-            counter++;
-         }
-         message.close();
-         messagecount++;
-      }
-      std::cout << messagecount << endl;
-      //We are sending the count of messages to the client
-      if (send(*current_socket, to_string(messagecount).c_str(), 3, 0) == -1)
-      {
-         perror("send answer failed");
-      }
-      if(messagecount != 0)
+      struct sockaddr_in replicationAddress = address;
+      replicationAddress.sin_port = htons(atoi(getenv("TWMAILER_STANDBY_PORT")));
+      if ((standbyListener = createListener(&replicationAddress, 1)) == -1)
       {
-         for(int i = 0; i < messagecount;i++)
-         {
-            std::cout << messages[i] << endl;
-            strcpy(buffer,messages[i].c_str());
-            if (send(*current_socket,buffer, 3, 0) == -1)
-            {
-               perror("send answer failed");
-            }
-         }
-         messages.clear();
+         return EXIT_FAILURE;
       }
+      standby = true;
+      thread(replicationReceiver).detach();
+      LOG_INFO("standby, waiting for a primary at port %d", ntohs(replicationAddress.sin_port));
    }
-   else
+   if (getenv("TWMAILER_REPLICA") != NULL)
    {
-      if (send(*current_socket, to_string(messagecount).c_str(), 3, 0) == -1)
-      {
-         perror("send answer failed");
-      }
+      replicating = true;
+      thread(replicationShipper, string(getenv("TWMAILER_REPLICA"))).detach();
    }
-}
-void readMessage(char* buffer,path directorypath,vector<string> index, int* current_socket)
-{
-   string messageNumber;
-   long unsigned int messNum = 0;
-   if(!filesystem::is_empty(directorypath))
+
+   for (int i = 0; i < acceptorCount; i++)
    {
-      try
-      {
-         strcpy(buffer,receive(buffer, current_socket));
-         messageNumber = buffer;
-         printf("Content received: %s\n", buffer); // ignore error
-      }
-      catch (const invalid_argument& except)
-      {
-         cerr << except.what() << endl;
-      }
-      try
+      if ((listenSockets[i] = createListener(&address, backlog)) == -1)
       {
-         int temp = stoi(messageNumber);
-         if(temp >= 0)
-         {
-            messNum += temp;
-         }
-         else
-         {
-            throw(std::invalid_argument(" "));
-         }
+         return EXIT_FAILURE;
       }
-      catch(...)
+   }
+
+   LOG_INFO("Started Server at port %d with %s as the spool directory (%d acceptors, backlog %d)",
+            ntohs(address.sin_port), spoolDirectory.c_str(), acceptorCount, backlog);
+
+   ////////////////////////////////////////////////////////////////////////////
+   // LOGGER
+   // all output of the request path goes through the asynchronous logger
+   logStart();
+
+   if (acceptorCount == 1)
+   {
+      acceptorLoop(0);
+   }
+   else
+   {
+      vector<thread> acceptors;
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      for (int i = 0; i < acceptorCount; i++)
       {
-         if (send(*current_socket, "ERR", 4, 0) == -1)
-         {
-            perror("send answer failed");
-         }
+         acceptors.emplace_back(acceptorThread, i, (int)(i % cpus));
       }
-      if(messNum <= index.size()-1)
+      for (auto &acceptor : acceptors)
       {
-         if (send(*current_socket, "OK", 3, 0) == -1)
-         {
-            perror("send answer failed");
-         }
-         string text;
-         ifstream file(directorypath/index[messNum-1]);
-         while (getline (file, text)) 
-         {
-            std::cout << text << endl;
-            if (send(*current_socket,text.c_str(), 3, 0) == -1)
-            {
-               perror("send answer failed");
-            }
-         }
-         file.close();
+         acceptor.join();
       }
-      else
+   }
+
+   // frees the descriptors, the signal handler only shut them down
+   for (int i = 0; i < acceptorCount; i++)
+   {
+      if (listenSockets[i] != -1)
       {
-         if (send(*current_socket, "ERR", 4, 0) == -1)
+         if (close(listenSockets[i]) == -1)
          {
-            perror("send answer failed");
+            perror("close create_socket");
          }
+         listenSockets[i] = -1;
       }
    }
+
+   long indexed = indexSave(spoolDirectoryPath);
+   if (indexed < 0)
+   {
+      LOG_ERROR("failed to write the index snapshot: %s", strerror(errno));
+   }
    else
    {
-      if (send(*current_socket, "ERR", 4, 0) == -1)
+      LOG_INFO("index snapshot of %ld mailboxes written", indexed);
+   }
+
+   if (traceEnabled)
+   {
+      if (traceExport(getenv("TWMAILER_TRACE_FILE")) == -1)
       {
-         perror("send answer failed");
+         LOG_ERROR("failed to write trace file: %s", strerror(errno));
       }
    }
-}
-void deleteMessage(char* buffer, path directorypath,vector<string> index, int* current_socket)
+
+   captureStop();
+   logStop();
+   return EXIT_SUCCESS;
+}
+int createListener(struct sockaddr_in *address, int backlog)
+{
+   int create_socket;
+   int reuseValue = 1;
+
+   ////////////////////////////////////////////////////////////////////////////
+   // CREATE A SOCKET
+   // https://man7.org/linux/man-pages/man2/socket.2.html
+   // https://man7.org/linux/man-pages/man7/ip.7.html
+   // https://man7.org/linux/man-pages/man7/tcp.7.html
+   // IPv4, TCP (connection oriented), IP (same as client)
+   if ((create_socket = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+   {
+      perror("Socket error"); // errno set by socket()
+      return -1;
+   }
+
+   ////////////////////////////////////////////////////////////////////////////
+   // SET SOCKET OPTIONS
+   // https://man7.org/linux/man-pages/man2/setsockopt.2.html
+   // https://man7.org/linux/man-pages/man7/socket.7.html
+   // socket, level, optname, optvalue, optlen
+   // SO_REUSEPORT lets every acceptor bind its own socket to the same port,
+   // the kernel then spreads incoming connections across them
+   if (setsockopt(create_socket,
+                  SOL_SOCKET,
+                  SO_REUSEADDR,
+                  &reuseValue,
+                  sizeof(reuseValue)) == -1)
+   {
+      perror("set socket options - reuseAddr");
+      close(create_socket);
+      return -1;
+   }
+
+   if (setsockopt(create_socket,
+                  SOL_SOCKET,
+                  SO_REUSEPORT,
+                  &reuseValue,
+                  sizeof(reuseValue)) == -1)
+   {
+      perror("set socket options - reusePort");
+      close(create_socket);
+      return -1;
+   }
+
+   ////////////////////////////////////////////////////////////////////////////
+   // ASSIGN AN ADDRESS WITH PORT TO SOCKET
+   if (bind(create_socket, (struct sockaddr *)address, sizeof(*address)) == -1)
+   {
+      perror("bind error");
+      close(create_socket);
+      return -1;
+   }
+
+   ////////////////////////////////////////////////////////////////////////////
+   // ALLOW CONNECTION ESTABLISHING
+   // Socket, Backlog (= count of waiting connections allowed)
+   if (listen(create_socket, backlog) == -1)
+   {
+      perror("listen error");
+      close(create_socket);
+      return -1;
+   }
+   return create_socket;
+}
+// one event loop per acceptor, its sessions run as coroutines on it
+void acceptorLoop(int acceptor)
+{
+   EventLoop loop;
+   int flags = fcntl(listenSockets[acceptor], F_GETFL);
+   if (!loop.valid() || flags == -1 || fcntl(listenSockets[acceptor], F_SETFL, flags | O_NONBLOCK) == -1)
+   {
+      LOG_ERROR("acceptor %d has no event loop: %s", acceptor, strerror(errno));
+      return;
+   }
+   loop.spawn(acceptConnections(&loop, acceptor));
+   loop.run();
+}
+Task<> acceptConnections(EventLoop* loop, int acceptor)
+{
+   socklen_t addrlen;
+   struct sockaddr_in cliaddress;
+
+   while (!abortRequested)
+   {
+      LOG_DEBUG("Waiting for connections...");
+
+      /////////////////////////////////////////////////////////////////////////
+      // ACCEPTS CONNECTION SETUP
+      // non-blocking, the loop runs the sessions while none arrives; the
+      // signal handler shuts the listener down, which ends the wait
+      addrlen = sizeof(struct sockaddr_in);
+      int client = accept4(listenSockets[acceptor], (struct sockaddr *)&cliaddress, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (client == -1)
+      {
+         if (!abortRequested && (errno == EAGAIN || errno == EINTR || errno == ECONNABORTED))
+         {
+            co_await loop->wait(listenSockets[acceptor], EPOLLIN);
+            continue;
+         }
+         if (abortRequested)
+         {
+            LOG_ERROR("accept error after aborted: %s", strerror(errno));
+         }
+         else
+         {
+            LOG_ERROR("accept error: %s", strerror(errno));
+         }
+         break;
+      }
+
+      // keepalive finds peers that vanished, parked IDLE sessions included
+      int keepalive[] = {1, 60, 10, 3}; // on, idle seconds, interval, probes
+      setsockopt(client, SOL_SOCKET, SO_KEEPALIVE, &keepalive[0], sizeof(int));
+      setsockopt(client, IPPROTO_TCP, TCP_KEEPIDLE, &keepalive[1], sizeof(int));
+      setsockopt(client, IPPROTO_TCP, TCP_KEEPINTVL, &keepalive[2], sizeof(int));
+      setsockopt(client, IPPROTO_TCP, TCP_KEEPCNT, &keepalive[3], sizeof(int));
+      // replies go out in frames and large pieces already; Nagle would hold
+      // the last segment of every multi-frame reply until the client's
+      // delayed ACK, some 40 ms per LIST or READ
+      int noDelay = 1;
+      setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(int));
+
+      /////////////////////////////////////////////////////////////////////////
+      // START CLIENT
+      LOG_INFO("Client connected from %s:%d (acceptor %d)...",
+               inet_ntoa(cliaddress.sin_addr),
+               ntohs(cliaddress.sin_port),
+               acceptor);
+      loop->spawn(clientCommunication(loop, client));
+   }
+
+   // the sessions of this loop end with a receive error, like at a timeout
+   for (size_t i = 0; i < connections.size(); i++)
+   {
+      Connection* connection = connections[i];
+      if (connection != NULL && connection->loop == loop)
+      {
+         shutdown((int)i, SHUT_RDWR);
+      }
+   }
+   loop->stop();
+}
+void acceptorThread(int acceptor, int cpu)
+{
+   // https://man7.org/linux/man-pages/man3/pthread_setaffinity_np.3.html
+   cpu_set_t cpus;
+   CPU_ZERO(&cpus);
+   CPU_SET(cpu, &cpus);
+   int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+   if (rc != 0)
+   {
+      LOG_WARN("acceptor %d could not be pinned to cpu %d: %s", acceptor, cpu, strerror(rc));
+   }
+   acceptorLoop(acceptor);
+}
+Task<char*> receive(char* buffer, int *current_socket)
+{
+   /////////////////////////////////////////////////////////////////////////
+   // RECEIVE
+   // A frame ends at '\0' (twmailer-client) or '\n' (line based clients).
+   // Clients may pipeline, so whatever follows the frame stays buffered in
+   // the connection for the next call. Until it is complete the session
+   // waits on its loop, other sessions run meanwhile.
+   TraceSpan span("socket-read");
+   int descriptor = *current_socket;
+   if (descriptor < 0 || (size_t)descriptor >= connections.size() || connections[descriptor] == NULL)
+   {
+      throw invalid_argument(abortRequested ? "recv error after aborted" : "recv error");
+   }
+   Connection &connection = *connections[descriptor];
+   int armed = -1; // one timeout covers the whole frame
+   bool waited = false;
+   for (;;)
+   {
+      char *begin = connection.pending + connection.start;
+      size_t available = connection.end - connection.start;
+      size_t size = 0;
+      while (size < available && begin[size] != '\0' && begin[size] != '\n')
+      {
+         size++;
+      }
+      if (size < available || available >= BUF - 1)
+      {
+         // overlong frames are split at BUF - 1 like a single recv did before
+         if (size > BUF - 1)
+         {
+            size = BUF - 1;
+         }
+         memcpy(buffer, begin, size);
+         bool terminated = size < available && (begin[size] == '\0' || begin[size] == '\n');
+         connection.start += terminated ? size + 1 : size;
+         connection.split = !terminated;
+         // remove ugly debug message, because of the sent newline of client
+         if (terminated && size > 0 && buffer[size - 1] == '\r')
+         {
+            --size;
+         }
+         buffer[size] = '\0';
+         if (armed != -1)
+         {
+            timeoutCancel(&connection);
+         }
+         if (connection.capture.number != 0)
+         {
+            captureFrame(connection.capture, connection.awaitingCommand, string_view(buffer, size));
+         }
+         co_return buffer;
+      }
+
+      memmove(connection.pending, begin, available);
+      connection.start = 0;
+      connection.end = available;
+      int reason = connection.awaitingCommand && available == 0 ? TimeoutIdle : TimeoutRead;
+      if (reason != armed)
+      {
+         timeoutArm(&connection, reason);
+         armed = reason;
+      }
+      ssize_t received = netRecv(descriptor, connection.pending + connection.end, sizeof(connection.pending) - connection.end);
+      if (received == -1 && errno == EAGAIN)
+      {
+         // the timeout reaper shuts the socket down, which ends this wait
+         co_await connection.loop->wait(descriptor, netWaitsForInput(descriptor, true) ? EPOLLIN : EPOLLOUT);
+         traceRequest = connection.request;
+         waited = true;
+         continue;
+      }
+      if (received <= 0)
+      {
+         timeoutCancel(&connection);
+      }
+      if (received == -1)
+      {
+         if (abortRequested)
+         {
+            throw invalid_argument("recv error after aborted");
+         }
+         else
+         {
+            throw invalid_argument("recv error");
+         }
+      }
+
+      if (received == 0)
+      {
+         throw invalid_argument("Client closed remote socket"); // ignore error
+      }
+      serverStats.bytesIn.fetch_add(received, memory_order_relaxed);
+      connection.end += received;
+      double delay = limitBytes(connection.owner, received);
+      if (delay > 0)
+      {
+         co_await connection.loop->sleep((uint64_t)(delay * 1e9));
+         traceRequest = connection.request;
+      }
+      else if (!waited)
+      {
+         // a client that keeps the socket full would never wait, it takes
+         // its turn after the other sessions of the loop instead
+         co_await connection.loop->yield();
+         traceRequest = connection.request;
+      }
+      waited = false;
+   }
+}
+Task<bool> transmit(int* current_socket, const char* data, size_t length)
+{
+   TraceSpan span("reply");
+   Connection* connection = *current_socket >= 0 ? connections[*current_socket] : NULL;
+   size_t sent = 0;
+   timeoutArm(connection, TimeoutWrite);
+   while (sent < length)
+   {
+      ssize_t size = netSend(*current_socket, data + sent, length - sent);
+      if (size == -1 && errno == EAGAIN && connection != NULL)
+      {
+         co_await connection->loop->wait(*current_socket, netWaitsForInput(*current_socket, false) ? EPOLLIN : EPOLLOUT);
+         traceRequest = connection->request;
+         continue;
+      }
+      if (size == -1)
+      {
+         LOG_ERROR("send answer failed: %s", strerror(errno));
+         timeoutCancel(connection);
+         co_return false;
+      }
+      serverStats.bytesOut.fetch_add(size, memory_order_relaxed);
+      sent += size;
+   }
+   timeoutCancel(connection);
+   co_return true;
+}
+Task<bool> answer(int* current_socket, const char* reply)
+{
+   if (strcmp(reply, "ERR") == 0 && *current_socket >= 0 && connections[*current_socket] != NULL)
+   {
+      connections[*current_socket]->failed = true;
+   }
+   return transmitLine(current_socket, reply);
+}
+Task<bool> transmitLine(int* current_socket, const char* line)
+{
+   // every reply is one '\0' terminated frame
+   return transmit(current_socket, line, strlen(line) + 1);
+}
+// runs work on the storage pool; the trace id does not travel with it
+template <typename Work>
+auto storage(int* current_socket, Work work) -> Task<invoke_result_t<Work&>>
+{
+   Connection* connection = connections[*current_socket];
+   uint64_t request = traceRequest;
+   if constexpr (is_void_v<invoke_result_t<Work&>>)
+   {
+      co_await offload(storagePool, *connection->loop, [&]() { traceRequest = request; work(); });
+      traceRequest = request;
+   }
+   else
+   {
+      auto result = co_await offload(storagePool, *connection->loop, [&]() { traceRequest = request; return work(); });
+      traceRequest = request;
+      co_return result;
+   }
+}
+Task<> sendMessage(char* buffer,const path& directorypath,pmr::memory_resource* arena,const string& user, int* current_socket)
+{
+   // sends Message to the server
+   // the body is streamed into a temporary file line by line, so memory use
+   // is the same for every message size; a disconnect throws and the
+   // writer removes the partial file
+   pmr::string receiver(arena);
+   pmr::string subject(arena);
+   SpoolWriter writer;
+   SearchTerms document;
+   // terms are only collected when the mailbox has a search index to update
+   bool indexed = searchFind(directorypath.native()) != nullptr;
+   uint64_t bodyLines = 0;
+   co_await receive(buffer, current_socket);
+   LOG_DEBUG("SEND receiver: %s", buffer);
+   receiver = buffer;
+   co_await receive(buffer, current_socket);
+   buffer[80] = '\0'; // subjects are limited to 80 characters
+   LOG_TRACE("SEND subject: %s", buffer);
+   subject = buffer;
+
+   // a full mailbox refuses the message before the body is read; the body
+   // is still consumed, to stay in step with the client, but not stored
+   SpoolUsage limit = quotas.limit(user);
+   bool limited = quotaLimited(limit);
+   SpoolUsage usage = limited ? co_await storage(current_socket, [&]() { return spoolUsage(directorypath.native()); }) : SpoolUsage();
+   if (limited && quotaFull(usage, limit))
+   {
+      serverStats.quota.fetch_add(1, memory_order_relaxed);
+      co_await answer(current_socket, "QUOTA");
+      do
+      {
+         co_await receive(buffer, current_socket);
+      }
+      while (strcmp(buffer, ".") != 0);
+      co_return;
+   }
+
+   //The next mailbox version gives each mail a unique, increasing id, taken
+   //when the message is stored so ids appear in order
+   string filename;
+   bool opened;
+   int error = 0;
+   {
+      TraceSpan span("storage");
+      opened = co_await storage(current_socket, [&]()
+      {
+         bool done = writer.open(directorypath.native());
+         error = errno;
+         return done;
+      });
+   }
+   if (!opened)
+   {
+      // the body is still read, the client sends it regardless
+      LOG_ERROR("failed to create a message file in %s: %s", directorypath.c_str(), strerror(error));
+   }
+   writer.header(receiver, subject);
+   for (;;)
+   {
+      try
+      {
+         co_await receive(buffer, current_socket);
+      }
+      catch (const invalid_argument& except)
+      {
+         LOG_WARN("SEND aborted after %llu lines: %s", (unsigned long long)bodyLines, except.what());
+         throw;
+      }
+      if (strcmp(buffer, ".") == 0)
+      {
+         break;
+      }
+      LOG_TRACE("SEND body: %s", buffer);
+      if(strlen(buffer) != 0)
+      {
+         writer.line(buffer);
+         if (indexed)
+         {
+            document.add(buffer);
+         }
+         bodyLines++;
+      }
+   }
+   uint64_t writeStarted = monotonicNanos();
+   bool stored = false;
+   if (opened)
+   {
+      TraceSpan span("storage");
+      stored = co_await storage(current_socket, [&]()
+      {
+         bool done = writer.commit(directorypath.native(), user, filename, limited ? &limit : NULL, &usage);
+         error = errno;
+         return done;
+      });
+   }
+   serverStats.spoolIo.record(monotonicNanos() - writeStarted);
+   if (!stored && opened && error == EDQUOT)
+   {
+      serverStats.quota.fetch_add(1, memory_order_relaxed);
+      co_await answer(current_socket, "QUOTA");
+      co_return;
+   }
+   if (!stored)
+   {
+      if (opened)
+      {
+         LOG_ERROR("failed to write a message into %s: %s", directorypath.c_str(), strerror(error));
+      }
+      co_await answer(current_socket, "ERR");
+      co_return;
+   }
+   LOG_DEBUG("File created: %s/%s", directorypath.c_str(), filename.c_str());
+   indexForget(directorypath.native());
+   quotas.record(user, usage);
+   retentionAdded(directorypath.native(), user, usage);
+   replicate(true, user, filename);
+   if (indexed)
+   {
+      document.add(subject);
+      searchAdd(directorypath.native(), filename.c_str(), subject.c_str(), document);
+   }
+   else if (searchFind(directorypath.native()) != nullptr)
+   {
+      // the first SEARCH of the mailbox built its index while the body came
+      // in, without this message the next SEARCH would build it again
+      co_await storage(current_socket, [&]() { searchAddFile(directorypath.native(), filename); });
+   }
+   co_await answer(current_socket, "OK");
+   idleNotify(directorypath.native(), spoolMessageId(filename));
+}
+Task<> importMessages(char* buffer,const path& directorypath,const string& user, int* current_socket)
+{
+   // the archive arrives as mbox lines up to a single ".", a leading "." of
+   // a line is doubled by the client; messages are stored as they complete
+   MailParser parser;
+   string line; // a line longer than a frame arrives in pieces
+   uint64_t count = 0;
+   uint64_t failures = 0;
+   uint64_t overQuota = 0;
+   SpoolUsage limit = quotas.limit(user);
+   auto store = [&]()
+   {
+      SpoolMessage message = parser.finish(user);
+      string filename;
+      TraceSpan span("storage");
+      uint64_t writeStarted = monotonicNanos();
+      SpoolUsage usage;
+      if (spoolWriteMessage(directorypath.native(), user, message, filename, quotaLimited(limit) ? &limit : NULL, &usage))
+      {
+         count++;
+         quotas.record(user, usage);
+         indexForget(directorypath.native());
+         retentionAdded(directorypath.native(), user, usage);
+         replicate(true, user, filename);
+         idleNotify(directorypath.native(), spoolMessageId(filename));
+         if (searchFind(directorypath.native()) != nullptr)
+         {
+            SearchTerms document;
+            document.add(message.subject);
+            for (const string& line : message.body)
+            {
+               document.add(line);
+            }
+            searchAdd(directorypath.native(), filename, message.subject, document);
+         }
+      }
+      else if (errno == EDQUOT)
+      {
+         overQuota++;
+      }
+      else
+      {
+         failures++;
+         LOG_ERROR("failed to store a message into %s: %s", directorypath.c_str(), strerror(errno));
+      }
+      serverStats.spoolIo.record(monotonicNanos() - writeStarted);
+   };
+   for (;;)
+   {
+      try
+      {
+         co_await receive(buffer, current_socket);
+      }
+      catch (const invalid_argument& except)
+      {
+         LOG_WARN("IMPORT aborted after %llu messages: %s", (unsigned long long)count, except.what());
+         throw;
+      }
+      line += buffer;
+      if (connections[*current_socket]->split)
+      {
+         continue; // only a whole line can be a "From " line or the end
+      }
+      if (line == ".")
+      {
+         break;
+      }
+      if (mboxLine(parser, line[0] == '.' ? string_view(line).substr(1) : string_view(line)))
+      {
+         co_await storage(current_socket, store);
+      }
+      line.clear();
+   }
+   if (parser.started)
+   {
+      co_await storage(current_socket, store);
+   }
+   LOG_INFO("IMPORT %llu messages into %s, %llu failed, %llu over quota", (unsigned long long)count, user.c_str(),
+            (unsigned long long)failures, (unsigned long long)overQuota);
+   if (overQuota != 0)
+   {
+      serverStats.quota.fetch_add(1, memory_order_relaxed);
+   }
+   co_await answer(current_socket, failures != 0 ? "ERR" : overQuota != 0 ? "QUOTA" : "OK");
+}
+Task<> exportMessages(char* buffer,const string& user,bool admin, int* current_socket)
+{
+   // EXPORT <mailbox>: empty = own mailbox, "*" = all, those two and other
+   // mailboxes only for the logged in admin.
+   // Reply "OK" followed by the ustar archive in chunks, each one frame with
+   // its decimal length and then that many raw bytes; a length of 0 ends it.
+   static atomic<uint64_t> exports{0};
+   string mailbox;
+   bool received = true;
+   try
+   {
+      co_await receive(buffer, current_socket);
+      mailbox = buffer;
+   }
+   catch (const invalid_argument& except)
+   {
+      LOG_WARN("%s", except.what());
+      received = false;
+   }
+   if (!received)
+   {
+      co_return;
+   }
+   if (mailbox.empty())
+   {
+      mailbox = user;
+   }
+   if ((mailbox != user && !admin)
+       || (mailbox != "*" && (!spoolValidUser(mailbox) || !is_directory(spoolMailboxPath(spoolDirectoryPath, mailbox)))))
+   {
+      co_await answer(current_socket, "ERR");
+      co_return;
+   }
+
+   string snapshot = spoolDirectoryPath + "/.export-" + to_string(getpid()) + "-" + to_string(exports.fetch_add(1));
+   vector<ExportEntry> entries;
+   bool taken;
+   {
+      TraceSpan span("snapshot");
+      taken = co_await storage(current_socket, [&]()
+      {
+         if (exportSnapshot(spoolDirectoryPath, mailbox, snapshot, entries))
+         {
+            return true;
+         }
+         LOG_ERROR("EXPORT snapshot %s failed: %s", snapshot.c_str(), strerror(errno));
+         exportRemoveSnapshot(snapshot);
+         return false;
+      });
+   }
+   if (!taken)
+   {
+      co_await answer(current_socket, "ERR");
+      co_return;
+   }
+   LOG_INFO("EXPORT %s: %zu messages for %s", mailbox.c_str(), entries.size(), user.c_str());
+   co_await answer(current_socket, "OK");
+   uint64_t streamStarted = monotonicNanos();
+   {
+      // the archive is read on a storage worker a chunk at a time and sent
+      // from the loop, a slow client holds no worker while it reads
+      TraceSpan span("storage");
+      ExportReader reader(snapshot, entries);
+      vector<char> chunk(EXPORT_CHUNK);
+      for (;;)
+      {
+         size_t length = co_await storage(current_socket, [&]() { return reader.fill(chunk.data(), chunk.size()); });
+         string header = to_string(length);
+         if (!co_await transmit(current_socket, header.c_str(), header.size() + 1)
+             || (length != 0 && !co_await transmit(current_socket, chunk.data(), length)))
+         {
+            LOG_WARN("EXPORT %s aborted, client is gone", mailbox.c_str());
+            break;
+         }
+         if (length == 0)
+         {
+            break; // the "0" frame ended the archive
+         }
+      }
+   }
+   co_await storage(current_socket, [&]() { exportRemoveSnapshot(snapshot); });
+   serverStats.spoolIo.record(monotonicNanos() - streamStarted);
+}
+Task<> searchMessages(char* buffer,const path& directorypath,const vector<string>& index,pmr::memory_resource* arena, int* current_socket)
+{
+   // SEARCH <words>: messages containing every word in subject or body.
+   // Reply like LIST: the count, then "<number> <subject>" per match, the
+   // number being the one READ and DEL take.
+   co_await receive(buffer, current_socket);
+   vector<string> words;
+   searchTokenize(buffer, [&words](const string& term) { words.push_back(term); });
+   LOG_DEBUG("SEARCH %s", buffer);
+
+   const string& mailbox = directorypath.native();
+   shared_ptr<MailboxIndex> search = searchFind(mailbox);
+   if (search != nullptr)
+   {
+      // files that appeared behind the server's back (offline import) show
+      // up as more messages than indexed, the index is then built again; it
+      // may also be ahead of this command's listing when other sessions
+      // stored since, the names it has beyond the listing are skipped below
+      shared_lock<shared_mutex> lock(search->mutex);
+      if (search->live < index.size())
+      {
+         search = nullptr;
+      }
+   }
+   if (search == nullptr)
+   {
+      TraceSpan span("index");
+      uint64_t buildStarted = monotonicNanos();
+      search = co_await storage(current_socket, [&]() { return searchBuild(mailbox, index); });
+      serverStats.spoolIo.record(monotonicNanos() - buildStarted);
+      LOG_INFO("search index of %s built, %zu messages", mailbox.c_str(), search->live);
+   }
+
+   pmr::vector<pmr::string> matches(arena);
+   {
+      TraceSpan span("search");
+      shared_lock<shared_mutex> lock(search->mutex);
+      vector<uint32_t> hits = search->query(words);
+      if (!hits.empty())
+      {
+         // message numbers are positions in the directory listing
+         unordered_map<string_view, uint32_t> wanted;
+         for (uint32_t hit : hits)
+         {
+            wanted.emplace(search->names[hit], hit);
+         }
+         for (size_t i = 0; i < index.size() && matches.size() < hits.size(); i++)
+         {
+            auto found = wanted.find(string_view(index[i].data(), index[i].size()));
+            if (found != wanted.end())
+            {
+               pmr::string match(to_string(i + 1).c_str(), arena);
+               match += ' ';
+               match += search->subjects[found->second];
+               matches.push_back(match);
+            }
+         }
+      }
+   }
+   co_await transmitLine(current_socket, to_string(matches.size()).c_str());
+   for (const pmr::string& match : matches)
+   {
+      co_await transmitLine(current_socket, match.c_str());
+   }
+}
+Task<> listMessages(char* buffer,const path& directorypath,const vector<string>& index,pmr::memory_resource* arena, int* current_socket)
+{
+   // buffer still holds the command line, arguments select a paged listing
+   string_view arguments = parseCommand(buffer).arguments;
+   if (!arguments.empty())
+   {
+      co_await listRange(arguments, directorypath, index, arena, current_socket);
+      co_return;
+   }
+   int messagecount = 0;
+   pmr::vector<pmr::string> messages(arena);
+   bool listed = co_await storage(current_socket, [&]()
+   {
+      if (filesystem::is_empty(directorypath))
+      {
+         return false;
+      }
+      uint64_t readStarted = monotonicNanos();
+      for(long unsigned int i = 0; i < index.size();i++)
+      {
+         TraceSpan span("storage");
+         pmr::string subject(arena);
+         ifstream message(mailPath(directorypath, index[i], arena).c_str());
+         int counter = 0;
+         //We iterate through the mail taking the subject from each
+         while (getline (message, subject)) 
+         {
+            if(counter == 1)
+            {
+               messages.push_back(subject);
+               break;
+            }
+            counter++;
+         }
+         message.close();
+         // a message removed after the index was taken still counts, subject and all
+         if (messages.size() == (size_t)messagecount)
+         {
+            messages.emplace_back();
+         }
+         messagecount++;
+      }
+      serverStats.spoolIo.record(monotonicNanos() - readStarted);
+      return true;
+   });
+   if(listed)
+   {
+      LOG_DEBUG("LIST %d messages", messagecount);
+      //We are sending the count of messages to the client
+      co_await transmitLine(current_socket, to_string(messagecount).c_str());
+      if(messagecount != 0)
+      {
+         for(int i = 0; i < messagecount;i++)
+         {
+            co_await transmitLine(current_socket, messages[i].c_str());
+         }
+         messages.clear();
+      }
+   }
+   else
+   {
+      co_await transmitLine(current_socket, to_string(messagecount).c_str());
+   }
+}
+Task<> listRange(string_view arguments,const path& directorypath,const vector<string>& index,pmr::memory_resource* arena, int* current_socket)
 {
-   string messageNumber;
-   long unsigned int messNum = 0;
-   if(!filesystem::is_empty(directorypath))
+   // LIST <limit> [<offset>]      page of the mailbox, oldest first
+   // LIST SINCE <id> [<limit>]    messages added after id, oldest first
+   // Reply "<count> <version> <total>", then "<number> <id> <subject>" per
+   // message. Polling clients pass the last id they saw and only get the
+   // delta; a changed version with no new messages means something was
+   // deleted (the total shows it), which needs a full listing.
+   char mode[16] = "";
+   unsigned long long first = 0;
+   unsigned long long second = 0;
+   string text(arguments);
+   int fields = sscanf(text.c_str(), "%15s %llu %llu", mode, &first, &second);
+   size_t begin = 0;
+   size_t limit = index.size();
+   if (fields >= 2 && strcasecmp(mode, "since") == 0)
    {
-      try
+      // the index is sorted by id, the delta starts after the first larger id
+      begin = partition_point(index.begin(), index.end(), [first](const string& name)
+      {
+         return spoolMessageId(string_view(name.data(), name.size())) <= first;
+      }) - index.begin();
+      if (fields == 3)
       {
-         strcpy(buffer,receive(buffer, current_socket));
-         messageNumber = buffer;
-         printf("Content received: %s\n", buffer); // ignore error
+         limit = second;
       }
-      catch (const invalid_argument& except)
+   }
+   else if (fields >= 1 && isdigit((unsigned char)mode[0]))
+   {
+      limit = strtoull(mode, NULL, 10);
+      begin = fields >= 2 ? first : 0;
+   }
+   else
+   {
+      co_await answer(current_socket, "ERR");
+      co_return;
+   }
+   size_t end = begin < index.size() ? begin + min(limit, index.size() - begin) : begin;
+   uint64_t version = 0;
+
+   pmr::vector<pmr::string> lines(arena);
+   uint64_t readStarted = monotonicNanos();
+   co_await storage(current_socket, [&]()
+   {
+      version = spoolVersion(directorypath.native());
+      for (size_t i = begin; i < end; i++)
       {
-         cerr << except.what() << endl;
+         TraceSpan span("storage");
+         // only the requested window is opened
+         pmr::string subject(arena);
+         ifstream message(mailPath(directorypath, index[i], arena).c_str());
+         getline(message, subject);
+         subject.clear();
+         getline(message, subject);
+         pmr::string line(to_string(i + 1).c_str(), arena);
+         line += ' ';
+         line += to_string(spoolMessageId(string_view(index[i].data(), index[i].size()))).c_str();
+         line += ' ';
+         line += subject;
+         lines.push_back(line);
       }
+   });
+   serverStats.spoolIo.record(monotonicNanos() - readStarted);
+   LOG_DEBUG("LIST %zu of %zu messages from %zu, version %llu", lines.size(), index.size(), begin, (unsigned long long)version);
+   string header = to_string(lines.size()) + " " + to_string(version) + " " + to_string(index.size());
+   co_await transmitLine(current_socket, header.c_str());
+   for (const pmr::string& line : lines)
+   {
+      co_await transmitLine(current_socket, line.c_str());
+   }
+}
+Task<> readMessage(char* buffer,const path& directorypath,const vector<string>& index,pmr::memory_resource* arena, int* current_socket)
+{
+   string messageNumber;
+   long unsigned int messNum = 0;
+   // the number is always consumed, so exactly one reply follows every
+   // request; a client that disconnects throws and ends the session
+   co_await receive(buffer, current_socket);
+   messageNumber = buffer;
+   LOG_DEBUG("message number: %s", buffer);
+   if(!co_await storage(current_socket, [&]() { return filesystem::is_empty(directorypath); }))
+   {
+      bool valid = true;
       try
       {
          int temp = stoi(messageNumber);
          if(temp >= 0)
          {
-            messNum = temp;
+            messNum += temp;
          }
          else
          {
@@ -480,169 +1438,791 @@ void deleteMessage(char* buffer, path directorypath,vector<string> index, int* c
       }
       catch(...)
       {
-         if (send(*current_socket, "ERR", 4, 0) == -1)
-         {
-            perror("send answer failed");
-         }
+         valid = false;
+      }
+      if(!valid)
+      {
+         co_await answer(current_socket, "ERR");
+         co_return;
       }
-      if(messNum <= index.size()-1)
+      if(messNum >= 1 && messNum <= index.size())
       {
-         string fileToRemove = index[messNum];
-         vector<string> temp;
-         for(long unsigned int i = 0; i != index.size();i++)
+         co_await answer(current_socket, "OK");
+         TraceSpan span("storage");
+         uint64_t readStarted = monotonicNanos();
+         // every line of the file is one frame: '\n' becomes '\0' and the file
+         // goes out in large pieces, a TLS record is not wasted on every line;
+         // the pieces are read on a storage worker, sent from the loop
+         char chunk[READ_CHUNK];
+         char last = '\0';
+         ssize_t size;
+         int file = -1;
+         size = co_await storage(current_socket, [&]()
          {
-            if(i != messNum)
+            file = open(mailPath(directorypath, index[messNum-1], arena).c_str(), O_RDONLY | O_CLOEXEC);
+            return file == -1 ? (ssize_t)-1 : read(file, chunk, sizeof(chunk));
+         });
+         while (size > 0)
+         {
+            replace(chunk, chunk + size, '\n', '\0');
+            last = chunk[size - 1];
+            if (!co_await transmit(current_socket, chunk, size))
+            {
+               break;
+            }
+            if (size < (ssize_t)sizeof(chunk))
             {
-               temp.push_back(index[i]);
+               break; // a short read of a message file is its end
             }
+            size = co_await storage(current_socket, [&]() { return read(file, chunk, sizeof(chunk)); });
          }
-         index.clear();    //deleting contents of vector so the referenz to the deleted file can be removed
-         index.resize(1);  //resize the vector index to avoid segmentaion faults
-         for(long unsigned int i = 0; i != temp.size();i++)
+         if (last != '\0')
          {
-            index.push_back(temp[i]);  //repopulating the vector with the remaining filenames
+            co_await transmit(current_socket, "", 1);
          }
-         remove(directorypath/fileToRemove); //deletes the targeted file
-         if (send(*current_socket, "OK", 3, 0) == -1)
+         if (file != -1)
          {
-            perror("send answer failed");
+            close(file);
          }
+         serverStats.spoolIo.record(monotonicNanos() - readStarted);
       }
       else
       {
-         if (send(*current_socket, "ERR", 4, 0) == -1)
+         co_await answer(current_socket, "ERR");
+      }
+   }
+   else
+   {
+      co_await answer(current_socket, "ERR");
+   }
+}
+Task<> deleteMessage(char* buffer,const path& directorypath,const vector<string>& index,pmr::memory_resource* arena, int* current_socket)
+{
+   string messageNumber;
+   long unsigned int messNum = 0;
+   // the number is always consumed, so exactly one reply follows every
+   // request; a client that disconnects throws and ends the session
+   co_await receive(buffer, current_socket);
+   messageNumber = buffer;
+   LOG_DEBUG("message number: %s", buffer);
+   if(!co_await storage(current_socket, [&]() { return filesystem::is_empty(directorypath); }))
+   {
+      bool valid = true;
+      try
+      {
+         // numbered from 1 like READ, LIST and SEARCH show them
+         int temp = stoi(messageNumber);
+         if(temp >= 1)
+         {
+            messNum = temp;
+         }
+         else
          {
-            perror("send answer failed");
+            throw(std::invalid_argument(" "));
          }
       }
+      catch(...)
+      {
+         valid = false;
+      }
+      if(!valid)
+      {
+         co_await answer(current_socket, "ERR");
+         co_return;
+      }
+      if(messNum <= index.size())
+      {
+         const string& fileToRemove = index[messNum - 1];
+         TraceSpan span("storage");
+         uint64_t removeStarted = monotonicNanos();
+         // false when a concurrent DEL, the retention sweep or a migration
+         // removed the file first, its bookkeeping is already done
+         bool removed = co_await storage(current_socket, [&]()
+         {
+            // file, usage and version change in one step under the lock of
+            // the version, like SEND stores; EXPORT never sees half of it
+            pmr::string filepath = mailPath(directorypath, fileToRemove, arena);
+            struct stat status;
+            SpoolUsage usage;
+            if (stat(filepath.c_str(), &status) != 0
+                || !spoolRemoveMessage(directorypath.native(), fileToRemove, status.st_size, &usage)) //deletes the targeted file
+            {
+               return false;
+            }
+            replicate(false, directorypath.filename().native(), string(fileToRemove.data(), fileToRemove.size()));
+            quotas.record(directorypath.filename().native(), usage); // the mailbox is named after its user
+            searchRemove(directorypath.native(), fileToRemove.c_str());
+            indexForget(directorypath.native());
+            return true;
+         });
+         serverStats.spoolIo.record(monotonicNanos() - removeStarted);
+         co_await answer(current_socket, removed ? "OK" : "ERR");
+      }
+      else
+      {
+         co_await answer(current_socket, "ERR");
+      }
    }
    else
    {
-      if (send(*current_socket, "ERR", 4, 0) == -1)
+      co_await answer(current_socket, "ERR");
+   }
+}
+Task<> clientCommunication(EventLoop* loop, int socket)
+{
+   Session *session = new Session; // the receive buffer is not cleared, it is written before it is read
+   session->socket = socket;
+   session->connection.descriptor = session->socket;
+   session->connection.timer.descriptor = session->socket;
+   session->connection.owner = session;
+   session->connection.loop = loop;
+
+   // over the session limit the client is turned away before any work,
+   // a plain text client is told why
+   int64_t maxSessions = limits.maxSessions.load(memory_order_relaxed);
+   if (maxSessions > 0 && serverStats.activeSessions.load(memory_order_relaxed) >= maxSessions)
+   {
+      if (tlsContext == NULL)
       {
-         perror("send answer failed");
+         send(session->socket, "BUSY\r\n", 6, MSG_NOSIGNAL);
       }
+      serverStats.busy.fetch_add(1, memory_order_relaxed);
+      close(session->socket);
+      delete session;
+      co_return;
+   }
+   struct sockaddr_in peer;
+   socklen_t peerLength = sizeof(peer);
+   if (getpeername(session->socket, (struct sockaddr *)&peer, &peerLength) == 0)
+   {
+      session->address = inet_ntoa(peer.sin_addr);
+   }
+   connections[session->socket] = &session->connection;
+
+   // a client that stalls the handshake only holds its own session
+   timeoutArm(&session->connection, TimeoutRead);
+   int secured = tlsContext == NULL ? 1 : tlsAccept(tlsContext, session->socket);
+   while (secured == 0)
+   {
+      co_await loop->wait(session->socket, netWaitsForInput(session->socket, true) ? EPOLLIN : EPOLLOUT);
+      secured = tlsAccept(tlsContext, session->socket);
+   }
+   timeoutCancel(&session->connection);
+   if (secured == -1)
+   {
+      LOG_WARN("TLS handshake failed");
+      connections[session->socket] = NULL;
+      close(session->socket);
+      delete session;
+      co_return;
+   }
+   if (tlsContext != NULL)
+   {
+      SSL *ssl = tlsStream(session->socket);
+      LOG_DEBUG("%s %s, kernel TLS %s", SSL_get_version(ssl), SSL_session_reused(ssl) ? "resumed" : "full handshake",
+                BIO_get_ktls_send(SSL_get_wbio(ssl)) ? "on" : "off");
+   }
+
+   ////////////////////////////////////////////////////////////////////////////
+   // SEND welcome message
+   const char *welcome = "Welcome to twmailer!\r\nPlease enter your commands...\r\n";
+   if (!co_await transmit(&session->socket, welcome, strlen(welcome)))
+   {
+      connections[session->socket] = NULL;
+      tlsClose(session->socket);
+      close(session->socket);
+      delete session;
+      co_return;
+   }
+   serverStats.activeSessions.fetch_add(1, memory_order_relaxed);
+   serverStats.totalSessions.fetch_add(1, memory_order_relaxed);
+   if (captureEnabled.load(memory_order_relaxed))
+   {
+      session->connection.capture.number = captureOpen();
    }
+
+   co_await runSession(session);
+   endSession(session);
 }
-void *clientCommunication(void *data)
+// suspends a session parked by IDLE, the idle reactor posts it back
+struct IdleWait
+{
+   Session *session;
+   uint64_t seconds;
+
+   bool await_ready() const noexcept
+   {
+      return false;
+   }
+
+   bool await_suspend(coroutine_handle<> waiting)
+   {
+      return idlePark(session, seconds, waiting);
+   }
+
+   void await_resume() const noexcept
+   {
+   }
+};
+Task<> runSession(Session *session)
 {
    char buffer[BUF];
-   int *current_socket = (int *)data;
-   int isQuit;
-   char commands[LEN][LEN] = {"quit","send", "list", "read", "del", "login"};
+   int *current_socket = &session->socket;
+   int isQuit = 0;
+   string &user = session->user;
 
-   ////////////////////////////////////////////////////////////////////////////
-   // SEND welcome message
-   strcpy(buffer, "Welcome to twmailer!\r\nPlease enter your commands...\r\n");
-   if (send(*current_socket, buffer, strlen(buffer), 0) == -1)
+   do
+   {
+      int isValid = 0;
+      uint64_t idleSeconds = 0;
+      Command command = Command::Unknown;
+      try
+      {
+         session->connection.awaitingCommand = true;
+         co_await receive(buffer, current_socket);
+         session->connection.awaitingCommand = false;
+         LOG_DEBUG("Message received: %s", buffer);
+      }
+      catch (const invalid_argument& except)
+      {
+         LOG_WARN("%s", except.what());
+         break;
+      }
+      traceBeginRequest();
+      session->connection.request = traceRequest;
+      uint64_t started = monotonicNanos();
+      {
+         // the verb is matched in place, no copy of the line is made
+         TraceSpan span("parse");
+         command = parseCommand(buffer).command;
+         isQuit = command == Command::Quit;
+         isValid = command != Command::Unknown;
+      }
+      const char* refusal = !isQuit && isValid ? admitCommand(session) : NULL;
+      if (refusal == NULL && standby.load(memory_order_relaxed)
+          && (command == Command::Send || command == Command::Del || command == Command::Import))
+      {
+         refusal = "ERR"; // a standby only changes through replication
+      }
+      if (refusal != NULL)
+      {
+         // refused before it touches the disk, its frames are read and dropped
+         try
+         {
+            co_await dropArguments(command, buffer, current_socket);
+            co_await answer(current_socket, refusal);
+         }
+         catch (const invalid_argument& except)
+         {
+            isQuit = 1;
+         }
+      }
+      else if(!isQuit)
+      {
+         if(isValid)
+         {
+            commandsRunning.fetch_add(1, memory_order_relaxed);
+            session->connection.failed = false;
+            path directorypath;
+            directorypath = spoolMailboxPath(spoolDirectoryPath, user);
+            // names relative to the mailbox in id order, listed again only
+            // when the mailbox changed (see MAILBOX INDEX); the listing is
+            // shared, the command only holds on to it
+            shared_ptr<const MailboxNames> names;
+            {
+               TraceSpan span("index");
+               uint64_t scanStarted = monotonicNanos();
+               names = co_await storage(current_socket, [&]()
+               {
+                  if (!exists(directorypath))
+                  {
+                     TraceSpan span("mailbox");
+                     if (!spoolCreateDirectories(directorypath.native()))
+                     {
+                        LOG_ERROR("failed to create directory %s", directorypath.c_str());
+                     }
+                  }
+                  return indexGet(directorypath.native());
+               });
+               serverStats.spoolIo.record(monotonicNanos() - scanStarted);
+               LOG_DEBUG("mailbox %s holds %zu files", user.c_str(), names->names.size());
+            }
+            const vector<string>& index = names->names;
+            // a client that disconnects in the middle of a command ends the session
+            try
+            {
+               switch (command)
+               {
+               case Command::Send:
+                  co_await sendMessage(buffer,directorypath,&session->arena,user,current_socket);
+                  break;
+               case Command::List:
+                  co_await listMessages(buffer,directorypath,index,&session->arena,current_socket);
+                  break;
+               case Command::Read:
+                  co_await readMessage(buffer,directorypath,index,&session->arena,current_socket);
+                  break;
+               case Command::Del:
+                  co_await deleteMessage(buffer,directorypath,index,&session->arena,current_socket);
+                  break;
+               case Command::Login:
+                  co_await loginMessage(buffer,user,session->admin,current_socket);
+                  break;
+               case Command::Stats:
+                  co_await statsMessage(session->admin,current_socket);
+                  break;
+               case Command::Usage:
+                  co_await usageMessage(session->admin,current_socket);
+                  break;
+               case Command::Export:
+                  co_await exportMessages(buffer,user,session->admin,current_socket);
+                  break;
+               case Command::Search:
+                  co_await searchMessages(buffer,directorypath,index,&session->arena,current_socket);
+                  break;
+               case Command::Import:
+                  co_await importMessages(buffer,directorypath,user,current_socket);
+                  break;
+               case Command::Idle:
+                  idleSeconds = co_await idleMessage(buffer,directorypath,index,session);
+                  break;
+               default:
+                  break;
+               }
+            }
+            catch (const invalid_argument& except)
+            {
+               isQuit = 1; // connection is gone
+               session->connection.failed = true;
+            }
+            session->arena.release(); // its blocks go back to arenaPool
+            commandsRunning.fetch_sub(1, memory_order_relaxed);
+            CommandStats &stats = serverStats.commands[(int)command];
+            stats.calls.fetch_add(1, memory_order_relaxed);
+            if (session->connection.failed)
+            {
+               stats.errors.fetch_add(1, memory_order_relaxed);
+            }
+            uint64_t finished = monotonicNanos();
+            stats.latency.record(finished - started);
+            if (traceEnabled.load(memory_order_relaxed))
+            {
+               traceRecord(commandName(command), started, finished);
+            }
+         }
+         else
+         {
+            co_await answer(current_socket, "ERR");
+         }
+      }
+      if (idleSeconds != 0)
+      {
+         // a parked session is a suspended coroutine, it holds no thread
+         co_await IdleWait{session, idleSeconds};
+         LOG_DEBUG("IDLE of %s ends: %s", user.c_str(), session->idleReply.c_str());
+         co_await transmitLine(current_socket, session->idleReply.c_str());
+      }
+   }
+   while(!isQuit && !abortRequested);
+}
+void endSession(Session *session)
+{
+   serverStats.activeSessions.fetch_sub(1, memory_order_relaxed);
+   connections[session->connection.descriptor] = NULL;
+   if (session->connection.capture.number != 0)
+   {
+      captureClose(session->connection.capture);
+   }
+   timeoutCancel(&session->connection); // the descriptor must not be reused under an armed timer
+
+   // closes/frees the descriptor if not already
+   if (session->socket != -1)
+   {
+      tlsClose(session->socket);
+      if (shutdown(session->socket, SHUT_RDWR) == -1)
+      {
+         LOG_ERROR("shutdown new_socket: %s", strerror(errno));
+      }
+      if (close(session->socket) == -1)
+      {
+         LOG_ERROR("close new_socket: %s", strerror(errno));
+      }
+      session->socket = -1;
+   }
+   delete session;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// TIMEOUTS
+// Idle (no command), read (rest of a command) and write timeouts share the
+// one timer of a connection, armed around every wait for the socket. When
+// it fires, the socket is shut down; the waiting call fails and the session
+// ends through its normal path. Slowloris clients that trickle a byte now and
+// then are caught as well: a frame has to be complete within the read
+// timeout that started when its first byte arrived.
+
+void timeoutArm(Connection* connection, int reason)
+{
+   if (connection != NULL && sessionTimeouts[reason] != 0)
+   {
+      sessionTimers.arm(connection->timer, monotonicNanos(), sessionTimeouts[reason], reason);
+   }
+}
+void timeoutCancel(Connection* connection)
+{
+   if (connection != NULL)
+   {
+      sessionTimers.cancel(connection->timer);
+   }
+}
+void timeoutReaper()
+{
+   const char* reasons[] = {"idle", "read", "write"};
+   uint64_t pruned = monotonicNanos();
+   while (!abortRequested)
+   {
+      this_thread::sleep_for(chrono::nanoseconds(TIMER_TICK));
+      // the other housekeeping of the server rides along
+      if (reloadRequested)
+      {
+         reloadRequested = 0;
+         limitsReload();
+         quotasReload();
+         retentionReload();
+      }
+      if (promoteRequested)
+      {
+         promoteRequested = 0;
+         replicationPromote();
+      }
+      if (monotonicNanos() - pruned > 60000000000ull)
+      {
+         pruned = monotonicNanos();
+         userLimits.prune(pruned, 60000000000ull);
+         addressLimits.prune(pruned, 60000000000ull);
+      }
+      sessionTimers.advance(monotonicNanos(), [&reasons](TimerNode& timer)
+      {
+         LOG_INFO("closing connection %d: %s timeout", timer.descriptor, reasons[timer.reason]);
+         serverStats.timeouts[timer.reason].fetch_add(1, memory_order_relaxed);
+         shutdown(timer.descriptor, SHUT_RDWR);
+      });
+   }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// LIMITS
+// A command is refused with BUSY when max_commands are already running
+// server-wide, so overload is shed at once instead of queueing up, and with
+// LIMIT when the user or the address is over its command rate. Received
+// bytes over the byte rate hold the session back instead.
+
+const char* admitCommand(Session* session)
+{
+   int64_t maxCommands = limits.maxCommands.load(memory_order_relaxed);
+   if (maxCommands > 0 && commandsRunning.load(memory_order_relaxed) >= maxCommands)
+   {
+      serverStats.busy.fetch_add(1, memory_order_relaxed);
+      return "BUSY";
+   }
+   double rate = limits.commandRate.load(memory_order_relaxed);
+   if (rate <= 0)
+   {
+      return NULL;
+   }
+   double burst = limits.commandBurst.load(memory_order_relaxed);
+   uint64_t now = monotonicNanos();
+   auto admit = [rate, burst, now](LimitEntry& entry) { return entry.commands.admit(1, rate, burst, now); };
+   if (!userLimits.with(session->user, admit) || !addressLimits.with(session->address, admit))
+   {
+      serverStats.limited.fetch_add(1, memory_order_relaxed);
+      return "LIMIT";
+   }
+   return NULL;
+}
+Task<> dropArguments(Command command, char* buffer, int* current_socket)
+{
+   // the frames that follow the verb, SEND and IMPORT end with a "." frame
+   int frames = 0;
+   switch (command)
+   {
+      case Command::Send:
+      case Command::Login:
+         frames = 2;
+         break;
+      case Command::Read:
+      case Command::Del:
+      case Command::Search:
+      case Command::Export:
+         frames = 1;
+         break;
+      default:
+         break;
+   }
+   for (int i = 0; i < frames; i++)
+   {
+      co_await receive(buffer, current_socket);
+   }
+   if (command == Command::Send || command == Command::Import)
+   {
+      do
+      {
+         co_await receive(buffer, current_socket);
+      }
+      while (strcmp(buffer, ".") != 0);
+   }
+}
+// seconds the session has to wait before it reads on, receive() sleeps them
+double limitBytes(Session* session, size_t bytes)
+{
+   double rate = limits.byteRate.load(memory_order_relaxed);
+   if (session == NULL || rate <= 0)
+   {
+      return 0;
+   }
+   double burst = limits.byteBurst.load(memory_order_relaxed);
+   uint64_t now = monotonicNanos();
+   auto charge = [bytes, rate, burst, now](LimitEntry& entry) { return entry.bytes.charge(bytes, rate, burst, now); };
+   double delay = max(userLimits.with(session->user, charge), addressLimits.with(session->address, charge));
+   return min(delay, LIMIT_DELAY_MAX);
+}
+void limitsReload()
+{
+   const char* filename = getenv("TWMAILER_LIMITS_FILE");
+   if (filename == NULL)
+   {
+      return;
+   }
+   if (limitsLoad(filename, limits))
+   {
+      LOG_INFO("limits reloaded from %s", filename);
+   }
+   else
+   {
+      LOG_ERROR("limits in %s not reloaded, the old ones stay", filename);
+   }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// IDLE
+// A parked session is only an entry in a few tables: the waiter set of its
+// mailbox, a deadline heap and one epoll registration. A single reactor
+// thread watches all of them; when SEND/IMPORT delivers to the mailbox, the
+// timeout expires or the client sends something, the reactor hands the
+// final reply to the session and posts its coroutine back to its event
+// loop, which sends it. So parked sessions cost no thread, however many
+// there are.
+
+void idleStart()
+{
+   idleEpoll = epoll_create1(EPOLL_CLOEXEC);
+   idleWake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+   if (idleEpoll == -1 || idleWake == -1)
+   {
+      LOG_ERROR("idle reactor: %s", strerror(errno));
+      return;
+   }
+   struct epoll_event event = {};
+   event.events = EPOLLIN;
+   event.data.u64 = 0; // tickets start at 1
+   epoll_ctl(idleEpoll, EPOLL_CTL_ADD, idleWake, &event);
+   thread(idleReactor).detach();
+}
+// removes a parked session from every table, idleMutex is held
+Session *idleTake(uint64_t ticket)
+{
+   auto found = idleSessions.find(ticket);
+   if (found == idleSessions.end())
    {
-      perror("send failed");
       return NULL;
    }
-
-   do
+   Session *session = found->second;
+   idleSessions.erase(found);
+   auto waiters = idleWaiters.find(session->idleMailbox);
+   if (waiters != idleWaiters.end())
    {
-      int isValid = 0;
-      int command = -1;
-      try
+      waiters->second.erase(ticket);
+      if (waiters->second.empty())
       {
-         strcpy(buffer,receive(buffer, current_socket));
-         printf("Message received: %s\n", buffer); // ignore error
+         idleWaiters.erase(waiters);
       }
-      catch (const invalid_argument& except)
+   }
+   epoll_ctl(idleEpoll, EPOLL_CTL_DEL, session->socket, NULL);
+   return session;
+}
+void idleReactor()
+{
+   struct epoll_event events[256];
+   // runs on at shutdown, the sessions still parked are woken as their
+   // sockets are shut down
+   for (;;)
+   {
+      int timeout = -1;
       {
-         cerr << except.what() << endl;
-         break;
+         lock_guard<mutex> lock(idleMutex);
+         // deadlines of sessions that already left are dropped lazily
+         while (!idleDeadlines.empty() && idleSessions.count(idleDeadlines.top().second) == 0)
+         {
+            idleDeadlines.pop();
+         }
+         if (!idleDeadlines.empty())
+         {
+            uint64_t now = monotonicNanos();
+            uint64_t deadline = idleDeadlines.top().first;
+            timeout = deadline <= now ? 0 : (int)((deadline - now) / 1000000 + 1);
+         }
       }
-      char str[1024] = "";
-      strcpy(str, buffer);
-      int len =strlen(str);
-      for(int i = 0; i < len; i++)//all characters are converted to lowercase
+      int ready = epoll_wait(idleEpoll, events, sizeof(events) / sizeof(events[0]), timeout);
+      if (ready == -1 && errno != EINTR)
       {
-         str[i] = tolower(str[i]);
+         LOG_ERROR("idle reactor: %s", strerror(errno));
+         return;
       }
-      isQuit = strcmp(str, commands[0]) == 0;
-      if(!isQuit)
+
+      vector<pair<Session *, string>> wake;
       {
-         for(int i = 1; i < LEN; i++)
+         lock_guard<mutex> lock(idleMutex);
+         for (int i = 0; i < ready; i++)
          {
-            if(isValid != 1)
+            if (events[i].data.u64 == 0)
             {
-               isValid = strcmp(str, commands[i]) == 0;     //determines which command is selected
-               command = i;
-            }
-         }
-         if(isValid)
-         {
-            string user = "test";
-            path directorypath;
-            vector<string> index;
-            directorypath = spoolDirectoryPath + "/" + user;
-            if (!exists(directorypath)) 
-            { 
-               try
-               {
-                  create_directory(directorypath);
-               }
-               catch (...)
+               uint64_t count;
+               if (read(idleWake, &count, sizeof(count)) == -1 && errno != EAGAIN)
                {
-                  cerr << "failed to create directory" << endl;
+                  LOG_WARN("idle wakeup: %s", strerror(errno));
                }
+               continue;
             }
-            if(!empty(directorypath))
+            // the client sent a command or hung up, the session handles it
+            Session *session = idleTake(events[i].data.u64);
+            if (session != NULL)
             {
-               for (auto const& dir_entry : std::filesystem::directory_iterator{directorypath})
-               {
-                  index.push_back(dir_entry.path().filename());
-                  cout << dir_entry.path().filename();
-               }
+               wake.emplace_back(session, "DONE");
             }
-            switch (command)
+         }
+         for (auto &notified : idleNotified)
+         {
+            Session *session = idleTake(notified.first);
+            if (session != NULL)
             {
-            case 1:
-               sendMessage(buffer,directorypath,index,user,current_socket);
-               break;
-            case 2:
-               listMessages(buffer,directorypath,index,current_socket);
-               break;
-            case 3:
-               readMessage(buffer,directorypath,index,current_socket);
-               break;
-            case 4:
-               deleteMessage(buffer,directorypath,index,current_socket);
-               break;
-            case 5:
-               loginMessage(buffer,current_socket);
-               break;
+               wake.emplace_back(session, "NEW " + to_string(notified.second));
             }
          }
-         else
+         idleNotified.clear();
+         uint64_t now = monotonicNanos();
+         while (!idleDeadlines.empty() && idleDeadlines.top().first <= now)
          {
-            if (send(*current_socket, "ERR", 4, 0) == -1)
+            Session *session = idleTake(idleDeadlines.top().second);
+            if (session != NULL)
             {
-               perror("send answer failed");
-               break;
+               wake.emplace_back(session, "TIMEOUT");
             }
+            idleDeadlines.pop();
          }
       }
-   }
-   while(!isQuit && !abortRequested);
-
-   // closes/frees the descriptor if not already
-   if (*current_socket != -1)
-   {
-      if (shutdown(*current_socket, SHUT_RDWR) == -1)
+      for (auto &woken : wake)
       {
-         perror("shutdown new_socket");
+         woken.first->idleReply = woken.second;
+         woken.first->connection.loop->post(woken.first->idleWaiting);
       }
-      if (close(*current_socket) == -1)
+   }
+}
+Task<uint64_t> idleMessage(char* buffer,const path& directorypath,const vector<string>& index, Session *session)
+{
+   // IDLE [<seconds> [<last id>]]: "OK", then one of "NEW <id>" (a message
+   // was stored, or one newer than <last id> already is), "TIMEOUT", or
+   // "DONE" when the client sends a command, which is then processed.
+   // Returns the seconds to park the session for, 0 when it was answered.
+   int *current_socket = &session->socket;
+   unsigned long long seconds = IDLE_TIMEOUT;
+   unsigned long long since = 0;
+   string arguments(parseCommand(buffer).arguments);
+   int fields = sscanf(arguments.c_str(), "%llu %llu", &seconds, &since);
+   if (seconds == 0 || seconds > IDLE_TIMEOUT_MAX)
+   {
+      seconds = IDLE_TIMEOUT_MAX;
+   }
+   call_once(idleStarted, idleStart);
+   if (idleEpoll == -1 || idleWake == -1)
+   {
+      co_await answer(current_socket, "ERR");
+      co_return 0;
+   }
+   co_await answer(current_socket, "OK");
+   uint64_t newest = index.empty() ? 0 : spoolMessageId(string_view(index.back().data(), index.back().size()));
+   if (fields == 2 && newest > since)
+   {
+      co_await transmitLine(current_socket, ("NEW " + to_string(newest)).c_str());
+      co_return 0;
+   }
+   if (session->connection.start != session->connection.end || netPending(session->socket))
+   {
+      co_await transmitLine(current_socket, "DONE"); // the next command is already here
+      co_return 0;
+   }
+   session->idleMailbox = directorypath.native();
+   session->idleSince = fields == 2 ? since : newest;
+   co_return seconds;
+}
+// registers a session with the idle reactor, which posts waiting back to
+// the session's loop; false when it can not wait, with the reply to send
+bool idlePark(Session *session, uint64_t seconds, coroutine_handle<> waiting)
+{
+   lock_guard<mutex> lock(idleMutex);
+   // a message stored since the index of the command was taken notified
+   // nobody yet; from here on idleNotify() finds the session
+   auto newest = idleNewest.find(session->idleMailbox);
+   if (newest != idleNewest.end() && newest->second > session->idleSince)
+   {
+      session->idleReply = "NEW " + to_string(newest->second);
+      return false;
+   }
+   uint64_t ticket = ++idleTickets;
+   session->idleTicket = ticket;
+   session->idleWaiting = waiting;
+   struct epoll_event event = {};
+   event.events = EPOLLIN | EPOLLRDHUP;
+   event.data.u64 = ticket;
+   if (epoll_ctl(idleEpoll, EPOLL_CTL_ADD, session->socket, &event) == -1)
+   {
+      LOG_ERROR("IDLE epoll: %s", strerror(errno));
+      session->idleReply = "TIMEOUT";
+      return false;
+   }
+   idleSessions[ticket] = session;
+   idleWaiters[session->idleMailbox].insert(ticket);
+   idleDeadlines.emplace(monotonicNanos() + seconds * 1000000000ull, ticket);
+   uint64_t one = 1;
+   if (write(idleWake, &one, sizeof(one)) == -1)
+   {
+      LOG_WARN("idle wakeup: %s", strerror(errno));
+   }
+   LOG_DEBUG("IDLE %s for %llus", session->user.c_str(), (unsigned long long)seconds);
+   return true;
+}
+// called after a message was stored in mailbox
+void idleNotify(const string& mailbox, uint64_t id)
+{
+   bool waiting = false;
+   {
+      lock_guard<mutex> lock(idleMutex);
+      uint64_t &newest = idleNewest[mailbox];
+      newest = max(newest, id);
+      auto waiters = idleWaiters.find(mailbox);
+      if (waiters != idleWaiters.end())
       {
-         perror("close new_socket");
+         for (uint64_t ticket : waiters->second)
+         {
+            idleNotified.emplace_back(ticket, id);
+         }
+         waiting = true;
       }
-      *current_socket = -1;
    }
-
-   return NULL;
+   uint64_t one = 1;
+   if (waiting && idleWake != -1 && write(idleWake, &one, sizeof(one)) == -1)
+   {
+      LOG_WARN("idle wakeup: %s", strerror(errno));
+   }
 }
 void signalHandler(int sig)
 {
@@ -655,40 +2235,37 @@ void signalHandler(int sig)
       // the reference count.
       // https://beej.us/guide/bgnet/html/#close-and-shutdownget-outta-my-face
       // https://linux.die.net/man/3/shutdown
-      if (new_socket != -1)
-      {
-         if (shutdown(new_socket, SHUT_RDWR) == -1)
-         {
-            perror("shutdown new_socket");
-         }
-         if (close(new_socket) == -1)
-         {
-            perror("close new_socket");
-         }
-         new_socket = -1;
-      }
-
-      if (create_socket != -1)
+      // The listeners stay open: a closed descriptor silently leaves epoll,
+      // a shut down one wakes its acceptor, which then ends the sessions of
+      // its loop. main() closes them.
+      for (int i = 0; i < acceptorCount; i++)
       {
-         if (shutdown(create_socket, SHUT_RDWR) == -1)
-         {
-            perror("shutdown create_socket");
-         }
-         if (close(create_socket) == -1)
+         if (listenSockets[i] != -1)
          {
-            perror("close create_socket");
+            if (shutdown(listenSockets[i], SHUT_RDWR) == -1)
+            {
+               perror("shutdown create_socket");
+            }
          }
-         create_socket = -1;
       }
    }
+   else if (sig == SIGHUP)
+   {
+      reloadRequested = 1; // picked up by the timeout reaper
+   }
+   else if (sig == SIGUSR1)
+   {
+      promoteRequested = 1; // likewise
+   }
    else
    {
       exit(sig);
    }
 }
 
-void loginMessage(char* buffer, int* current_socket)
+Task<> loginMessage(char* buffer, string& user, bool& admin, int* current_socket)
 {
+   TraceSpan span("auth");
    /*try
    {
       int connect = Connect();
@@ -696,33 +2273,504 @@ void loginMessage(char* buffer, int* current_socket)
    }
    catch (const invalid_argument& except)
    {
-      cerr << except.what() << endl;
+      LOG_WARN("%s", except.what());
    }*/
-   try
+   // a client that disconnects throws, the session ends like for any command
+   co_await receive(buffer, current_socket);
+   LOG_DEBUG("LOGIN user: %s", buffer);
+   //readUser(buffer);
+   // the name becomes a directory of the spool, it must not lead out of it
+   string name = buffer;
+   co_await receive(buffer, current_socket); // password, never logged
+   //readPassword(buffer);
+   // "*" stands for every mailbox in EXPORT; the admin name only with its password
+   bool isAdmin = name == adminUser;
+   bool authenticated = !isAdmin || (!adminPassword.empty() && strlen(buffer) == adminPassword.size()
+                                     && CRYPTO_memcmp(buffer, adminPassword.data(), adminPassword.size()) == 0);
+   if (!spoolValidUser(name) || name == "*" || !authenticated)
    {
-      strcpy(buffer,receive(buffer, current_socket));
-      printf("Content received: %s\n", buffer); // ignore error
+      LOG_WARN("LOGIN refused for %s", spoolValidUser(name) ? name.c_str() : "an invalid user name");
+      co_await answer(current_socket, "ERR");
+      co_return;
    }
-   catch (const invalid_argument& except)
+   user = name;
+   admin = isAdmin;
+   co_await answer(current_socket, "OK");
+
+}
+pmr::string mailPath(const path& directorypath, string_view filename, pmr::memory_resource* arena)
+{
+   // joins into the caller's arena instead of allocating a path
+   pmr::string filepath(directorypath.native().c_str(), arena);
+   filepath += '/';
+   filepath += filename;
+   return filepath;
+}
+Task<> statsMessage(bool admin, int* current_socket)
+{
+   // the report is sent as text lines terminated by a single "." line
+   if (!admin)
    {
-      cerr << except.what() << endl;
+      co_await answer(current_socket, "ERR");
+      co_return;
    }
-   //readUser(buffer);
-   try
+   string report = statsReport(commandNames, COMMAND_COUNT) + ".\n";
+   co_await transmit(current_socket, report.c_str(), report.size() + 1);
+}
+Task<> usageMessage(bool admin, int* current_socket)
+{
+   // one line per mailbox (see QuotaTable::report), then a single "." line
+   if (!admin)
    {
-      strcpy(buffer,receive(buffer, current_socket));
-      printf("Content received: %s\n", buffer); // ignore error
+      co_await answer(current_socket, "ERR");
+      co_return;
    }
-   catch (const invalid_argument& except)
+   string report = quotas.report() + ".\n";
+   co_await transmit(current_socket, report.c_str(), report.size() + 1);
+}
+void quotasReload()
+{
+   const char* filename = getenv("TWMAILER_QUOTA_FILE");
+   if (filename == NULL)
    {
-      cerr << except.what() << endl;
+      return;
    }
-   //readPassword(buffer);
-   if (send(*current_socket, "OK", 3, 0) == -1)
+   if (quotas.load(filename))
+   {
+      LOG_INFO("quotas reloaded from %s", filename);
+   }
+   else
+   {
+      LOG_ERROR("quotas in %s not reloaded, the old ones stay", filename);
+   }
+}
+void quotaScan()
+{
+   // reads the usage of every mailbox once, so USAGE knows them all; only
+   // mailboxes without counters are walked, and get them from then on
+   uint64_t started = monotonicNanos();
+   uint64_t mailboxes = 0;
+   spoolScanUsers(spoolDirectoryPath, [&mailboxes](const string& user, const string& mailbox)
+   {
+      quotas.record(user, spoolUsage(mailbox));
+      mailboxes++;
+   });
+   LOG_INFO("usage of %llu mailboxes read in %.3f ms", (unsigned long long)mailboxes, (monotonicNanos() - started) / 1e6);
+}
+void retentionAdded(const string& mailbox, const string& user, const SpoolUsage& usage)
+{
+   // the new message is the newest of the mailbox, so an entry that is
+   // already queued stays; it only matters for an empty or unqueued mailbox
+   RetentionPolicy policy = retention.policy(user);
+   uint64_t now = time(NULL);
+   if (policy.maxCount != 0 && usage.messages > policy.maxCount)
+   {
+      retentionQueue.schedule(mailbox, user, now);
+   }
+   else if (policy.maxAge != 0)
+   {
+      retentionQueue.schedule(mailbox, user, now + policy.maxAge);
+   }
+}
+void retentionReload()
+{
+   const char* filename = getenv("TWMAILER_RETENTION_FILE");
+   if (filename == NULL)
+   {
+      return;
+   }
+   if (retention.load(filename))
+   {
+      LOG_INFO("retention policies reloaded from %s", filename);
+      thread(retentionScan).detach(); // the due times follow the new ages
+   }
+   else
+   {
+      LOG_ERROR("retention policies in %s not reloaded, the old ones stay", filename);
+   }
+}
+void retentionScan()
+{
+   // queues every mailbox under a policy once, by the age of its first
+   // message; from then on SEND, IMPORT and the sweeper keep the queue
+   uint64_t started = monotonicNanos();
+   uint64_t now = time(NULL);
+   retentionQueue.clear();
+   spoolScanUsers(spoolDirectoryPath, [now](const string& user, const string& mailbox)
+   {
+      RetentionPolicy policy = retention.policy(user);
+      if (!retentionActive(policy))
+      {
+         return;
+      }
+      shared_ptr<const MailboxNames> names = indexGet(mailbox);
+      struct stat status;
+      if (policy.maxCount != 0 && names->names.size() > policy.maxCount)
+      {
+         retentionQueue.schedule(mailbox, user, now);
+      }
+      else if (policy.maxAge != 0 && !names->names.empty()
+               && stat((mailbox + "/" + names->names.front()).c_str(), &status) == 0)
+      {
+         retentionQueue.schedule(mailbox, user, status.st_mtime + policy.maxAge);
+      }
+   });
+   LOG_INFO("retention queue of %zu mailboxes built in %.3f ms", retentionQueue.size(),
+            (monotonicNanos() - started) / 1e6);
+}
+size_t retentionSweep(const RetentionQueue::Entry& entry, size_t budget)
+{
+   // removes up to budget messages from the front of the mailbox, then
+   // queues it again for the first message that stays
+   RetentionPolicy policy = retention.policy(entry.user);
+   if (!retentionActive(policy))
+   {
+      return 0;
+   }
+   const string& mailbox = entry.mailbox;
+   shared_ptr<const MailboxNames> names = indexGet(mailbox);
+   size_t excess = policy.maxCount != 0 && names->names.size() > policy.maxCount ? names->names.size() - policy.maxCount : 0;
+   uint64_t now = time(NULL);
+   uint64_t next = 0; // due time of the mailbox, 0 = not queued again
+   vector<pair<string, off_t>> expired;
+   for (const string& name : names->names)
+   {
+      struct stat status;
+      if (stat((mailbox + "/" + name).c_str(), &status) != 0)
+      {
+         continue; // deleted meanwhile
+      }
+      if (expired.size() >= excess && (policy.maxAge == 0 || (uint64_t)status.st_mtime + policy.maxAge > now))
+      {
+         next = policy.maxAge != 0 ? status.st_mtime + policy.maxAge : 0;
+         break;
+      }
+      if (expired.size() == budget)
+      {
+         next = now; // more to remove after the next batch elsewhere
+         break;
+      }
+      expired.emplace_back(name, status.st_size);
+   }
+   if (expired.empty())
    {
-      perror("send answer failed");
+      if (next != 0)
+      {
+         retentionQueue.schedule(mailbox, entry.user, next);
+      }
+      return 0;
    }
 
+   // like DEL every file goes together with its usage and a new version
+   SpoolUsage usage;
+   uint64_t removeStarted = monotonicNanos();
+   size_t removed = 0;
+   for (const auto& message : expired)
+   {
+      if (!spoolRemoveMessage(mailbox, message.first, message.second, &usage))
+      {
+         continue;
+      }
+      searchRemove(mailbox, message.first);
+      replicate(false, entry.user, message.first);
+      removed++;
+   }
+   serverStats.spoolIo.record(monotonicNanos() - removeStarted);
+   if (removed == 0)
+   {
+      LOG_WARN("retention of %s failed: %s", entry.user.c_str(), strerror(errno));
+      retentionQueue.schedule(mailbox, entry.user, now + RETENTION_RETRY);
+      return 0;
+   }
+   indexForget(mailbox);
+   quotas.record(entry.user, usage);
+   serverStats.expired.fetch_add(removed, memory_order_relaxed);
+   LOG_DEBUG("retention removed %zu messages of %s", removed, entry.user.c_str());
+   if (next != 0)
+   {
+      retentionQueue.schedule(mailbox, entry.user, next);
+   }
+   return expired.size();
+}
+void retentionSweeper(int rate)
+{
+   // takes the due mailboxes off the queue one batch at a time and sleeps
+   // after each, so removals never exceed rate per second
+   size_t batch = min((size_t)RETENTION_BATCH, (size_t)rate);
+   while (!abortRequested)
+   {
+      RetentionQueue::Entry entry;
+      // a standby gets the removals of its primary
+      if (standby.load(memory_order_relaxed) || !retentionQueue.pop(time(NULL), entry))
+      {
+         sleep(1);
+         continue;
+      }
+      size_t removed = retentionSweep(entry, batch);
+      this_thread::sleep_for(chrono::microseconds(removed * 1000000 / rate));
+   }
+}
+void replicate(bool store, const string& user, const string& name)
+{
+   if (replicating)
+   {
+      replicationLog.append(store, user, name);
+      serverStats.replicationPending.fetch_add(1, memory_order_relaxed);
+   }
+}
+void replicationShipper(string target)
+{
+   // one connection at a time; after a reconnect the records follow the
+   // last one acknowledged
+   bool reported = false;
+   while (!abortRequested)
+   {
+      int replica = netConnect(target);
+      if (replica == -1)
+      {
+         if (!reported)
+         {
+            LOG_WARN("standby %s not reachable: %s", target.c_str(), strerror(errno));
+            reported = true;
+         }
+         sleep(1);
+         continue;
+      }
+      reported = false;
+      LOG_INFO("replicating to %s", target.c_str());
+      atomic<bool> broken{false};
+      thread acks(replicationAcks, replica, &broken);
+      uint64_t sent = replicationLog.confirmed();
+      vector<ReplicationRecord> records;
+      while (!abortRequested && !broken.load())
+      {
+         records.clear();
+         if (!replicationLog.after(sent, records, 256, chrono::milliseconds(1000)))
+         {
+            LOG_ERROR("standby %s missed changes the log no longer holds, it needs a new copy of the spool",
+                      target.c_str());
+         }
+         for (const ReplicationRecord& record : records)
+         {
+            if (!replicationShip(replica, record))
+            {
+               broken = true;
+               break;
+            }
+            sent = record.sequence;
+         }
+      }
+      shutdown(replica, SHUT_RDWR);
+      acks.join();
+      close(replica);
+      if (!abortRequested)
+      {
+         LOG_WARN("standby %s disconnected", target.c_str());
+         sleep(1);
+      }
+   }
+}
+bool replicationShip(int replica, const ReplicationRecord& record)
+{
+   // the file is read only now, one deleted meanwhile goes as its deletion
+   string mailbox = spoolMailboxPath(spoolDirectoryPath, record.user);
+   int file = record.store ? open((mailbox + "/" + record.name).c_str(), O_RDONLY | O_CLOEXEC) : -1;
+   struct stat status;
+   bool stored = file != -1 && fstat(file, &status) == 0;
+   char header[1024];
+   if (stored)
+   {
+      snprintf(header, sizeof(header), "STORE %llu %llu %s %s %llu\n", (unsigned long long)record.sequence,
+               (unsigned long long)record.time, record.user.c_str(), record.name.c_str(),
+               (unsigned long long)status.st_size);
+   }
+   else
+   {
+      snprintf(header, sizeof(header), "DELETE %llu %llu %s %s\n", (unsigned long long)record.sequence,
+               (unsigned long long)record.time, record.user.c_str(), record.name.c_str());
+   }
+   bool shipped = replicationSend(replica, header, strlen(header));
+   off_t offset = 0;
+   while (shipped && stored && offset < status.st_size)
+   {
+      ssize_t size = netSendfile(replica, file, offset, status.st_size - offset);
+      shipped = size > 0;
+      offset += shipped ? size : 0;
+   }
+   if (file != -1)
+   {
+      close(file);
+   }
+   serverStats.replicated.fetch_add(1, memory_order_relaxed);
+   serverStats.replicatedBytes.fetch_add(strlen(header) + offset, memory_order_relaxed);
+   return shipped;
+}
+void replicationAcks(int replica, atomic<bool>* broken)
+{
+   string pending;
+   string line;
+   while (replicationLine(replica, pending, line))
+   {
+      unsigned long long sequence, time;
+      if (sscanf(line.c_str(), "ACK %llu %llu", &sequence, &time) != 2)
+      {
+         LOG_ERROR("invalid acknowledgement from the standby: %s", line.c_str());
+         break;
+      }
+      replicationLog.acknowledge(sequence);
+      uint64_t now = replicationClock();
+      serverStats.replicationLag.store(now > time ? now - time : 0, memory_order_relaxed);
+      serverStats.replicationPending.store(replicationLog.pending(), memory_order_relaxed);
+   }
+   *broken = true;
+}
+void replicationReceiver()
+{
+   // one primary at a time, until promoted
+   while (standby.load() && !abortRequested)
+   {
+      int primary = accept4(standbyListener, NULL, NULL, SOCK_CLOEXEC);
+      if (primary == -1)
+      {
+         if (errno != EINTR && standby.load())
+         {
+            LOG_WARN("replication accept: %s", strerror(errno));
+            sleep(1);
+         }
+         continue;
+      }
+      {
+         lock_guard<mutex> lock(standbyMutex);
+         standbyConnection = primary;
+      }
+      LOG_INFO("replicating from a primary");
+      string pending;
+      string line;
+      while (standby.load() && replicationLine(primary, pending, line) && replicationApply(line, primary, pending))
+      {
+      }
+      LOG_INFO("primary disconnected");
+      lock_guard<mutex> lock(standbyMutex);
+      standbyConnection = -1;
+      close(primary);
+   }
+   lock_guard<mutex> lock(standbyMutex);
+   close(standbyListener);
+   standbyListener = -1;
+}
+bool replicationApply(const string& line, int primary, string& pending)
+{
+   // one record, acknowledged once it is on disk; like SEND and DEL the
+   // file, the usage and the version change in one step under the lock of
+   // the version
+   char type[8];
+   char user[256];
+   char name[512];
+   unsigned long long sequence, time, length = 0;
+   int fields = sscanf(line.c_str(), "%7s %llu %llu %255s %511s %llu", type, &sequence, &time, user, name, &length);
+   bool store = fields == 6 && strcmp(type, "STORE") == 0;
+   if ((!store && (fields != 5 || strcmp(type, "DELETE") != 0)) || !replicationValid(user, name))
+   {
+      LOG_ERROR("invalid replication record: %s", line.c_str());
+      return false;
+   }
+   string body;
+   if (store && !replicationBytes(primary, pending, length, body))
+   {
+      return false;
+   }
+   string mailbox = spoolMailboxPath(spoolDirectoryPath, user);
+   string filepath = mailbox + "/" + name;
+   struct stat status;
+   bool present = stat(filepath.c_str(), &status) == 0; // applied before
+   SpoolUsage usage;
+   if (store && !present)
+   {
+      const char* slash = strchr(name, '/');
+      string directory = slash == NULL ? mailbox : mailbox + "/" + string(name, slash - name);
+      if (!spoolCreateDirectories(directory) || !spoolWriteFile(mailbox, name, body, &usage))
+      {
+         LOG_ERROR("failed to replicate %s: %s", filepath.c_str(), strerror(errno));
+         return false;
+      }
+      indexForget(mailbox);
+      quotas.record(user, usage);
+      searchAddFile(mailbox, name);
+      idleNotify(mailbox, spoolMessageId(name));
+   }
+   else if (!store && present)
+   {
+      if (!spoolRemoveMessage(mailbox, name, status.st_size, &usage))
+      {
+         LOG_ERROR("failed to replicate the removal of %s: %s", filepath.c_str(), strerror(errno));
+         return false;
+      }
+      searchRemove(mailbox, name);
+      indexForget(mailbox);
+      quotas.record(user, usage);
+   }
+   uint64_t now = replicationClock();
+   serverStats.replicated.fetch_add(1, memory_order_relaxed);
+   serverStats.replicatedBytes.fetch_add(line.size() + 1 + length, memory_order_relaxed);
+   serverStats.replicationLag.store(now > time ? now - time : 0, memory_order_relaxed);
+   char ack[64];
+   snprintf(ack, sizeof(ack), "ACK %llu %llu\n", sequence, time);
+   return replicationSend(primary, ack, strlen(ack));
+}
+void replicationPromote()
+{
+   // stops applying, the stream of the old primary is cut; from here on
+   // this server takes writes
+   if (!standby.exchange(false))
+   {
+      return;
+   }
+   lock_guard<mutex> lock(standbyMutex);
+   if (standbyListener != -1)
+   {
+      shutdown(standbyListener, SHUT_RDWR);
+   }
+   if (standbyConnection != -1)
+   {
+      shutdown(standbyConnection, SHUT_RDWR);
+   }
+   LOG_INFO("promoted to primary after %llu replicated changes",
+            (unsigned long long)serverStats.replicated.load(memory_order_relaxed));
+}
+void statsDump(string filename, int interval)
+{
+   while (!abortRequested)
+   {
+      sleep(interval);
+      string report = statsReport(commandNames, COMMAND_COUNT);
+      ofstream file(filename, ios::trunc);
+      if (!file.is_open())
+      {
+         LOG_WARN("failed to write stats file %s", filename.c_str());
+         continue;
+      }
+      file << report;
+   }
+}
+void indexWarmStart(unsigned threads)
+{
+   uint64_t started = monotonicNanos();
+   uint64_t intact = 0;
+   uint64_t listed = 0;
+   indexWarm(threads, intact, listed);
+   LOG_INFO("index snapshot checked on %u threads in %.3f ms: %llu mailboxes current, %llu listed again",
+            threads, (monotonicNanos() - started) / 1e6, (unsigned long long)intact, (unsigned long long)listed);
+}
+void indexWriter(int interval)
+{
+   while (!abortRequested)
+   {
+      sleep(interval);
+      if (indexSave(spoolDirectoryPath) < 0)
+      {
+         LOG_WARN("failed to write the index snapshot: %s", strerror(errno));
+      }
+   }
 }
 /*
 int Connect()
@@ -0,0 +1,865 @@
+#ifndef TWMAILER_SPOOL_H
+#define TWMAILER_SPOOL_H
+
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <string_view>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// SPOOL LAYOUT
+// Shared by the server and the tools. A mailbox is a directory, every
+// message one file in it:
+//    <receiver>\n<subject>\n<body lines>\n.\n
+// The "." line ends the message on READ, so a body line "." is stored as "..".
+// Mailboxes and messages are spread over directories, see SHARDED LAYOUT.
+
+#define SPOOL_SUBJECT_MAX 80
+
+struct SpoolMessage
+{
+   std::string receiver;
+   std::string subject;
+   std::vector<std::string> body;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// SHARDED LAYOUT
+// Mailboxes live at <spool>/.users/<xx>/<yy>/<user>, xx and yy taken from a
+// hash of the user, so no directory holds more than a few entries per 65536
+// users. Inside a mailbox the messages are grouped by id into buckets of
+// SPOOL_BUCKET_SIZE: <mailbox>/<id / SPOOL_BUCKET_SIZE, hex>/<name>. The id
+// already orders them, so a bucket fills up and is never touched again.
+// Names in a mailbox index are relative to the mailbox ("<bucket>/<name>").
+// A mailbox of the old flat layout, <spool>/<user> with the files directly
+// in it, is still found and served until twmailer-migrate moved it.
+
+#define SPOOL_USER_ROOT ".users"
+#define SPOOL_BUCKET_BITS 12
+#define SPOOL_BUCKET_SIZE (1 << SPOOL_BUCKET_BITS)
+#define SPOOL_USER_MAX 64 // bytes of a user name
+
+// "<xx>/<yy>" from FNV-1a of the user
+inline std::string spoolShard(std::string_view user)
+{
+   uint32_t hash = 2166136261u;
+   for (char c : user)
+   {
+      hash = (hash ^ (unsigned char)c) * 16777619u;
+   }
+   char shard[8];
+   snprintf(shard, sizeof(shard), "%02x/%02x", (unsigned)(hash >> 24), (unsigned)((hash >> 16) & 0xff));
+   return shard;
+}
+
+inline std::string spoolShardedPath(const std::string &spool, const std::string &user)
+{
+   return spool + "/" SPOOL_USER_ROOT "/" + spoolShard(user) + "/" + user;
+}
+
+// a name that stays one directory inside the spool: not empty, no '/',
+// no leading '.' (which also rules out "." and "..") and not too long for
+// the message file names built from it
+inline bool spoolValidUser(std::string_view user)
+{
+   return !user.empty() && user.size() <= SPOOL_USER_MAX && user[0] != '.' && user.find('/') == std::string_view::npos;
+}
+
+// where the mailbox of user is, the flat path while it was not migrated
+inline std::string spoolMailboxPath(const std::string &spool, const std::string &user)
+{
+   std::string sharded = spoolShardedPath(spool, user);
+   struct stat status;
+   if (stat(sharded.c_str(), &status) != 0)
+   {
+      std::string flat = spool + "/" + user;
+      if (!user.empty() && user[0] != '.' && stat(flat.c_str(), &status) == 0 && S_ISDIR(status.st_mode))
+      {
+         return flat;
+      }
+   }
+   return sharded;
+}
+
+// like mkdir -p, true when the directory exists afterwards
+inline bool spoolCreateDirectories(const std::string &directory)
+{
+   if (mkdir(directory.c_str(), 0755) == 0 || errno == EEXIST)
+   {
+      return true;
+   }
+   size_t slash = directory.rfind('/');
+   if (errno != ENOENT || slash == std::string::npos || slash == 0)
+   {
+      return false;
+   }
+   return spoolCreateDirectories(directory.substr(0, slash)) && (mkdir(directory.c_str(), 0755) == 0 || errno == EEXIST);
+}
+
+inline std::string spoolBucket(uint64_t id)
+{
+   char bucket[24];
+   snprintf(bucket, sizeof(bucket), "%04llx", (unsigned long long)(id >> SPOOL_BUCKET_BITS));
+   return bucket;
+}
+
+// calls found(name) for every message of mailbox: flat files and those in
+// buckets, as names relative to the mailbox. Dot files are skipped.
+template <class Found>
+inline void spoolScanMailbox(const std::string &mailbox, Found found)
+{
+   DIR *directory = opendir(mailbox.c_str());
+   if (directory == NULL)
+   {
+      return;
+   }
+   std::string relative;
+   while (struct dirent *entry = readdir(directory))
+   {
+      if (entry->d_name[0] == '.')
+      {
+         continue;
+      }
+      bool isDirectory = entry->d_type == DT_DIR;
+      if (entry->d_type == DT_UNKNOWN)
+      {
+         struct stat status;
+         isDirectory = stat((mailbox + "/" + entry->d_name).c_str(), &status) == 0 && S_ISDIR(status.st_mode);
+      }
+      if (!isDirectory)
+      {
+         found(entry->d_name);
+         continue;
+      }
+      DIR *bucket = opendir((mailbox + "/" + entry->d_name).c_str());
+      if (bucket == NULL)
+      {
+         continue;
+      }
+      while (struct dirent *message = readdir(bucket))
+      {
+         if (message->d_name[0] != '.')
+         {
+            relative.assign(entry->d_name);
+            relative += '/';
+            relative += message->d_name;
+            found(relative.c_str());
+         }
+      }
+      closedir(bucket);
+   }
+   closedir(directory);
+}
+
+// calls found(user, mailbox path) for every mailbox, sharded and flat ones
+template <class Found>
+inline void spoolScanUsers(const std::string &spool, Found found)
+{
+   auto directories = [](const std::string &path, auto each)
+   {
+      DIR *directory = opendir(path.c_str());
+      if (directory == NULL)
+      {
+         return;
+      }
+      while (struct dirent *entry = readdir(directory))
+      {
+         struct stat status;
+         std::string child = path + "/" + entry->d_name;
+         if (entry->d_name[0] != '.' && (entry->d_type == DT_DIR || (entry->d_type == DT_UNKNOWN
+             && stat(child.c_str(), &status) == 0 && S_ISDIR(status.st_mode))))
+         {
+            each(std::string(entry->d_name), child);
+         }
+      }
+      closedir(directory);
+   };
+   directories(spool + "/" SPOOL_USER_ROOT, [&](const std::string &, const std::string &first)
+   {
+      directories(first, [&](const std::string &, const std::string &second)
+      {
+         directories(second, found);
+      });
+   });
+   directories(spool, found); // flat layout, not migrated yet
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MAILBOX VERSION
+// <mailbox>/.version holds a counter that every SEND, IMPORT and DEL
+// advances under flock(), so server threads and twmailer-import share it.
+// A new message is named after the version that added it, which makes the
+// number its stable, increasing id: "<user>-<id, 20 digits>.txt". The id is
+// taken and the file renamed into place under one lock, so messages appear
+// in id order and a reader that sees a version also sees its messages.
+// Files of older layouts have id 0 and sort before all others.
+// Behind the version the file keeps the usage of the mailbox, "<version>
+// <messages> <bytes>", changed under the same lock. A file without the
+// counters gets them from one walk over the mailbox the first time they are
+// needed.
+
+#define SPOOL_VERSION_FILE ".version"
+#define SPOOL_ID_DIGITS 20
+
+struct SpoolUsage
+{
+   uint64_t messages = 0;
+   uint64_t bytes = 0;
+};
+
+// by stat() of every message, only where the counters are missing
+inline SpoolUsage spoolUsageWalk(const std::string &mailbox)
+{
+   SpoolUsage usage;
+   spoolScanMailbox(mailbox, [&mailbox, &usage](const char *name)
+   {
+      struct stat status;
+      if (stat((mailbox + "/" + name).c_str(), &status) == 0)
+      {
+         usage.messages++;
+         usage.bytes += status.st_size;
+      }
+   });
+   return usage;
+}
+
+// reads version and usage of mailbox and changes them: advance moves the
+// version on by that many ids, messages/bytes are added to the usage unless
+// that would go over limit (0 = unlimited). place(new version) runs under
+// the lock before anything is written, when it fails nothing changes.
+// False on failure, or with errno EDQUOT when refused.
+template <class Place>
+inline bool spoolMetaLocked(const std::string &mailbox, uint64_t advance, int64_t messages, int64_t bytes,
+                            const SpoolUsage *limit, uint64_t *version, SpoolUsage *usage, bool count,
+                            uint64_t minimum, Place place)
+{
+   bool charge = messages != 0 || bytes != 0;
+   bool exclusive = advance != 0 || charge || count;
+   std::string filepath = mailbox + "/" SPOOL_VERSION_FILE;
+   int file = open(filepath.c_str(), (exclusive ? O_RDWR | O_CREAT : O_RDONLY) | O_CLOEXEC, 0644);
+   if (file == -1)
+   {
+      return false;
+   }
+   bool done = false;
+   bool refused = false;
+   int error = 0;
+   if (flock(file, exclusive ? LOCK_EX : LOCK_SH) == 0)
+   {
+      char text[96] = {};
+      unsigned long long values[3] = {0, 0, 0};
+      int fields = 0;
+      if (pread(file, text, sizeof(text) - 1, 0) > 0)
+      {
+         fields = sscanf(text, "%llu %llu %llu", &values[0], &values[1], &values[2]);
+      }
+      bool counted = fields == 3;
+      if (!counted && usage != nullptr && !exclusive)
+      {
+         close(file);
+         return spoolMetaLocked(mailbox, 0, 0, 0, limit, version, usage, true, 0, place); // the count is written
+      }
+      SpoolUsage current{values[1], values[2]};
+      bool recount = !counted && (charge || usage != nullptr);
+      if (recount)
+      {
+         current = spoolUsageWalk(mailbox);
+         counted = true;
+      }
+      refused = limit != nullptr && messages > 0
+                     && ((limit->messages != 0 && current.messages + messages > limit->messages)
+                         || (limit->bytes != 0 && current.bytes + bytes > limit->bytes));
+      bool placed = false;
+      if (!refused)
+      {
+         SpoolUsage changed = current;
+         changed.messages = messages < 0 && current.messages < (uint64_t)-messages ? 0 : current.messages + messages;
+         changed.bytes = bytes < 0 && current.bytes < (uint64_t)-bytes ? 0 : current.bytes + bytes;
+         uint64_t next = values[0] + advance < minimum ? minimum : values[0] + advance;
+         placed = place(next);
+         error = placed ? 0 : errno;
+         if (placed)
+         {
+            current = changed;
+            values[0] = next;
+         }
+      }
+      done = placed;
+      if ((exclusive && placed) || recount)
+      {
+         int length = counted ? snprintf(text, sizeof(text), "%llu %llu %llu\n", values[0],
+                                         (unsigned long long)current.messages, (unsigned long long)current.bytes)
+                              : snprintf(text, sizeof(text), "%llu\n", values[0]);
+         if (pwrite(file, text, length, 0) != length || ftruncate(file, length) != 0)
+         {
+            done = false;
+         }
+      }
+      if (version != nullptr)
+      {
+         *version = values[0];
+      }
+      if (usage != nullptr)
+      {
+         *usage = current;
+      }
+   }
+   else
+   {
+      error = errno;
+   }
+   close(file); // releases the lock
+   errno = refused ? EDQUOT : error;
+   return done;
+}
+
+inline bool spoolMetaUpdate(const std::string &mailbox, uint64_t advance, int64_t messages, int64_t bytes,
+                            const SpoolUsage *limit, uint64_t *version, SpoolUsage *usage, uint64_t minimum = 0)
+{
+   return spoolMetaLocked(mailbox, advance, messages, bytes, limit, version, usage, false, minimum,
+                          [](uint64_t) { return true; });
+}
+
+inline uint64_t spoolVersion(const std::string &mailbox)
+{
+   uint64_t version = 0;
+   spoolMetaUpdate(mailbox, 0, 0, 0, nullptr, &version, nullptr);
+   return version;
+}
+
+// the version moves on by one, and up to minimum at least: a replicated
+// message keeps its id, later ones must not reuse it
+inline uint64_t spoolAdvance(const std::string &mailbox, uint64_t minimum = 0)
+{
+   uint64_t version = 0;
+   return spoolMetaUpdate(mailbox, 1, 0, 0, nullptr, &version, nullptr, minimum) ? version : 0;
+}
+
+inline SpoolUsage spoolUsage(const std::string &mailbox)
+{
+   SpoolUsage usage;
+   spoolMetaUpdate(mailbox, 0, 0, 0, nullptr, nullptr, &usage);
+   return usage;
+}
+
+// messages/bytes added to the usage, or taken off when negative; false when
+// that would exceed limit. usage receives the counters afterwards.
+inline bool spoolCharge(const std::string &mailbox, int64_t messages, int64_t bytes, const SpoolUsage *limit = nullptr,
+                        SpoolUsage *usage = nullptr)
+{
+   return spoolMetaUpdate(mailbox, 0, messages, bytes, limit, nullptr, usage);
+}
+
+// removes the message name of bytes from mailbox under the lock of the
+// mailbox version, which moves on, and takes it off the usage in the same
+// step, the way spoolPlaceMessage() adds one; false when it could not be
+// removed, nothing changes then
+inline bool spoolRemoveMessage(const std::string &mailbox, const std::string &name, uint64_t bytes,
+                               SpoolUsage *usage = nullptr)
+{
+   return spoolMetaLocked(mailbox, 1, -1, -(int64_t)bytes, nullptr, nullptr, usage, false, 0,
+                          [&](uint64_t) { return unlink((mailbox + "/" + name).c_str()) == 0; });
+}
+
+// the name of message id in mailbox; the bucket directory is created when
+// needed
+inline std::string spoolMessageName(const std::string &mailbox, const std::string &user, uint64_t id)
+{
+   char digits[SPOOL_ID_DIGITS + 1];
+   snprintf(digits, sizeof(digits), "%0*llu", SPOOL_ID_DIGITS, (unsigned long long)id);
+   std::string bucket = spoolBucket(id);
+   if (mkdir((mailbox + "/" + bucket).c_str(), 0755) != 0 && errno != EEXIST)
+   {
+      return user + "-" + digits + ".txt"; // flat still works
+   }
+   return bucket + "/" + user + "-" + digits + ".txt";
+}
+
+// takes the next id of mailbox and calls place(name) to put the message of
+// bytes there under that name, all under the lock of the mailbox version;
+// the usage is charged in the same step. name receives the name relative
+// to mailbox, limit and usage as in spoolCharge().
+template <class Place>
+inline bool spoolPlaceMessage(const std::string &mailbox, const std::string &user, uint64_t bytes, Place place,
+                              std::string &name, const SpoolUsage *limit = nullptr, SpoolUsage *usage = nullptr)
+{
+   return spoolMetaLocked(mailbox, 1, 1, bytes, limit, nullptr, usage, false, 0, [&](uint64_t id)
+   {
+      name = spoolMessageName(mailbox, user, id);
+      return place(mailbox + "/" + name);
+   });
+}
+
+inline uint64_t spoolMessageId(std::string_view name)
+{
+   const size_t suffix = SPOOL_ID_DIGITS + 4; // digits + ".txt"
+   if (name.size() <= suffix || name[name.size() - suffix - 1] != '-' || name.substr(name.size() - 4) != ".txt")
+   {
+      return 0;
+   }
+   uint64_t id = 0;
+   for (char c : name.substr(name.size() - suffix, SPOOL_ID_DIGITS))
+   {
+      if (c < '0' || c > '9')
+      {
+         return 0;
+      }
+      id = id * 10 + (uint64_t)(c - '0');
+   }
+   return id;
+}
+
+// oldest first, so message numbers stay stable while a mailbox only grows
+template <class Names>
+inline void spoolSortMessages(Names &names)
+{
+   std::sort(names.begin(), names.end(), [](const auto &a, const auto &b)
+   {
+      uint64_t left = spoolMessageId(std::string_view(a.data(), a.size()));
+      uint64_t right = spoolMessageId(std::string_view(b.data(), b.size()));
+      return left != right ? left < right : a < b;
+   });
+}
+
+// "<dir>/.<name>.tmp", dot files are not part of a mailbox
+inline std::string spoolTemporaryPath(std::string_view filepath)
+{
+   size_t slash = filepath.rfind('/') + 1; // npos + 1 == 0
+   std::string temporary(filepath.substr(0, slash));
+   temporary += '.';
+   temporary += filepath.substr(slash);
+   temporary += ".tmp";
+   return temporary;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SPOOL WRITER
+// Streams one message into "<mailbox>/.incoming-<pid>-<n>.tmp" through a
+// fixed buffer and renames it into place on commit(), so memory use does not
+// depend on the message size and a message never appears half written.
+// commit() takes the id of the message, charges it to the usage of its
+// mailbox and renames it under one lock (see spoolPlaceMessage()), a quota
+// can still refuse it there. A writer that is destroyed without commit()
+// removes its temporary file.
+
+#define SPOOL_WRITE_BUFFER 65536
+
+inline std::atomic<uint64_t> spoolIncoming{0};
+
+class SpoolWriter
+{
+ public:
+   SpoolWriter() = default;
+   SpoolWriter(const SpoolWriter &) = delete;
+   SpoolWriter &operator=(const SpoolWriter &) = delete;
+
+   ~SpoolWriter()
+   {
+      abort();
+   }
+
+   bool open(const std::string &mailbox)
+   {
+      abort();
+      temporary = mailbox + "/.incoming-" + std::to_string((long)getpid()) + "-"
+                  + std::to_string(spoolIncoming.fetch_add(1, std::memory_order_relaxed)) + ".tmp";
+      file = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+      failed = file == -1;
+      if (failed)
+      {
+         temporary.clear(); // not ours to remove
+      }
+      used = 0;
+      total = 0;
+      return !failed;
+   }
+
+   // receiver and subject, then every body line
+   void header(std::string_view receiver, std::string_view subject)
+   {
+      append(receiver);
+      append("\n");
+      append(subject.substr(0, SPOOL_SUBJECT_MAX));
+      append("\n");
+   }
+
+   void line(std::string_view text)
+   {
+      append(text == "." ? std::string_view("..") : text);
+      append("\n");
+   }
+
+   // ends the message and closes its file, which stays at temporary path
+   bool finish()
+   {
+      append(".\n");
+      flush();
+      if (file == -1)
+      {
+         return false;
+      }
+      bool closed = close(file) == 0;
+      file = -1;
+      return !failed && closed;
+   }
+
+   // name receives the name of the message relative to mailbox; false with
+   // errno EDQUOT when the message would exceed limit. usage receives the
+   // counters of mailbox afterwards.
+   bool commit(const std::string &mailbox, const std::string &user, std::string &name,
+               const SpoolUsage *limit = nullptr, SpoolUsage *usage = nullptr)
+   {
+      bool placed = finish() && spoolPlaceMessage(mailbox, user, total, [this](const std::string &target)
+      {
+         return rename(temporary.c_str(), target.c_str()) == 0;
+      }, name, limit, usage);
+      if (placed)
+      {
+         temporary.clear();
+      }
+      int error = errno;
+      abort();
+      errno = error;
+      return placed;
+   }
+
+   // the finished file is handed over, the writer no longer removes it
+   std::string release()
+   {
+      std::string path;
+      path.swap(temporary);
+      return path;
+   }
+
+   uint64_t size() const
+   {
+      return total;
+   }
+
+   void abort()
+   {
+      if (file != -1)
+      {
+         close(file);
+         file = -1;
+      }
+      if (!temporary.empty())
+      {
+         unlink(temporary.c_str());
+         temporary.clear();
+      }
+   }
+
+ private:
+   std::string temporary;
+   int file = -1;
+   bool failed = false;
+   size_t used = 0;
+   uint64_t total = 0; // bytes of the message
+   char buffer[SPOOL_WRITE_BUFFER];
+
+   void append(std::string_view text)
+   {
+      while (!text.empty())
+      {
+         size_t part = std::min(text.size(), sizeof(buffer) - used);
+         memcpy(buffer + used, text.data(), part);
+         used += part;
+         total += part;
+         text.remove_prefix(part);
+         if (used == sizeof(buffer))
+         {
+            flush();
+         }
+      }
+   }
+
+   void flush()
+   {
+      size_t written = 0;
+      while (file != -1 && !failed && written < used)
+      {
+         ssize_t size = write(file, buffer + written, used - written);
+         if (size == -1)
+         {
+            failed = true;
+            break;
+         }
+         written += size;
+      }
+      used = 0;
+   }
+};
+
+// small messages end up as a single write(); name, limit and usage as in
+// SpoolWriter::commit()
+inline bool spoolWriteMessage(const std::string &mailbox, const std::string &user, const SpoolMessage &message,
+                              std::string &name, const SpoolUsage *limit = nullptr, SpoolUsage *usage = nullptr)
+{
+   SpoolWriter writer;
+   if (!writer.open(mailbox))
+   {
+      return false;
+   }
+   writer.header(message.receiver, message.subject);
+   for (const std::string &line : message.body)
+   {
+      writer.line(line);
+   }
+   return writer.commit(mailbox, user, name, limit, usage);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SPOOL BATCH
+// Messages written aside like by SpoolWriter and placed together: one lock
+// of the mailbox version takes the ids of all of them, renames them in the
+// order they were added and charges their usage, for bulk imports. A batch
+// that is destroyed uncommitted removes its files.
+
+class SpoolBatch
+{
+ public:
+   SpoolBatch() = default;
+   SpoolBatch(const SpoolBatch &) = delete;
+   SpoolBatch &operator=(const SpoolBatch &) = delete;
+
+   ~SpoolBatch()
+   {
+      abort();
+   }
+
+   bool add(const std::string &mailbox, const SpoolMessage &message)
+   {
+      SpoolWriter writer;
+      if (!writer.open(mailbox))
+      {
+         return false;
+      }
+      writer.header(message.receiver, message.subject);
+      for (const std::string &line : message.body)
+      {
+         writer.line(line);
+      }
+      if (!writer.finish())
+      {
+         return false;
+      }
+      bytes += writer.size();
+      temporaries.push_back(writer.release());
+      return true;
+   }
+
+   size_t size() const
+   {
+      return temporaries.size();
+   }
+
+   // all messages or none are placed, the batch is empty afterwards
+   bool commit(const std::string &mailbox, const std::string &user)
+   {
+      size_t count = temporaries.size();
+      std::vector<std::string> placed;
+      bool done = count == 0 || spoolMetaLocked(mailbox, count, count, bytes, nullptr, nullptr, nullptr, false, 0,
+                                                [&](uint64_t last)
+      {
+         for (size_t i = 0; i < count; i++)
+         {
+            std::string target = mailbox + "/" + spoolMessageName(mailbox, user, last - count + 1 + i);
+            if (rename(temporaries[i].c_str(), target.c_str()) != 0)
+            {
+               int error = errno;
+               while (i-- > 0)
+               {
+                  rename(placed[i].c_str(), temporaries[i].c_str());
+               }
+               errno = error;
+               return false;
+            }
+            placed.push_back(target);
+         }
+         return true;
+      });
+      if (done)
+      {
+         temporaries.clear();
+      }
+      int error = errno;
+      abort();
+      errno = error;
+      return done;
+   }
+
+   void abort()
+   {
+      for (const std::string &temporary : temporaries)
+      {
+         unlink(temporary.c_str());
+      }
+      temporaries.clear();
+      bytes = 0;
+   }
+
+ private:
+   std::vector<std::string> temporaries;
+   uint64_t bytes = 0;
+};
+
+// a complete message file as it is, the way commit() stores it; for
+// messages that arrive from another spool. It appears under the lock of
+// the mailbox version, which moves on to the id of name at least, so ids
+// stay unique after a promotion.
+inline bool spoolWriteFile(const std::string &mailbox, const std::string &name, std::string_view bytes,
+                           SpoolUsage *usage = nullptr)
+{
+   std::string target = mailbox + "/" + name;
+   std::string temporary = spoolTemporaryPath(target);
+   int file = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+   if (file == -1)
+   {
+      return false;
+   }
+   size_t written = 0;
+   while (written < bytes.size())
+   {
+      ssize_t size = write(file, bytes.data() + written, bytes.size() - written);
+      if (size <= 0)
+      {
+         break;
+      }
+      written += size;
+   }
+   bool closed = close(file) == 0;
+   if (written != bytes.size() || !closed
+       || !spoolMetaLocked(mailbox, 1, 1, bytes.size(), nullptr, nullptr, usage, false, spoolMessageId(name),
+                           [&](uint64_t) { return rename(temporary.c_str(), target.c_str()) == 0; }))
+   {
+      int error = errno;
+      unlink(temporary.c_str());
+      errno = error;
+      return false;
+   }
+   return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// MAIL PARSING
+// RFC 5322 messages fed line by line (without terminator). Only To and
+// Subject are kept from the header, folded header lines are unfolded.
+
+struct MailParser
+{
+   SpoolMessage message;
+   std::string header; // current, possibly folded header field
+   bool inBody = false;
+   bool started = false;
+
+   void headerDone()
+   {
+      if (header.size() > 3 && strncasecmp(header.c_str(), "to:", 3) == 0)
+      {
+         message.receiver = trim(std::string_view(header).substr(3));
+      }
+      else if (header.size() > 8 && strncasecmp(header.c_str(), "subject:", 8) == 0)
+      {
+         message.subject = trim(std::string_view(header).substr(8));
+      }
+      header.clear();
+   }
+
+   static std::string trim(std::string_view text)
+   {
+      while (!text.empty() && (text.front() == ' ' || text.front() == '\t'))
+      {
+         text.remove_prefix(1);
+      }
+      while (!text.empty() && (text.back() == ' ' || text.back() == '\t' || text.back() == '\r'))
+      {
+         text.remove_suffix(1);
+      }
+      return std::string(text);
+   }
+
+   void line(std::string_view text)
+   {
+      if (!text.empty() && text.back() == '\r')
+      {
+         text.remove_suffix(1);
+      }
+      started = true;
+      if (inBody)
+      {
+         message.body.emplace_back(text);
+      }
+      else if (text.empty())
+      {
+         headerDone();
+         inBody = true;
+      }
+      else if ((text.front() == ' ' || text.front() == '\t') && !header.empty())
+      {
+         header += ' ';
+         header += trim(text);
+      }
+      else
+      {
+         headerDone();
+         header.assign(text);
+      }
+   }
+
+   // returns the parsed message and starts over, receiver falls back to owner
+   SpoolMessage finish(const std::string &owner)
+   {
+      headerDone();
+      SpoolMessage done = std::move(message);
+      if (done.receiver.empty())
+      {
+         done.receiver = owner;
+      }
+      // mbox separates messages with an empty line that is not part of the body
+      if (!done.body.empty() && done.body.back().empty())
+      {
+         done.body.pop_back();
+      }
+      message = SpoolMessage();
+      inBody = false;
+      started = false;
+      return done;
+   }
+};
+
+// one mbox line: a "From " line starts the next message, ">From " quoting
+// (mboxrd) is undone. Returns true when the previous message is complete.
+inline bool mboxLine(MailParser &parser, std::string_view text)
+{
+   if (text.substr(0, 5) == "From ")
+   {
+      return parser.started;
+   }
+   size_t quotes = 0;
+   while (quotes < text.size() && text[quotes] == '>')
+   {
+      quotes++;
+   }
+   if (quotes > 0 && text.substr(quotes, 5) == "From ")
+   {
+      text.remove_prefix(1);
+   }
+   parser.line(text);
+   return false;
+}
+
+#endif
@@ -0,0 +1,202 @@
+#ifndef TWMAILER_STATS_H
+#define TWMAILER_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <atomic>
+#include <string>
+
+///////////////////////////////////////////////////////////////////////////////
+// SERVER STATISTICS
+// All counters are plain atomics updated with relaxed ordering, so recording
+// never takes a lock. A snapshot read while requests are running is not
+// perfectly consistent between counters, which is fine for monitoring.
+
+#define STATS_MAX_COMMANDS 16
+
+// log-linear buckets: every power of two is split into 2^STATS_SUB_BITS
+// sub-buckets, which keeps the relative error of a percentile below 12.5%
+#define STATS_SUB_BITS 3
+#define STATS_SUB_COUNT (1 << STATS_SUB_BITS)
+#define STATS_MAX_BITS 40 // 2^40 ns ~ 18 minutes, larger values are clamped
+#define STATS_BUCKETS ((STATS_MAX_BITS - STATS_SUB_BITS + 1) * STATS_SUB_COUNT)
+
+///////////////////////////////////////////////////////////////////////////////
+
+inline uint64_t monotonicNanos()
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+struct LatencyHistogram
+{
+   std::atomic<uint64_t> buckets[STATS_BUCKETS] = {};
+   std::atomic<uint64_t> count{0};
+   std::atomic<uint64_t> total{0};
+   std::atomic<uint64_t> max{0};
+
+   static int bucketOf(uint64_t value)
+   {
+      if (value < STATS_SUB_COUNT)
+      {
+         return (int)value;
+      }
+      int msb = 63 - __builtin_clzll(value);
+      if (msb >= STATS_MAX_BITS)
+      {
+         return STATS_BUCKETS - 1;
+      }
+      int sub = (int)(value >> (msb - STATS_SUB_BITS)) & (STATS_SUB_COUNT - 1);
+      return (msb - STATS_SUB_BITS + 1) * STATS_SUB_COUNT + sub;
+   }
+
+   // highest value that still falls into the given bucket
+   static uint64_t upperBoundOf(int bucket)
+   {
+      if (bucket < STATS_SUB_COUNT)
+      {
+         return (uint64_t)bucket;
+      }
+      int msb = bucket / STATS_SUB_COUNT + STATS_SUB_BITS - 1;
+      uint64_t sub = (uint64_t)(bucket % STATS_SUB_COUNT) | STATS_SUB_COUNT;
+      return ((sub + 1) << (msb - STATS_SUB_BITS)) - 1;
+   }
+
+   void record(uint64_t nanos)
+   {
+      buckets[bucketOf(nanos)].fetch_add(1, std::memory_order_relaxed);
+      count.fetch_add(1, std::memory_order_relaxed);
+      total.fetch_add(nanos, std::memory_order_relaxed);
+      uint64_t seen = max.load(std::memory_order_relaxed);
+      while (nanos > seen && !max.compare_exchange_weak(seen, nanos, std::memory_order_relaxed))
+      {
+      }
+   }
+
+   // percentile in the range 0..100, result in nanoseconds
+   uint64_t percentile(double p) const
+   {
+      uint64_t samples = count.load(std::memory_order_relaxed);
+      if (samples == 0)
+      {
+         return 0;
+      }
+      uint64_t rank = (uint64_t)(p / 100.0 * (double)samples + 0.5);
+      if (rank == 0)
+      {
+         rank = 1;
+      }
+      uint64_t seen = 0;
+      for (int i = 0; i < STATS_BUCKETS; i++)
+      {
+         seen += buckets[i].load(std::memory_order_relaxed);
+         if (seen >= rank)
+         {
+            uint64_t bound = upperBoundOf(i);
+            uint64_t highest = max.load(std::memory_order_relaxed);
+            return bound < highest ? bound : highest;
+         }
+      }
+      return max.load(std::memory_order_relaxed);
+   }
+};
+
+struct CommandStats
+{
+   std::atomic<uint64_t> calls{0};
+   std::atomic<uint64_t> errors{0};
+   LatencyHistogram latency;
+};
+
+struct ServerStats
+{
+   CommandStats commands[STATS_MAX_COMMANDS];
+   std::atomic<uint64_t> bytesIn{0};
+   std::atomic<uint64_t> bytesOut{0};
+   std::atomic<int64_t> activeSessions{0};
+   std::atomic<uint64_t> totalSessions{0};
+   std::atomic<uint64_t> timeouts[3] = {}; // idle, read, write
+   std::atomic<uint64_t> busy{0};            // sessions and commands shed
+   std::atomic<uint64_t> limited{0};         // commands over their rate
+   std::atomic<uint64_t> quota{0};           // SEND/IMPORT over a mailbox quota
+   std::atomic<uint64_t> expired{0};         // messages removed by retention
+   std::atomic<uint64_t> replicated{0};      // records shipped, on a standby applied
+   std::atomic<uint64_t> replicatedBytes{0};
+   std::atomic<uint64_t> replicationPending{0}; // records the standby did not acknowledge
+   std::atomic<uint64_t> replicationLag{0};  // ns from a change to its acknowledgement
+   LatencyHistogram spoolIo;
+};
+
+inline ServerStats serverStats;
+
+///////////////////////////////////////////////////////////////////////////////
+
+inline void statsAppendHistogram(std::string &out, const char *name, const LatencyHistogram &histogram)
+{
+   char line[256];
+   uint64_t samples = histogram.count.load(std::memory_order_relaxed);
+   uint64_t mean = samples ? histogram.total.load(std::memory_order_relaxed) / samples : 0;
+   snprintf(line, sizeof(line),
+            "%-8s n=%llu mean=%lluus p50=%lluus p90=%lluus p99=%lluus p999=%lluus max=%lluus\n",
+            name,
+            (unsigned long long)samples,
+            (unsigned long long)(mean / 1000),
+            (unsigned long long)(histogram.percentile(50) / 1000),
+            (unsigned long long)(histogram.percentile(90) / 1000),
+            (unsigned long long)(histogram.percentile(99) / 1000),
+            (unsigned long long)(histogram.percentile(99.9) / 1000),
+            (unsigned long long)(histogram.max.load(std::memory_order_relaxed) / 1000));
+   out += line;
+}
+
+// plain text report, one line per entry
+inline std::string statsReport(const char *const names[], int count)
+{
+   std::string out;
+   char line[256];
+   snprintf(line, sizeof(line), "sessions active=%lld total=%llu\n",
+            (long long)serverStats.activeSessions.load(std::memory_order_relaxed),
+            (unsigned long long)serverStats.totalSessions.load(std::memory_order_relaxed));
+   out += line;
+   snprintf(line, sizeof(line), "bytes in=%llu out=%llu\n",
+            (unsigned long long)serverStats.bytesIn.load(std::memory_order_relaxed),
+            (unsigned long long)serverStats.bytesOut.load(std::memory_order_relaxed));
+   out += line;
+   snprintf(line, sizeof(line), "timeouts idle=%llu read=%llu write=%llu\n",
+            (unsigned long long)serverStats.timeouts[0].load(std::memory_order_relaxed),
+            (unsigned long long)serverStats.timeouts[1].load(std::memory_order_relaxed),
+            (unsigned long long)serverStats.timeouts[2].load(std::memory_order_relaxed));
+   out += line;
+   snprintf(line, sizeof(line), "refused busy=%llu limit=%llu quota=%llu\n",
+            (unsigned long long)serverStats.busy.load(std::memory_order_relaxed),
+            (unsigned long long)serverStats.limited.load(std::memory_order_relaxed),
+            (unsigned long long)serverStats.quota.load(std::memory_order_relaxed));
+   out += line;
+   snprintf(line, sizeof(line), "retention expired=%llu\n",
+            (unsigned long long)serverStats.expired.load(std::memory_order_relaxed));
+   out += line;
+   snprintf(line, sizeof(line), "replication records=%llu bytes=%llu pending=%llu lag=%lluus\n",
+            (unsigned long long)serverStats.replicated.load(std::memory_order_relaxed),
+            (unsigned long long)serverStats.replicatedBytes.load(std::memory_order_relaxed),
+            (unsigned long long)serverStats.replicationPending.load(std::memory_order_relaxed),
+            (unsigned long long)(serverStats.replicationLag.load(std::memory_order_relaxed) / 1000));
+   out += line;
+   for (int i = 0; i < count && i < STATS_MAX_COMMANDS; i++)
+   {
+      const CommandStats &command = serverStats.commands[i];
+      snprintf(line, sizeof(line), "command %s calls=%llu errors=%llu\n", names[i],
+               (unsigned long long)command.calls.load(std::memory_order_relaxed),
+               (unsigned long long)command.errors.load(std::memory_order_relaxed));
+      out += line;
+      statsAppendHistogram(out, names[i], command.latency);
+   }
+   statsAppendHistogram(out, "spool-io", serverStats.spoolIo);
+   return out;
+}
+
+#endif
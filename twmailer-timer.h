@@ -0,0 +1,144 @@
+#ifndef TWMAILER_TIMER_H
+#define TWMAILER_TIMER_H
+
+#include <stdint.h>
+#include <mutex>
+
+///////////////////////////////////////////////////////////////////////////////
+// TIMER WHEEL
+// Hierarchical timing wheel after Varghese & Lauck: TIMER_LEVELS wheels of
+// TIMER_SLOTS slots, a slot of level n spans TIMER_SLOTS^n ticks. Timers are
+// intrusive list nodes owned by the caller, so arm() and cancel() are O(1)
+// and never allocate. advance() walks the ticks that passed, moving the
+// timers of a higher level slot one level down whenever the lower wheel
+// wraps, and hands every due timer to the expire callback.
+
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_LEVELS 4 // with 100 ms ticks: 6.4 s, 6.8 min, 7.3 h, 19 days
+
+struct TimerNode
+{
+   TimerNode *prev = nullptr; // nullptr while not armed
+   TimerNode *next = nullptr;
+   uint64_t expires = 0; // tick
+   int descriptor = -1;  // for the expire callback
+   int reason = 0;       // for the expire callback
+};
+
+class TimerWheel
+{
+ public:
+   explicit TimerWheel(uint64_t tickNanos) : tick(tickNanos)
+   {
+      for (auto &level : slots)
+      {
+         for (TimerNode &head : level)
+         {
+            head.prev = head.next = &head;
+         }
+      }
+   }
+
+   TimerWheel(const TimerWheel &) = delete;
+   TimerWheel &operator=(const TimerWheel &) = delete;
+
+   // (re)arms node to expire timeout nanoseconds after now
+   void arm(TimerNode &node, uint64_t now, uint64_t timeout, int reason)
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (node.prev != nullptr)
+      {
+         unlink(node);
+      }
+      if (current == 0)
+      {
+         current = now / tick;
+      }
+      node.expires = (now + timeout + tick - 1) / tick;
+      node.reason = reason;
+      insert(node, current + 1);
+   }
+
+   void cancel(TimerNode &node)
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (node.prev != nullptr)
+      {
+         unlink(node);
+      }
+   }
+
+   // expire(node) runs with the wheel locked, the node is unlinked already
+   template <class Expire>
+   void advance(uint64_t now, Expire expire)
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      uint64_t target = now / tick;
+      if (current == 0)
+      {
+         current = target; // first call, nothing can be due yet
+      }
+      while (current < target)
+      {
+         current++;
+         // a wrapped wheel takes over the next slot of the one above
+         for (int level = 1; level < TIMER_LEVELS; level++)
+         {
+            if ((current & ((1ull << (TIMER_SLOT_BITS * level)) - 1)) != 0)
+            {
+               break;
+            }
+            TimerNode &head = slots[level][(current >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1)];
+            while (head.next != &head)
+            {
+               TimerNode &node = *head.next;
+               unlink(node);
+               insert(node, current); // this tick's slot is handled next
+            }
+         }
+         TimerNode &head = slots[0][current & (TIMER_SLOTS - 1)];
+         while (head.next != &head)
+         {
+            TimerNode &node = *head.next;
+            unlink(node);
+            expire(node);
+         }
+      }
+   }
+
+ private:
+   std::mutex mutex;
+   uint64_t tick;
+   uint64_t current = 0;
+   TimerNode slots[TIMER_LEVELS][TIMER_SLOTS];
+
+   void insert(TimerNode &node, uint64_t earliest)
+   {
+      uint64_t expires = node.expires > earliest ? node.expires : earliest;
+      uint64_t delta = expires - current;
+      int level = 0;
+      while (level + 1 < TIMER_LEVELS && delta >= (1ull << (TIMER_SLOT_BITS * (level + 1))))
+      {
+         level++;
+      }
+      if (delta >= (1ull << (TIMER_SLOT_BITS * TIMER_LEVELS)))
+      {
+         expires = current + (1ull << (TIMER_SLOT_BITS * TIMER_LEVELS)) - 1; // far future, clamped
+      }
+      TimerNode &head = slots[level][(expires >> (TIMER_SLOT_BITS * level)) & (TIMER_SLOTS - 1)];
+      node.prev = head.prev;
+      node.next = &head;
+      head.prev->next = &node;
+      head.prev = &node;
+   }
+
+   static void unlink(TimerNode &node)
+   {
+      node.prev->next = node.next;
+      node.next->prev = node.prev;
+      node.prev = node.next = nullptr;
+   }
+};
+
+#endif
@@ -0,0 +1,381 @@
+#ifndef TWMAILER_TLS_H
+#define TWMAILER_TLS_H
+
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <string>
+#include <vector>
+
+///////////////////////////////////////////////////////////////////////////////
+// TRANSPORT
+// Shared by client and server. All socket I/O goes through netSend() and
+// netRecv(); a descriptor with a TLS stream in tlsStreams is encrypted,
+// every other one stays plain TCP. TLS is optional and configured from the
+// environment:
+//    server: TWMAILER_TLS_CERT, TWMAILER_TLS_KEY (PEM files)
+//    client: TWMAILER_TLS=1 or TWMAILER_TLS_CA=<PEM file>,
+//            TWMAILER_TLS_INSECURE=1 skips the certificate check,
+//            TWMAILER_TLS_NAME=<host> is checked instead of the address,
+//            TWMAILER_TLS_SESSION=<file> keeps the last session ticket
+// The server hands out session tickets, so a client that kept one resumes
+// without a full handshake. Kernel TLS is requested on every stream: once
+// the handshake is done OpenSSL moves the record layer into the kernel when
+// it supports the cipher, and netSendfile() then stays zero-copy.
+// TWMAILER_TLS_KTLS=0 keeps it in user space, on either side.
+
+#define TLS_TICKETS 2 // session tickets sent after a full handshake
+
+// one slot per descriptor, set by the thread that owns the connection
+inline std::vector<SSL *> tlsStreams;
+
+inline void tlsInit(size_t descriptors)
+{
+   tlsStreams.assign(descriptors, nullptr);
+}
+
+inline SSL *tlsStream(int fd)
+{
+   return fd >= 0 && (size_t)fd < tlsStreams.size() ? tlsStreams[fd] : nullptr;
+}
+
+inline bool tlsKernelWanted()
+{
+   const char *kernel = getenv("TWMAILER_TLS_KTLS");
+   return kernel == NULL || strcmp(kernel, "0") != 0;
+}
+
+inline void tlsError(const char *what)
+{
+   char text[256];
+   unsigned long error = ERR_get_error();
+   ERR_error_string_n(error, text, sizeof(text));
+   fprintf(stderr, "%s: %s\n", what, error != 0 ? text : strerror(errno));
+   ERR_clear_error();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// SSL_ERROR_* to the send()/recv() convention: 0 on close, -1 and errno;
+// EAGAIN when a non-blocking socket has to wait, see netWaitsForInput()
+inline ssize_t tlsResult(SSL *ssl, int result, size_t done)
+{
+   if (result > 0)
+   {
+      return (ssize_t)done;
+   }
+   int error = SSL_get_error(ssl, result);
+   ERR_clear_error();
+   if (error == SSL_ERROR_ZERO_RETURN)
+   {
+      return 0;
+   }
+   if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+   {
+      errno = EAGAIN;
+      return -1;
+   }
+   if (error != SSL_ERROR_SYSCALL || errno == 0)
+   {
+      errno = EIO;
+   }
+   return -1;
+}
+
+inline ssize_t netSend(int fd, const void *data, size_t length)
+{
+   SSL *ssl = tlsStream(fd);
+   if (ssl == nullptr)
+   {
+      return send(fd, data, length, MSG_NOSIGNAL);
+   }
+   size_t written = 0;
+   int result = SSL_write_ex(ssl, data, length, &written);
+   return tlsResult(ssl, result, written);
+}
+
+inline ssize_t netRecv(int fd, void *data, size_t length)
+{
+   SSL *ssl = tlsStream(fd);
+   if (ssl == nullptr)
+   {
+      return recv(fd, data, length, 0);
+   }
+   size_t read = 0;
+   int result = SSL_read_ex(ssl, data, length, &read);
+   return tlsResult(ssl, result, read);
+}
+
+// after EAGAIN on a non-blocking socket: whether it has to become readable
+// (or else writable) first; a TLS stream may need the other direction than
+// the call that failed, to finish a handshake or key update
+inline bool netWaitsForInput(int fd, bool receiving)
+{
+   SSL *ssl = tlsStream(fd);
+   if (ssl == nullptr)
+   {
+      return receiving;
+   }
+   return SSL_want_read(ssl) ? true : SSL_want_write(ssl) ? false : receiving;
+}
+
+// decrypted bytes waiting in the stream, epoll does not see them
+inline bool netPending(int fd)
+{
+   SSL *ssl = tlsStream(fd);
+   return ssl != nullptr && SSL_pending(ssl) > 0;
+}
+
+// file bytes to the socket without a copy through user space, plain TCP or
+// kernel TLS; userspace TLS reads and encrypts them in pieces
+inline ssize_t netSendfile(int fd, int file, off_t offset, size_t length)
+{
+   SSL *ssl = tlsStream(fd);
+   if (ssl == nullptr)
+   {
+      return sendfile(fd, file, &offset, length);
+   }
+   if (BIO_get_ktls_send(SSL_get_wbio(ssl)))
+   {
+      ossl_ssize_t sent = SSL_sendfile(ssl, file, offset, length, 0);
+      return sent < 0 ? tlsResult(ssl, (int)sent, 0) : (ssize_t)sent;
+   }
+   char piece[16384]; // one TLS record
+   ssize_t size = pread(file, piece, length < sizeof(piece) ? length : sizeof(piece), offset);
+   return size <= 0 ? size : netSend(fd, piece, size);
+}
+
+// a TCP connection to "<host>:<port>", -1 when no address answers
+inline int netConnect(const std::string &target)
+{
+   size_t colon = target.rfind(':');
+   if (colon == std::string::npos)
+   {
+      errno = EINVAL;
+      return -1;
+   }
+   std::string host = target.substr(0, colon);
+   std::string port = target.substr(colon + 1);
+   struct addrinfo hints = {};
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   struct addrinfo *addresses = NULL;
+   if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0)
+   {
+      errno = EHOSTUNREACH;
+      return -1;
+   }
+   int descriptor = -1;
+   for (struct addrinfo *address = addresses; address != NULL && descriptor == -1; address = address->ai_next)
+   {
+      descriptor = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+      if (descriptor != -1 && connect(descriptor, address->ai_addr, address->ai_addrlen) != 0)
+      {
+         close(descriptor);
+         descriptor = -1;
+      }
+   }
+   freeaddrinfo(addresses);
+   if (descriptor != -1)
+   {
+      int enable = 1;
+      setsockopt(descriptor, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+   }
+   return descriptor;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+inline SSL_CTX *tlsServerContext()
+{
+   const char *certificate = getenv("TWMAILER_TLS_CERT");
+   const char *key = getenv("TWMAILER_TLS_KEY");
+   if (certificate == NULL)
+   {
+      return nullptr;
+   }
+   SSL_CTX *context = SSL_CTX_new(TLS_server_method());
+   if (context == nullptr)
+   {
+      tlsError("TLS context");
+      return nullptr;
+   }
+   SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+   if (tlsKernelWanted())
+   {
+      SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS);
+   }
+   SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_SERVER);
+   SSL_CTX_set_num_tickets(context, TLS_TICKETS);
+   if (SSL_CTX_use_certificate_chain_file(context, certificate) != 1
+       || SSL_CTX_use_PrivateKey_file(context, key != NULL ? key : certificate, SSL_FILETYPE_PEM) != 1
+       || SSL_CTX_check_private_key(context) != 1)
+   {
+      tlsError(certificate);
+      SSL_CTX_free(context);
+      return nullptr;
+   }
+   return context;
+}
+
+// the server side of the handshake: 1 once it is done, -1 when it failed;
+// 0 when a non-blocking socket has to wait (see netWaitsForInput()), call
+// again after that
+inline int tlsAccept(SSL_CTX *context, int fd)
+{
+   SSL *ssl = tlsStream(fd);
+   if (ssl == nullptr)
+   {
+      ssl = SSL_new(context);
+      if (ssl == nullptr || SSL_set_fd(ssl, fd) != 1)
+      {
+         ERR_clear_error();
+         SSL_free(ssl);
+         return -1;
+      }
+      tlsStreams[fd] = ssl;
+   }
+   int result = SSL_accept(ssl);
+   if (result == 1)
+   {
+      return 1;
+   }
+   int error = SSL_get_error(ssl, result);
+   ERR_clear_error();
+   if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE)
+   {
+      return 0;
+   }
+   SSL_free(ssl);
+   tlsStreams[fd] = nullptr;
+   return -1;
+}
+
+// sends close_notify and forgets the stream, the socket stays open
+inline void tlsClose(int fd)
+{
+   SSL *ssl = tlsStream(fd);
+   if (ssl != nullptr)
+   {
+      SSL_shutdown(ssl);
+      ERR_clear_error();
+      SSL_free(ssl);
+      tlsStreams[fd] = nullptr;
+   }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+
+// new tickets arrive after the handshake, each one replaces the saved one
+inline int tlsSaveSession(SSL *, SSL_SESSION *session)
+{
+   const char *filename = getenv("TWMAILER_TLS_SESSION");
+   FILE *file = filename != NULL ? fopen(filename, "w") : NULL;
+   if (file != NULL)
+   {
+      PEM_write_SSL_SESSION(file, session);
+      fclose(file);
+   }
+   return 0; // not kept, the caller frees it
+}
+
+inline bool tlsRequested()
+{
+   const char *enabled = getenv("TWMAILER_TLS");
+   return (enabled != NULL && strcmp(enabled, "1") == 0) || getenv("TWMAILER_TLS_CA") != NULL;
+}
+
+inline SSL_CTX *tlsClientContext()
+{
+   const char *authority = getenv("TWMAILER_TLS_CA");
+   const char *insecure = getenv("TWMAILER_TLS_INSECURE");
+   SSL_CTX *context = SSL_CTX_new(TLS_client_method());
+   if (context == nullptr)
+   {
+      tlsError("TLS context");
+      return nullptr;
+   }
+   SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+   if (tlsKernelWanted())
+   {
+      SSL_CTX_set_options(context, SSL_OP_ENABLE_KTLS);
+   }
+   SSL_CTX_set_session_cache_mode(context, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+   SSL_CTX_sess_set_new_cb(context, tlsSaveSession);
+   if (insecure != NULL && strcmp(insecure, "1") == 0)
+   {
+      SSL_CTX_set_verify(context, SSL_VERIFY_NONE, NULL);
+   }
+   else
+   {
+      SSL_CTX_set_verify(context, SSL_VERIFY_PEER, NULL);
+      if ((authority != NULL ? SSL_CTX_load_verify_locations(context, authority, NULL)
+                             : SSL_CTX_set_default_verify_paths(context)) != 1)
+      {
+         tlsError(authority != NULL ? authority : "TLS trust store");
+         SSL_CTX_free(context);
+         return nullptr;
+      }
+   }
+   return context;
+}
+
+// resumes the saved session when there is one, returns false on failure.
+// The certificate has to name the server address (or host name when one is
+// given), or TWMAILER_TLS_NAME.
+inline bool tlsConnect(SSL_CTX *context, int fd, const char *address)
+{
+   SSL *ssl = SSL_new(context);
+   if (ssl == nullptr || SSL_set_fd(ssl, fd) != 1)
+   {
+      tlsError("TLS");
+      SSL_free(ssl);
+      return false;
+   }
+   const char *name = getenv("TWMAILER_TLS_NAME");
+   if (name != NULL)
+   {
+      SSL_set_tlsext_host_name(ssl, name);
+      SSL_set1_host(ssl, name);
+   }
+   else if (X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), address) != 1)
+   {
+      ERR_clear_error();
+      SSL_set_tlsext_host_name(ssl, address);
+      SSL_set1_host(ssl, address);
+   }
+   const char *filename = getenv("TWMAILER_TLS_SESSION");
+   FILE *file = filename != NULL ? fopen(filename, "r") : NULL;
+   if (file != NULL)
+   {
+      SSL_SESSION *session = PEM_read_SSL_SESSION(file, NULL, NULL, NULL);
+      fclose(file);
+      if (session != nullptr)
+      {
+         SSL_set_session(ssl, session);
+         SSL_SESSION_free(session);
+      }
+      ERR_clear_error();
+   }
+   if (SSL_connect(ssl) != 1)
+   {
+      tlsError("TLS handshake");
+      SSL_free(ssl);
+      return false;
+   }
+   tlsStreams.resize(fd + 1 > (int)tlsStreams.size() ? fd + 1 : tlsStreams.size(), nullptr);
+   tlsStreams[fd] = ssl;
+   return true;
+}
+
+#endif
@@ -0,0 +1,129 @@
+#ifndef TWMAILER_TRACE_H
+#define TWMAILER_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include "twmailer-stats.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// REQUEST TRACING
+// Spans are recorded into a ring owned by the recording thread, so the only
+// cost on the request path is two clock reads and a store. The rings are
+// exported as Chrome trace JSON (chrome://tracing, ui.perfetto.dev).
+// Tracing is off unless traceEnabled is set (env TWMAILER_TRACE_FILE).
+
+#define TRACE_EVENTS 65536 // per thread, oldest spans are overwritten
+
+struct TraceEvent
+{
+   const char *name; // must be a string literal
+   uint64_t start;
+   uint64_t duration;
+   uint64_t request;
+};
+
+struct TraceBuffer
+{
+   std::vector<TraceEvent> events;
+   uint64_t recorded = 0;
+   long thread = 0;
+};
+
+inline std::atomic<int> traceEnabled{0};
+inline std::atomic<uint64_t> traceRequests{0};
+inline std::mutex traceRegistryMutex;
+inline std::vector<TraceBuffer *> traceRegistry;
+inline thread_local TraceBuffer *traceLocal = NULL;
+inline thread_local uint64_t traceRequest = 0; // id of the running request
+
+///////////////////////////////////////////////////////////////////////////////
+
+inline void traceRecord(const char *name, uint64_t start, uint64_t end)
+{
+   if (traceLocal == NULL)
+   {
+      // first span of this thread, the buffer lives until the process exits
+      traceLocal = new TraceBuffer();
+      traceLocal->events.resize(TRACE_EVENTS);
+      traceLocal->thread = syscall(SYS_gettid);
+      std::lock_guard<std::mutex> lock(traceRegistryMutex);
+      traceRegistry.push_back(traceLocal);
+   }
+   TraceEvent &event = traceLocal->events[traceLocal->recorded % TRACE_EVENTS];
+   event.name = name;
+   event.start = start;
+   event.duration = end - start;
+   event.request = traceRequest;
+   traceLocal->recorded++;
+}
+
+// starts a new request id for the calling thread
+inline void traceBeginRequest()
+{
+   if (traceEnabled.load(std::memory_order_relaxed))
+   {
+      traceRequest = traceRequests.fetch_add(1, std::memory_order_relaxed) + 1;
+   }
+}
+
+struct TraceSpan
+{
+   const char *name;
+   uint64_t started;
+
+   explicit TraceSpan(const char *spanName)
+      : name(spanName), started(traceEnabled.load(std::memory_order_relaxed) ? monotonicNanos() : 0)
+   {
+   }
+
+   ~TraceSpan()
+   {
+      if (started != 0)
+      {
+         traceRecord(name, started, monotonicNanos());
+      }
+   }
+};
+
+///////////////////////////////////////////////////////////////////////////////
+
+// writes every buffered span, call once the recording threads are idle
+inline int traceExport(const char *filename)
+{
+   FILE *file = fopen(filename, "w");
+   if (file == NULL)
+   {
+      return -1;
+   }
+   long pid = (long)getpid();
+   int first = 1;
+   fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", file);
+   std::lock_guard<std::mutex> lock(traceRegistryMutex);
+   for (TraceBuffer *buffer : traceRegistry)
+   {
+      uint64_t begin = buffer->recorded > TRACE_EVENTS ? buffer->recorded - TRACE_EVENTS : 0;
+      for (uint64_t i = begin; i < buffer->recorded; i++)
+      {
+         const TraceEvent &event = buffer->events[i % TRACE_EVENTS];
+         fprintf(file,
+                 "%s{\"name\":\"%s\",\"cat\":\"twmailer\",\"ph\":\"X\",\"ts\":%llu.%03llu,"
+                 "\"dur\":%llu.%03llu,\"pid\":%ld,\"tid\":%ld,\"args\":{\"request\":%llu}}",
+                 first ? "" : ",\n",
+                 event.name,
+                 (unsigned long long)(event.start / 1000), (unsigned long long)(event.start % 1000),
+                 (unsigned long long)(event.duration / 1000), (unsigned long long)(event.duration % 1000),
+                 pid, buffer->thread,
+                 (unsigned long long)event.request);
+         first = 0;
+      }
+   }
+   fputs("\n]}\n", file);
+   return fclose(file);
+}
+
+#endif